@@ -0,0 +1,88 @@
+//
+// Gesture matching by dynamic time warping
+//
+// Every frame pushed into a stream is the newest sample of a window that
+// is compared against each template with DTW constrained to a Sakoe-Chiba
+// band. LB_Keogh, a lower bound of that distance computed against the
+// template's envelope in linear time, rules out most templates before any
+// DTW runs. Both inner loops have AVX2 versions picked at runtime.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include "motion_input.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Acceleration x, y, z followed by MotionPlus yaw, roll, pitch
+#define GESTURE_CHANNELS (6)
+#define GESTURE_ACCEL_CHANNELS (3)
+// Gyro rates are scaled so 180 degrees per second weigh as much as 1 g
+#define GESTURE_GYRO_SCALE (1.0f / 180.0f)
+// Half width of the warping band, in percent of the template length
+#define GESTURE_BAND_PERCENT (10)
+
+typedef struct gesture_template {
+    int id;
+    int len;
+    // GESTURE_ACCEL_CHANNELS or GESTURE_CHANNELS
+    int channels;
+    int band;
+    // Largest DTW distance that still matches: the threshold per frame
+    // times the length
+    float cutoff;
+
+    // Samples and their envelope over the band, one row per channel
+    float t[GESTURE_CHANNELS][MOTION_GESTURE_MAX_LEN];
+    float upper[GESTURE_CHANNELS][MOTION_GESTURE_MAX_LEN];
+    float lower[GESTURE_CHANNELS][MOTION_GESTURE_MAX_LEN];
+} gesture_template_t;
+
+// `samples` holds `len` frames of `channels` values each, gyro rates in
+// degrees per second. Returns nonzero if the template is invalid.
+int gesture_template_init(gesture_template_t *t, int id, float const *samples, int len, int channels, float threshold);
+
+typedef struct gesture_candidate {
+    // Lowest distance since it last dropped below the cutoff, or INFINITY
+    float best;
+    // Frames until the template may match again
+    int refractory;
+} gesture_candidate_t;
+
+typedef struct gesture_stream {
+    // The latest frames, one row per channel. Every frame is stored at
+    // `pos` and again at `pos + MOTION_GESTURE_MAX_LEN`, so the window
+    // ending at the newest frame is contiguous.
+    float hist[GESTURE_CHANNELS][2 * MOTION_GESTURE_MAX_LEN];
+    int pos;
+    // Frames pushed, up to MOTION_GESTURE_MAX_LEN
+    int count;
+
+    gesture_candidate_t cand[MOTION_GESTURE_MAX_TEMPLATES];
+
+    // Windows checked, and how many of them LB_Keogh ruled out; read by
+    // motion_get_stats on any thread
+    uint64_t windows, pruned;
+} gesture_stream_t;
+
+void gesture_stream_init(gesture_stream_t *s);
+
+// Appends a frame of GESTURE_CHANNELS values and matches every template
+// against the frames ending at it; templates using the gyro are skipped
+// unless `has_gyro` is set. A template is reported once its distance
+// stops falling, at most once per half its length.
+// Writes the matches to `out`, which needs room for `count` of them, and
+// returns how many there are.
+int gesture_stream_push(
+        gesture_stream_t *s,
+        float const *frame, int has_gyro,
+        gesture_template_t const *templates, int count,
+        motion_gesture_t *out);
+
+#ifdef __cplusplus
+}
+#endif
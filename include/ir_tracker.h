@@ -0,0 +1,98 @@
+//
+// Sensor bar tracking from the IR camera's dots
+//
+// Dots are matched to the tracks of the previous report by nearest
+// neighbour around where each track was heading, so they keep their
+// identity while moving. Among the tracks the pair most likely to be the
+// sensor bar's two LED clusters is picked, preferring the pair of the
+// previous report; the rest, reflections and lamps, are ignored. With one
+// cluster out of view the other is put where the last pair had it. The
+// pointer, distance and roll follow from that pair and are smoothed with
+// a 1 euro filter.
+//
+// Everything works on at most IR_MAX_TRACKS tracks, so a report costs
+// the same however many dots come and go.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include "motion_input.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Dots the camera reports
+#define IR_MAX_DOTS (4)
+// Dots still remembered after they disappeared, plus the visible ones
+#define IR_MAX_TRACKS (8)
+
+// Camera resolution; x grows to the right and y upwards, seen from behind
+// the Wiimote
+#define IR_CAMERA_WIDTH (1024)
+#define IR_CAMERA_HEIGHT (768)
+// Horizontal field of view of the camera, in radians
+#define IR_CAMERA_FOV (0.576f)
+// Distance between the two LED clusters of a sensor bar, in meters
+#define IR_BAR_WIDTH (0.20f)
+
+typedef struct ir_dot {
+    float x, y;
+    // 0 to 15, or -1 in the basic format which doesn't report it
+    int size;
+} ir_dot_t;
+
+// Decode the 10 byte basic or 12 byte extended format into `dots`, which
+// needs room for IR_MAX_DOTS of them, skipping empty slots. Return how
+// many dots there are.
+int ir_decode_basic(uint8_t const *data, ir_dot_t *dots);
+int ir_decode_extended(uint8_t const *data, ir_dot_t *dots);
+
+typedef struct ir_track {
+    int id;
+    float x, y;
+    // Pixels per report
+    float vx, vy;
+    int size;
+    // Reports since the dot was last seen
+    int missed;
+} ir_track_t;
+
+typedef struct ir_tracker {
+    ir_track_t tracks[IR_MAX_TRACKS];
+    int num_tracks;
+    int next_id;
+
+    // Tracks of the left and right cluster, or -1
+    int left, right;
+    // Right cluster minus left cluster, in pixels, as last seen together,
+    // and the roll of the last pose
+    float sep_x, sep_y;
+    float roll;
+    // Reports the pair has been extrapolated from one cluster, and since
+    // the bar was last seen, counting up to a few seconds
+    int extrapolated;
+    int lost;
+    // Tracks of the best other pair, and how many reports in a row it was
+    int cand_left, cand_right;
+    int confirmed;
+
+    // 1 euro filter state of x, y, distance and roll
+    float smooth[4], speed[4];
+    int primed;
+
+    // Dots that were neither cluster of the pair
+    unsigned long outliers;
+} ir_tracker_t;
+
+void ir_tracker_init(ir_tracker_t *t);
+
+// Feeds the dots of one report. Returns nonzero and sets every field of
+// `out` but `visible` if the sensor bar is in view.
+int ir_tracker_update(ir_tracker_t *t, ir_dot_t const *dots, int count, motion_pointer_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,13 +1,36 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "wiimote_hw.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Keep looking for new devices and reconnect lost ones on a background
+// thread after motion_init returned
+#define MOTION_INPUT_FLAG_HOTPLUG (1 << 0)
+
 typedef struct motion_input_config {
+    // MOTION_INPUT_FLAG_*
     int flags;
+    // Maximum number of output reports per second sent to a single
+    // device; zero selects the default of 100.
+    int max_output_rate;
+    // File remembering the addresses of known Wiimotes, or NULL. They are
+    // all paged at once on startup, for under a second. If fewer than
+    // `max_players` answer, an inquiry looks for the rest: in the
+    // background with MOTION_INPUT_FLAG_HOTPLUG once at least one did,
+    // otherwise before motion_init returns.
+    char const *device_cache_path;
+    // Number of Wiimotes expected; zero selects the default of 4
+    int max_players;
+    // File remembering the accelerometer calibration and extension of
+    // every Wiimote seen, or NULL. A known Wiimote reports calibrated data
+    // as soon as it connects, while both are read again in the
+    // background and the file is updated if they changed.
+    char const *calibration_cache_path;
 } motion_input_config_t;
 
 int motion_init(motion_input_config_t const* cfg);
@@ -19,6 +42,17 @@ typedef enum motion_event_kind {
     MI_EV_DISCONNECTED,
     MI_EV_BUTTON,
     MI_EV_ACCEL,
+    MI_EV_NUNCHUK,
+    MI_EV_GYRO,
+    MI_EV_STATUS,
+    MI_EV_GESTURE,
+    // motion_event_t::accel after the filter stages set with
+    // motion_set_accel_filter
+    MI_EV_ACCEL_FILTERED,
+    // motion_event_t::accel resampled to the rate set with
+    // motion_set_uniform_rate
+    MI_EV_ACCEL_UNIFORM,
+    MI_EV_POINTER,
     MI_EV_MAX
 } motion_event_kind_t;
 
@@ -34,6 +68,9 @@ typedef enum motion_button {
     MB_A,
     MB_MINUS,
     MB_HOME,
+    // Nunchuk buttons
+    MB_C,
+    MB_Z,
     MB_MAX
 } motion_button_t;
 
@@ -46,19 +83,313 @@ typedef struct motion_accel {
     float x, y, z;
 } motion_accel_t;
 
+typedef struct motion_nunchuk {
+    // Stick position, roughly in [-1, 1]
+    float stick_x, stick_y;
+    motion_accel_t accel;
+} motion_nunchuk_t;
+
+// Angular velocities reported by the MotionPlus, in degrees per second
+typedef struct motion_gyro {
+    float yaw, roll, pitch;
+} motion_gyro_t;
+
+// Sent after MI_EV_CONNECTED, when an extension is plugged in or removed
+// and on a periodic battery poll
+typedef struct motion_status {
+    // Battery charge in [0, 1]
+    float battery;
+    int battery_low;
+    int extension_connected;
+    // LEDs lit, as passed to motion_set_leds
+    unsigned leds;
+} motion_status_t;
+
+// A motion matched a template added with motion_gesture_add
+typedef struct motion_gesture {
+    int id;
+    // 1 for a perfect match, falling to 0 at the template's threshold
+    float confidence;
+} motion_gesture_t;
+
+// Where the Wiimote points, from the sensor bar seen by its camera. Sent
+// with every IR report while the bar is in view, and once with `visible`
+// cleared when it is lost.
+typedef struct motion_pointer {
+    // Position of the bar's center in the camera's view, rotated upright;
+    // -1 to 1 from left to right and top to bottom at the view's edges
+    float x, y;
+    // Distance to the sensor bar, in meters
+    float distance;
+    // Rotation around the pointing axis, in radians, positive clockwise
+    float roll;
+    int visible;
+} motion_pointer_t;
+
 typedef struct motion_event {
     motion_event_kind_t kind;
+    // Device the event came from; same numbering as motion_set_leds
+    int player;
+    // Time the packet carrying this event was received, in microseconds
+    // on the monotonic clock. For MI_EV_ACCEL_UNIFORM, the estimated
+    // time the sample was taken instead, exactly one output period apart.
+    uint64_t timestamp;
 
     union {
         motion_button_press_t btn;
         motion_accel_t accel;
+        motion_nunchuk_t nunchuk;
+        motion_gyro_t gyro;
+        motion_status_t status;
+        motion_gesture_t gesture;
+        motion_pointer_t pointer;
     };
 } motion_event_t;
 
 int motion_poll(motion_event_t *ev);
 
+// File descriptor that polls readable when a device sent something or the
+// set of devices changed, for integrating motion_poll into an event loop.
+// Only valid between motion_init and motion_shutdown.
+int motion_get_fd();
+
+// Milliseconds until motion_poll needs to be called even if motion_get_fd
+// stays quiet, e.g. to pace queued output reports; -1 if there's no such
+// deadline and zero if events are pending already.
+int motion_get_timeout();
+
+// Blocks until motion_poll has something to do or `timeout_ms` passed;
+// -1 waits indefinitely. Returns nonzero if woken by activity.
+int motion_wait(int timeout_ms);
+
 void motion_set_leds(int iPlayer, unsigned mask);
 
+#define MOTION_RUMBLE_MAX_STEPS (32)
+// Strengths between off and full are rendered by switching the motor on
+// for that fraction of every period, in milliseconds
+#define MOTION_RUMBLE_PWM_PERIOD (20)
+
+typedef struct motion_rumble_step {
+    // Motor strength in [0, 1]
+    float level;
+    unsigned duration_ms;
+} motion_rumble_step_t;
+
+// Plays a rumble pattern of up to MOTION_RUMBLE_MAX_STEPS steps, replacing
+// whatever the device was playing; `repeat` loops it until replaced. A
+// `count` of zero stops the motor. Timing is accurate to a millisecond as
+// long as motion_poll is called when motion_get_timeout asks for it, and
+// the motor switching counts against max_output_rate: at the default of
+// 100, a PWM edge can be late by up to 10 ms.
+int motion_rumble(int iPlayer, motion_rumble_step_t const *steps, int count, int repeat);
+
+// Rate the speaker plays at; motion_speaker_play resamples to it
+#define MOTION_SPEAKER_RATE (3000)
+
+// Powers the speaker up at `volume` in [0, 1], or mutes and powers it down
+// when `volume` is zero, discarding any queued audio.
+// Audio is encoded to 4-bit ADPCM and streamed by a background thread at
+// exactly the rate the speaker plays it. Speaker reports don't count
+// against max_output_rate.
+int motion_speaker_enable(int iPlayer, float volume);
+
+// Queues mono 16-bit PCM sampled at `sample_rate` Hz. Returns how many
+// samples were taken, fewer than `count` when the buffer (a bit over two
+// seconds) is full; pass the rest again later. Returns -1 if the speaker
+// isn't enabled, e.g. because the device reconnected since.
+int motion_speaker_play(int iPlayer, int16_t const *pcm, int count, int sample_rate);
+
+#define MOTION_GESTURE_MAX_TEMPLATES (32)
+// Frames per template
+#define MOTION_GESTURE_MAX_LEN (128)
+
+// Adds a template to the gestures matched on every device. `samples`
+// holds `len` frames of `channels` values, recorded at the report rate
+// (about 100 Hz): the acceleration x, y, z as in MI_EV_ACCEL and, with six
+// channels, the MotionPlus yaw, roll and pitch as in MI_EV_GYRO.
+// Six-channel templates only match devices with an active MotionPlus.
+// `threshold` is the largest mean squared distance per frame that still
+// matches, in g squared; 180 degrees per second count as 1 g.
+// Matching runs on the accelerometer stream, so someone needs to
+// subscribe to MOTION_STREAM_ACCEL, and to MOTION_STREAM_EXTENSION for
+// the gyro. Each match is reported as MI_EV_GESTURE carrying `id`.
+// Returns nonzero if the template is invalid or there are
+// MOTION_GESTURE_MAX_TEMPLATES already.
+int motion_gesture_add(int id, float const *samples, int len, int channels, float threshold);
+void motion_gesture_clear();
+
+typedef enum motion_filter_kind {
+    // Biquads; `cutoff_hz` and `q`
+    MOTION_FILTER_LOWPASS = 0,
+    MOTION_FILTER_HIGHPASS,
+    // Subtracts the output of a low-pass at `cutoff_hz`, leaving the
+    // acceleration without gravity
+    MOTION_FILTER_GRAVITY,
+    // One euro filter: a low-pass at `cutoff_hz` while still, opening up
+    // by `beta` per g per second of speed
+    MOTION_FILTER_ONE_EURO,
+} motion_filter_kind_t;
+
+typedef struct motion_filter {
+    motion_filter_kind_t kind;
+    float cutoff_hz;
+    // Biquad quality; zero selects 0.7071, the flattest passband
+    float q;
+    float beta;
+} motion_filter_t;
+
+#define MOTION_FILTER_MAX_STAGES (4)
+// Report rate the filter coefficients are computed for
+#define MOTION_FILTER_RATE (100)
+
+// Sets the stages, applied in order, that turn every device's
+// MI_EV_ACCEL into MI_EV_ACCEL_FILTERED, replacing the previous ones; no
+// stages pass the acceleration through unchanged. Filter state starts
+// over from the next sample. Every device has state of its own and is
+// filtered as its report is decoded, with no added latency and no limit
+// on the number of players. Returns nonzero if a stage is invalid.
+int motion_set_accel_filter(motion_filter_t const *stages, int count);
+
+#define MOTION_UNIFORM_MAX_RATE (1000)
+
+// Reports MI_EV_ACCEL_UNIFORM at `rate` Hz alongside MI_EV_ACCEL, or
+// stops when `rate` is zero. The remote's sample clock is estimated from
+// the receive times; each output is interpolated from the reports around
+// its sample time once a jitter buffer's delay passed. The delay adapts to
+// the delivery jitter seen recently; see motion_device_stats_t.
+// Returns nonzero if `rate` is out of range.
+int motion_set_uniform_rate(int rate);
+
+typedef struct motion_prediction {
+    motion_accel_t accel;
+    // Valid if has_gyro is set, i.e. a MotionPlus is active
+    motion_gyro_t gyro;
+    int has_gyro;
+} motion_prediction_t;
+
+// Extrapolates a device's acceleration and MotionPlus rates to
+// `timestamp`, in microseconds on the same clock as
+// motion_event_t::timestamp, e.g. the time the next frame is displayed.
+// Each channel follows a constant-acceleration model fitted to the
+// samples as they arrive; extrapolation stops 100 ms past the newest.
+// Safe to call from any thread, as often as needed; it never waits for
+// the polling thread. Returns nonzero if no sample arrived yet.
+int motion_predict(int iPlayer, uint64_t timestamp, motion_prediction_t *out);
+
+#define MOTION_STREAM_BUTTONS   (1 << 0)
+#define MOTION_STREAM_ACCEL     (1 << 1)
+// MI_EV_POINTER
+#define MOTION_STREAM_IR        (1 << 2)
+// Nunchuk and MotionPlus data
+#define MOTION_STREAM_EXTENSION (1 << 3)
+// MI_EV_ACCEL_FILTERED. Unless MOTION_STREAM_ACCEL is subscribed to as
+// well, MI_EV_ACCEL is no longer reported.
+#define MOTION_STREAM_ACCEL_FILTERED (1 << 4)
+// Reported when nobody subscribed to anything
+#define MOTION_STREAM_DEFAULT \
+    (MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL | MOTION_STREAM_EXTENSION)
+
+// Declare interest in a set of streams (MOTION_STREAM_*).
+// Subscriptions are counted per stream; every device is switched to the
+// smallest report mode that carries all streams someone is subscribed to.
+// Buttons are part of every report mode.
+void motion_subscribe(unsigned streams);
+void motion_unsubscribe(unsigned streams);
+
+typedef struct motion_output_stats {
+    // Number of output reports waiting to be sent
+    unsigned queue_depth;
+    unsigned peak_queue_depth;
+    // Number of output reports written to the device
+    unsigned long sent;
+    // Number of output reports merged into a pending report of the same kind
+    unsigned long coalesced;
+} motion_output_stats_t;
+
+int motion_get_output_stats(int iPlayer, motion_output_stats_t *stats);
+
+// Input reports 0x20 to 0x3F
+#define MOTION_STATS_NUM_REPORT_CODES (32)
+#define MOTION_STATS_FIRST_REPORT_CODE (0x20)
+// Bucket 0 counts packets decoded in less than 256 ns, bucket i > 0 those
+// that took [128 << i, 256 << i) ns; the last bucket also counts
+// everything slower
+#define MOTION_STATS_NUM_DECODE_BUCKETS (12)
+
+typedef struct motion_device_stats {
+    int player;
+    int connected;
+
+    // Indexed by report code minus MOTION_STATS_FIRST_REPORT_CODE
+    unsigned long packets[MOTION_STATS_NUM_REPORT_CODES];
+    unsigned long long bytes;
+    // Packets that were received but not decoded
+    unsigned long unhandled_packets;
+    // Extensions whose signature matched no known kind, and memory reads
+    // the Wiimote answered with an error
+    unsigned long unknown_extensions;
+    unsigned long failed_reads;
+    unsigned long decode_time[MOTION_STATS_NUM_DECODE_BUCKETS];
+
+    unsigned long events_emitted;
+    // Events overwritten because nobody polled them in time
+    unsigned long events_dropped;
+
+    unsigned long disconnects;
+    // Connections the discovery thread restored after a disconnect
+    unsigned long reconnects;
+
+    motion_output_stats_t output;
+
+    // Microseconds since the last packet arrived, or UINT64_MAX if none
+    // ever did
+    uint64_t micros_since_last_packet;
+
+    // Uniform-rate stage, while motion_set_uniform_rate is on: the
+    // remote's estimated report interval in nanoseconds, the recent
+    // delivery jitter and the jitter buffer delay in microseconds, and
+    // outputs that had to repeat the newest report because it was late
+    unsigned report_interval;
+    unsigned uniform_jitter;
+    unsigned uniform_delay;
+    unsigned long uniform_underruns;
+
+    // IR dots ignored as neither cluster of the sensor bar
+    unsigned long ir_outliers;
+
+    // Windows of recent motion compared against a gesture template, and
+    // those of them LB_Keogh ruled out without running DTW
+    unsigned long long gesture_windows;
+    unsigned long long gesture_pruned;
+
+    // Root mean square difference between each arriving acceleration and
+    // what motion_predict said it would be, over the last few hundred
+    // samples in thousandths of a g; and the same for simply holding the
+    // previous sample, for comparison
+    unsigned predict_error;
+    unsigned hold_error;
+} motion_device_stats_t;
+
+typedef struct motion_stats {
+    int num_devices;
+
+    // Sums over all devices
+    unsigned long long packets;
+    unsigned long long bytes;
+    unsigned long long unhandled_packets;
+    unsigned long long events_emitted;
+    unsigned long long events_dropped;
+
+    // Inquiries for new devices the discovery thread failed to run
+    unsigned long failed_inquiries;
+} motion_stats_t;
+
+// Takes a snapshot of the runtime counters. The counters are always on;
+// this may be called from any thread while another one polls.
+// `devices` (may be NULL) receives the stats of the first `max_devices`
+// devices. Returns the number of entries written to it.
+int motion_get_stats(motion_stats_t *stats, motion_device_stats_t *devices, int max_devices);
+
 #ifdef __cplusplus
 }
 #endif
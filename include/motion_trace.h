@@ -0,0 +1,39 @@
+//
+// Compile-time gated trace points
+//
+// Build with MOTION_TRACE defined to record trace points into a per-thread
+// ring buffer that can be dumped as Chrome trace-event JSON and loaded into
+// Perfetto or chrome://tracing. Without it the macros expand to nothing.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// `name` must be a string literal or otherwise outlive the trace
+void motion_trace_event(char const *name, char phase, int64_t arg);
+
+// Writes every event still in the rings to `path`.
+// Returns zero on success, nonzero if the file couldn't be written, with
+// errno telling why, or if tracing was compiled out.
+int motion_trace_dump(char const *path);
+
+#ifdef MOTION_TRACE
+#define MOTION_TRACE_BEGIN(name)            motion_trace_event((name), 'B', 0)
+#define MOTION_TRACE_END(name)              motion_trace_event((name), 'E', 0)
+#define MOTION_TRACE_INSTANT(name, arg)     motion_trace_event((name), 'i', (arg))
+#define MOTION_TRACE_COUNTER(name, value)   motion_trace_event((name), 'C', (value))
+#else
+#define MOTION_TRACE_BEGIN(name)            ((void)0)
+#define MOTION_TRACE_END(name)              ((void)0)
+#define MOTION_TRACE_INSTANT(name, arg)     ((void)0)
+#define MOTION_TRACE_COUNTER(name, value)   ((void)0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
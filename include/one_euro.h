@@ -0,0 +1,40 @@
+//
+// 1 euro filter (Casiez, Roussel and Vogel, CHI 2012)
+//
+// A one-pole low-pass whose cutoff rises with the signal's speed: still
+// signals are smoothed hard, fast ones follow with little lag. Shared by
+// the MI_EV_ACCEL_FILTERED stage and the IR tracker's pose. Inline, so
+// loops over several channels stay vectorisable.
+//
+
+#pragma once
+
+#include <math.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Smoothing factor of the speed for a signal sampled at `rate` Hz; the
+// speed is smoothed at a fixed 1 Hz, as in the paper
+static inline float one_euro_d_alpha(float rate) {
+    return 1.0f / (1.0f + rate / (2.0f * (float)M_PI));
+}
+
+// Moves the filtered `*value` by `delta`, the new sample minus `*value`,
+// and updates its smoothed speed `*speed`. The cutoff is `min_cutoff` Hz
+// at rest and rises by `beta` per unit of speed per second. Taking the
+// difference lets angles pass it wrapped.
+static inline void one_euro_step(
+        float *value, float *speed, float delta,
+        float rate, float min_cutoff, float beta, float d_alpha) {
+    float s = *speed + d_alpha * (delta * rate - *speed);
+    float cutoff = min_cutoff + beta * fabsf(s);
+    float alpha = 1.0f / (1.0f + rate / (2.0f * (float)M_PI * cutoff));
+    *value += alpha * delta;
+    *speed = s;
+}
+
+#ifdef __cplusplus
+}
+#endif
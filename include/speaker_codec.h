@@ -0,0 +1,64 @@
+//
+// Audio conversion for the Wiimote speaker
+//
+// Resamples 16-bit PCM to the speaker's rate and encodes it to the 4-bit
+// Yamaha ADPCM the speaker plays, two samples per byte, high nibble first.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Zero crossings of the interpolation kernel on each side, at the lower
+// of the two rates
+#define SPEAKER_KERNEL_ZEROS (8)
+#define SPEAKER_MAX_INPUT_RATE (192000)
+// Input samples processed at a time
+#define SPEAKER_RESAMPLE_CHUNK (1024)
+// Covers the kernel of the highest supported input rate plus one chunk
+#define SPEAKER_HISTORY_SIZ (4096)
+
+typedef struct speaker_resampler {
+    int in_rate, out_rate;
+    // Input samples per output sample
+    double step;
+    // How much the kernel is stretched; above one when downsampling, to
+    // cut off at the output's Nyquist frequency
+    float scale;
+    // Kernel half width in input samples
+    int half;
+
+    // Position of the next output sample within `hist`, in input samples
+    double pos;
+    int len;
+    float hist[SPEAKER_HISTORY_SIZ];
+} speaker_resampler_t;
+
+// Returns nonzero if either rate is unsupported
+int speaker_resampler_init(speaker_resampler_t *r, int in_rate, int out_rate);
+
+// Consumes all `count` input samples and writes the output samples that
+// became available, at most about count / step + 1 of them.
+// Returns the number of samples written to `out`.
+int speaker_resample(speaker_resampler_t *r, int16_t const *in, int count, int16_t *out);
+
+typedef struct speaker_adpcm {
+    int predictor;
+    int step;
+    // Encoded sample waiting for its partner to fill a byte, or -1
+    int pending;
+} speaker_adpcm_t;
+
+void speaker_adpcm_init(speaker_adpcm_t *s);
+
+// Encodes `count` samples into `out`, which needs room for
+// (count + 1) / 2 bytes. Returns the number of bytes written.
+int speaker_adpcm_encode(speaker_adpcm_t *s, int16_t const *in, int count, uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
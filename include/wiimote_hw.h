@@ -24,18 +24,45 @@ struct wiimote_listener {
 
 // Initiates a scan for Wiimotes
 // Calls wiimote_listener::on_device_found for every device found.
+// Devices that already have a handle are skipped.
+// Blocks for the duration of the inquiry (about 10 seconds).
 int wiimote_scan(struct wiimote_listener *l, void *user);
 
+// Set the file used to remember verified Wiimotes across runs, or NULL to
+// disable it. wiimote_scan adds every Wiimote it verifies to this file.
+void wiimote_set_device_cache(char const *path);
+
+// Connect directly to the Wiimotes listed in the device cache, without an
+// inquiry. Calls wiimote_listener::on_device_found for every device that
+// accepted the connection.
+// Returns the number of devices connected.
+int wiimote_connect_cached(struct wiimote_listener *l, void *user);
+
 // Disconnect from a Wiimote
 // This invalidates the handle
 int wiimote_disconnect(HWIIMOTE hDev);
 
+// Reopen the connection to a Wiimote whose connection was lost, e.g.
+// after wiimote_recv returned -1. The handle stays valid either way.
+// Returns zero on success.
+int wiimote_reconnect(HWIIMOTE hDev);
+
+// Write the Bluetooth address of the Wiimote to `buf` as
+// "XX:XX:XX:XX:XX:XX", which needs room for WIIMOTE_ADDRESS_SIZ bytes.
+// Returns zero on success.
+#define WIIMOTE_ADDRESS_SIZ (18)
+int wiimote_get_address(HWIIMOTE hDev, char *buf, size_t length);
+
 // Send a raw packet to the Wiimote
 int wiimote_send(HWIIMOTE hDev, void const *data, size_t length);
 
+// File descriptor that polls readable when wiimote_recv has something to
+// return, or -1 if there is none. Changes when the device reconnects.
+int wiimote_get_fd(HWIIMOTE hDev);
+
 // Receive a packet from the Wiimote
 // Returns the length of the received packet, zero if no packet was
-// received since the last call or -1 on error.
+// received since the last call or -1 on error or if the device hung up.
 int wiimote_recv(HWIIMOTE hDev, void       *data, size_t length);
 
 #ifdef __cplusplus
@@ -31,7 +31,8 @@
 #define WIIM_REPORT_DATA_BUTTONS_ACCEL_IR12                      (0x33)
 #define WIIM_REPORT_DATA_BUTTONS_EXT19                           (0x34)
 #define WIIM_REPORT_DATA_BUTTONS_ACCEL_EXT16                     (0x35)
-#define WIIM_REPORT_DATA_BUTTONS_IR10_EXT6                       (0x36)
+#define WIIM_REPORT_DATA_BUTTONS_IR10_EXT9                       (0x36)
+#define WIIM_REPORT_DATA_BUTTONS_ACCEL_IR10_EXT6                 (0x37)
 #define WIIM_REPORT_DATA_EXT21                                   (0x3D)
 #define WIIM_REPORT_DATA_BUTTONS_ACCEL_IR36_INTER0               (0x3E)
 #define WIIM_REPORT_DATA_BUTTONS_ACCEL_IR36_INTER1               (0x3F)
@@ -42,7 +43,8 @@
 #define WIIM_REPORT_MODE_BUTTONS_ACCEL_IR12                      (0x33)
 #define WIIM_REPORT_MODE_BUTTONS_EXT19                           (0x34)
 #define WIIM_REPORT_MODE_BUTTONS_ACCEL_EXT16                     (0x35)
-#define WIIM_REPORT_MODE_BUTTONS_IR10_EXT6                       (0x36)
+#define WIIM_REPORT_MODE_BUTTONS_IR10_EXT9                       (0x36)
+#define WIIM_REPORT_MODE_BUTTONS_ACCEL_IR10_EXT6                 (0x37)
 #define WIIM_REPORT_MODE_EXT21                                   (0x3D)
 #define WIIM_REPORT_MODE_BUTTONS_ACCEL_IR36_INTER0               (0x3E)
 #define WIIM_REPORT_MODE_BUTTONS_ACCEL_IR36_INTER1               (0x3F)
@@ -55,6 +57,14 @@
 #define WIIM_DRM_FLAG_RUMBLE        (0x01)
 #define WIIM_DRM_FLAG_CONTINUOUS    (0x04)
 
+// Flag of the IR camera and speaker enable/mute reports
+#define WIIM_FLAG_ENABLE            (0x04)
+
+// IR camera data formats, written to 0xB00033
+#define WIIM_IR_MODE_OFF            (0x00)
+#define WIIM_IR_MODE_BASIC          (0x01)
+#define WIIM_IR_MODE_EXTENDED       (0x03)
+
 #define WIIM_ADDRSPACE_EEPROM (0x00)
 #define WIIM_ADDRSPACE_CTLREG (0x04)
 
@@ -83,6 +93,40 @@ struct pkt_status_request {
     uint8_t flags;
 };
 
+// IR camera and speaker enable/mute
+struct pkt_enable {
+    struct wiimote_header hdr;
+    uint8_t flags;
+};
+
+// Speaker registers in WIIM_ADDRSPACE_CTLREG
+#define WIIM_SPEAKER_REG_CONFIG     (0xA20001)
+#define WIIM_SPEAKER_REG_PLAY       (0xA20008)
+#define WIIM_SPEAKER_REG_RESET      (0xA20009)
+
+// Speaker configuration written to WIIM_SPEAKER_REG_CONFIG
+struct speaker_config {
+    uint8_t unk0;
+    // 0x00 for 4-bit Yamaha ADPCM, 0x40 for signed 8-bit PCM
+    uint8_t format;
+    // Sample rate is 6 MHz over this, little-endian
+    uint8_t rate_lo, rate_hi;
+    uint8_t volume;
+    uint8_t unk1, unk2;
+};
+
+#define WIIM_SPEAKER_FORMAT_ADPCM   (0x00)
+// Loudest volume for ADPCM
+#define WIIM_SPEAKER_VOLUME_MAX     (0x40)
+#define WIIM_SPEAKER_DATA_MAX       (20)
+
+struct pkt_speaker_data {
+    struct wiimote_header hdr;
+    // Number of data bytes << 3, with the rumble flag in bit 0
+    uint8_t len;
+    uint8_t data[WIIM_SPEAKER_DATA_MAX];
+};
+
 struct pkt_memory_read {
     struct wiimote_header hdr;
     uint8_t address_space;
@@ -137,13 +181,23 @@ typedef struct buttons {
     uint8_t home    : 1;
 } buttons_t;
 
+// Accelerometer data, overlaid on the core buttons whose unused bits carry
+// the least significant bits. X has 10 bits of precision; Y and Z only 9,
+// so their bit 0 is always zero. Every field stays within its byte, so the
+// layout doesn't depend on how the compiler packs bitfields across bytes.
 typedef struct accel_data {
     uint8_t irr0 : 5;
+    // Bits 1:0 of X
     uint8_t x2 : 2;
-    uint8_t irr1 : 6;
+    uint8_t irr1 : 1;
+
+    uint8_t irr2 : 5;
+    // Bit 1 of Y and Z
     uint8_t y2 : 1;
     uint8_t z2 : 1;
-    uint8_t irr2 : 1;
+    uint8_t irr3 : 1;
+
+    // Bits 9:2
     uint8_t x, y, z;
 } accel_data_t;
 
@@ -155,15 +209,17 @@ typedef struct button_accel_hdr {
 struct pkt_memory_read_response {
     struct wiimote_header hdr;
     buttons_t btn;
-    uint8_t size : 4;
     uint8_t error : 4;
+    // Number of bytes returned minus one
+    uint8_t size : 4;
     uint8_t off_mi, off_lo;
     uint8_t data[16];
 };
 
 typedef struct extension_signature {
-    uint16_t x;
-    uint16_t base;
+    uint8_t x[2];
+    // 0xA6 for an inactive MotionPlus, 0xA4 for everything else
+    uint8_t base_hi, base_lo;
     uint8_t state;
     uint8_t id;
 } extension_signature_t;
@@ -171,11 +227,93 @@ typedef struct extension_signature {
 #define EXT_ID_NUNCHUCK     (0x00)
 #define EXT_ID_MOTIONPLUS   (0x05)
 
+// Values of extension_signature_t::state when id is EXT_ID_MOTIONPLUS
+#define EXT_MP_STATE_INACTIVE           (0x00)
+#define EXT_MP_STATE_ACTIVE             (0x04)
+#define EXT_MP_STATE_NUNCHUCK_PASSTHRU  (0x05)
+
+// Values written to 0xA600FE to activate the MotionPlus
+#define EXT_MP_MODE_ACTIVE              (0x04)
+#define EXT_MP_MODE_NUNCHUCK_PASSTHRU   (0x05)
+
+// Flags of pkt_status_report::flags; LEDs are in the high nibble
+#define WIIM_STATUS_FLAG_BATTERY_LOW    (0x01)
+#define WIIM_STATUS_FLAG_EXTENSION      (0x02)
+#define WIIM_STATUS_FLAG_SPEAKER        (0x04)
+#define WIIM_STATUS_FLAG_IR             (0x08)
+
+// Battery level reported with fresh batteries
+#define WIIM_BATTERY_FULL           (0xC8)
+
+// Sent on request and whenever an extension is plugged in or removed
+struct pkt_status_report {
+    struct wiimote_header hdr;
+    buttons_t btn;
+    uint8_t flags;
+    uint8_t unk[2];
+    uint8_t battery;
+};
+
 struct pkt_report_buttons_only {
     struct wiimote_header hdr;
     buttons_t btn;
 };
 
+typedef struct nunchuk_data {
+    uint8_t stick_x;
+    uint8_t stick_y;
+    uint8_t accel_x_hi;
+    uint8_t accel_y_hi;
+    uint8_t accel_z_hi;
+
+    // Buttons are active low
+    uint8_t z : 1;
+    uint8_t c : 1;
+    uint8_t accel_x_lo : 2;
+    uint8_t accel_y_lo : 2;
+    uint8_t accel_z_lo : 2;
+} nunchuk_data_t;
+
+// Nunchuk data as interleaved by a MotionPlus in passthrough mode; the
+// least significant accelerometer bits are dropped to make room for the
+// frame type flag.
+typedef struct nunchuk_passthru_data {
+    uint8_t stick_x;
+    uint8_t stick_y;
+    uint8_t accel_x_hi;
+    uint8_t accel_y_hi;
+
+    uint8_t ext_connected : 1;
+    uint8_t accel_z_hi : 7;
+
+    uint8_t zero : 1;
+    // Zero for Nunchuk frames, one for MotionPlus frames
+    uint8_t is_motionplus : 1;
+    uint8_t z : 1;
+    uint8_t c : 1;
+    uint8_t accel_x_lo : 1;
+    uint8_t accel_y_lo : 1;
+    uint8_t accel_z_lo : 2;
+} nunchuk_passthru_data_t;
+
+typedef struct nunchuk_calibration_data {
+    uint8_t x_0g_hi, y_0g_hi, z_0g_hi;
+    uint8_t z_0g_lo : 2;
+    uint8_t y_0g_lo : 2;
+    uint8_t x_0g_lo : 2;
+    uint8_t zero0 : 2;
+
+    uint8_t x_1g_hi, y_1g_hi, z_1g_hi;
+    uint8_t z_1g_lo : 2;
+    uint8_t y_1g_lo : 2;
+    uint8_t x_1g_lo : 2;
+    uint8_t zero1 : 2;
+
+    uint8_t stick_x_max, stick_x_min, stick_x_center;
+    uint8_t stick_y_max, stick_y_min, stick_y_center;
+    uint8_t checksum[2];
+} nunchuk_calibration_data_t;
+
 typedef struct motionplus_data {
     uint8_t yaw_down_speed_lo;
     uint8_t roll_left_speed_lo;
@@ -190,6 +328,7 @@ typedef struct motionplus_data {
     uint8_t roll_left_speed_hi: 6;
 
     uint8_t zero : 1;
+    // Always one for MotionPlus frames
     uint8_t one : 1;
     uint8_t pitch_left_speed_hi : 6;
 } motionplus_data_t;
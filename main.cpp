@@ -1,5 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <SDL2/SDL.h>
 #include "glad/glad.h"
@@ -9,13 +15,16 @@
 #include <imgui_impl_opengl3.h>
 
 #include <motion_input.h>
+#include <motion_trace.h>
+
+#include "plot.h"
 
 typedef struct wnd {
     SDL_Window *hWindow;
     void *hGlCtx;
 } wnd_t;
 
-static int open_window(wnd_t *wnd) {
+static int open_window(wnd_t *wnd, bool bVsync) {
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         printf("SDL_Init failed: %s\n", SDL_GetError());
         return 0;
@@ -54,7 +63,7 @@ static int open_window(wnd_t *wnd) {
     }
 
     SDL_GL_MakeCurrent(hWindow, hGlCtx);
-    SDL_GL_SetSwapInterval(1);
+    SDL_GL_SetSwapInterval(bVsync ? 1 : 0);
 
     if (gladLoadGL() == 0) {
         printf("gladLoadGL failed\n");
@@ -74,12 +83,19 @@ static int open_window(wnd_t *wnd) {
     ImGui_ImplSDL2_InitForOpenGL(hWindow, hGlCtx);
     ImGui_ImplOpenGL3_Init(pszGlslVersion);
 
+    if(!gpu_plot_setup()) {
+        printf("gpu_plot_setup failed\n");
+        return 0;
+    }
+
     return 1;
 }
 
 static void destroy_window(wnd_t *wnd) {
     assert(wnd != NULL);
 
+    gpu_plot_teardown();
+
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -89,20 +105,63 @@ static void destroy_window(wnd_t *wnd) {
     SDL_Quit();
 }
 
+// Accel samples kept in input_state_t; only needs to cover the samples
+// arriving between two frames, the plots keep the long history on the GPU
 #define PAST_DATA_COUNT (1024)
+// Accel samples retained by the plots, per axis: an hour at 100 Hz
+#define PLOT_HISTORY_COUNT (60 * 60 * 100)
 
 typedef struct input_state {
     bool buttons[(int)MB_MAX];
 
     float acc[3];
 
+    // From the last MI_EV_STATUS
+    bool has_status;
+    float battery;
+
+    // From the last MI_EV_POINTER
+    motion_pointer_t pointer;
+
     float old_x[PAST_DATA_COUNT];
     float old_y[PAST_DATA_COUNT];
     float old_z[PAST_DATA_COUNT];
     int old_i;
+    uint64_t accel_count;
+
+    // Number of events applied so far
+    uint64_t seq;
 } input_state_t;
 
-static int display_input_state(input_state_t *state) {
+typedef struct plots {
+    gpu_plot_t axes[3];
+    uint64_t accel_count;
+} plots_t;
+
+// Uploads the accel samples the plots haven't seen yet
+static void update_plots(plots_t *plots, input_state_t const *state) {
+    uint64_t n = state->accel_count - plots->accel_count;
+    if(n > PAST_DATA_COUNT) {
+        n = PAST_DATA_COUNT;
+    }
+
+    float const *src[3] = { state->old_x, state->old_y, state->old_z };
+    int first = (int)((state->old_i + PAST_DATA_COUNT - n) % PAST_DATA_COUNT);
+    int tail = PAST_DATA_COUNT - first;
+    if(tail > (int)n) {
+        tail = (int)n;
+    }
+
+    for(int i = 0; i < 3; i++) {
+        gpu_plot_push(&plots->axes[i], src[i] + first, tail);
+        gpu_plot_push(&plots->axes[i], src[i], (int)n - tail);
+    }
+
+    plots->accel_count = state->accel_count;
+}
+
+// `pred` is NULL until the first Wiimote sent a sample
+static int display_input_state(input_state_t *state, plots_t *plots, motion_prediction_t const *pred) {
     for(int i = 0; i < MB_MAX; i++) {
         char buf[32];
         snprintf(buf, 31, "%d", i);
@@ -111,9 +170,25 @@ static int display_input_state(input_state_t *state) {
 
     ImGui::InputFloat3("Acc.", state->acc);
 
-    ImGui::PlotLines("Accel. X", state->old_x, PAST_DATA_COUNT);
-    ImGui::PlotLines("Accel. Y", state->old_y, PAST_DATA_COUNT);
-    ImGui::PlotLines("Accel. Z", state->old_z, PAST_DATA_COUNT);
+    if(pred != NULL) {
+        float acc[3] = { pred->accel.x, pred->accel.y, pred->accel.z };
+        ImGui::InputFloat3("Predicted", acc);
+    }
+
+    if(state->has_status) {
+        ImGui::ProgressBar(state->battery, ImVec2(-1, 0), "Battery");
+    }
+
+    if(state->pointer.visible) {
+        motion_pointer_t const &p = state->pointer;
+        ImGui::Text("Pointer %.3f %.3f, %.2f m, roll %.1f deg", p.x, p.y, p.distance, p.roll * 180 / M_PI);
+    } else {
+        ImGui::Text("No sensor bar in view");
+    }
+
+    gpu_plot_draw(&plots->axes[0], "Accel. X", -3, 3, ImVec2(0, 0));
+    gpu_plot_draw(&plots->axes[1], "Accel. Y", -3, 3, ImVec2(0, 0));
+    gpu_plot_draw(&plots->axes[2], "Accel. Z", -3, 3, ImVec2(0, 0));
     return 0;
 }
 
@@ -129,59 +204,316 @@ static void mutate(input_state_t *state, motion_event_t const &ev) {
         state->old_y[state->old_i] = ev.accel.y;
         state->old_z[state->old_i] = ev.accel.z;
         state->old_i = (state->old_i + 1) % PAST_DATA_COUNT;
+        state->accel_count++;
+    } else if(ev.kind == MI_EV_STATUS) {
+        state->has_status = true;
+        state->battery = ev.status.battery;
+    } else if(ev.kind == MI_EV_POINTER) {
+        state->pointer = ev.pointer;
     }
 }
 
+// Receive timestamps of the most recent events, indexed by input_state_t::seq
+// modulo STAMP_RING_SIZ. Written by whoever drains motion_poll and published
+// together with the state that includes them.
+#define STAMP_RING_SIZ (8192)
+static uint64_t gStamps[STAMP_RING_SIZ];
+
+// Applies all pending events to the state, returns how many there were
+static int drain_events(input_state_t *state) {
+    motion_event_t ev;
+    int n = 0;
+
+    while(motion_poll(&ev)) {
+        switch(ev.kind) {
+            case MI_EV_BUTTON:
+            case MI_EV_ACCEL:
+            case MI_EV_STATUS:
+            case MI_EV_POINTER:
+            {
+                mutate(state, ev);
+                gStamps[state->seq % STAMP_RING_SIZ] = ev.timestamp;
+                state->seq++;
+                n++;
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
+
+    return n;
+}
+
+// Input thread handing its state to the render thread through a triple
+// buffer: the input thread fills `back`, then swaps it with `middle`; the
+// render thread swaps `front` with `middle` when the latter is fresh. Neither
+// side ever waits and the render thread always sees a whole snapshot.
+#define SLOT_FRESH (4)
+// Upper bound on how long the input thread sleeps before checking whether
+// it should exit, in milliseconds
+#define INPUT_WAIT_TIMEOUT (100)
+
+typedef struct input_thread {
+    pthread_t hThread;
+    int running;
+
+    // SDL event pushed after publishing a snapshot so a render thread
+    // blocked in SDL_WaitEvent wakes up; zero for none. At most one is in
+    // flight, wake_pending is cleared when the render thread receives it.
+    Uint32 wake_event;
+    int wake_pending;
+
+    input_state_t work;
+    input_state_t slots[3];
+    int back, middle, front;
+} input_thread_t;
+
+static void *input_thread_main(void *arg) {
+    input_thread_t *it = (input_thread_t *)arg;
+
+    while(__atomic_load_n(&it->running, __ATOMIC_ACQUIRE)) {
+        MOTION_TRACE_BEGIN("input.drain");
+        int n = drain_events(&it->work);
+        MOTION_TRACE_END("input.drain");
+
+        if(n > 0) {
+            memcpy(&it->slots[it->back], &it->work, sizeof(input_state_t));
+            it->back = __atomic_exchange_n(&it->middle, it->back | SLOT_FRESH, __ATOMIC_ACQ_REL) & 3;
+
+            if(it->wake_event != 0 && !__atomic_exchange_n(&it->wake_pending, 1, __ATOMIC_ACQ_REL)) {
+                SDL_Event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.type = it->wake_event;
+                SDL_PushEvent(&ev);
+            }
+        }
+
+        motion_wait(INPUT_WAIT_TIMEOUT);
+    }
+
+    return NULL;
+}
+
+static int start_input_thread(input_thread_t *it, Uint32 wake_event) {
+    memset(it, 0, sizeof(*it));
+    it->back = 0;
+    it->middle = 1;
+    it->front = 2;
+    it->running = 1;
+    it->wake_event = wake_event;
+
+    return pthread_create(&it->hThread, NULL, input_thread_main, it) == 0;
+}
+
+static void stop_input_thread(input_thread_t *it) {
+    __atomic_store_n(&it->running, 0, __ATOMIC_RELEASE);
+    pthread_join(it->hThread, NULL);
+}
+
+// Most recent snapshot published by the input thread; *pbFresh tells
+// whether it's a different one than last time
+static input_state_t *acquire_input_state(input_thread_t *it, bool *pbFresh) {
+    *pbFresh = false;
+    if(__atomic_load_n(&it->middle, __ATOMIC_RELAXED) & SLOT_FRESH) {
+        it->front = __atomic_exchange_n(&it->middle, it->front, __ATOMIC_ACQ_REL) & 3;
+        *pbFresh = true;
+    }
+
+    return &it->slots[it->front];
+}
+
+// Input-to-swap latency histogram, in LATENCY_BUCKET_US wide buckets; the
+// last bucket collects everything above the range
+#define LATENCY_BUCKET_US (50)
+#define LATENCY_BUCKET_COUNT (2000)
+
+typedef struct latency_hist {
+    uint64_t buckets[LATENCY_BUCKET_COUNT];
+    uint64_t count;
+    uint64_t max;
+    uint64_t sum;
+} latency_hist_t;
+
+static uint64_t now_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void latency_record(latency_hist_t *hist, uint64_t latency) {
+    uint64_t idx = latency / LATENCY_BUCKET_US;
+    if(idx >= LATENCY_BUCKET_COUNT) {
+        idx = LATENCY_BUCKET_COUNT - 1;
+    }
+
+    hist->buckets[idx]++;
+    hist->count++;
+    hist->sum += latency;
+    if(latency > hist->max) {
+        hist->max = latency;
+    }
+}
+
+// Upper edge of the bucket containing the given percentile
+static double latency_percentile(latency_hist_t const *hist, double p) {
+    uint64_t rank = (uint64_t)(p / 100.0 * hist->count);
+    uint64_t seen = 0;
+
+    for(int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+        seen += hist->buckets[i];
+        if(seen > rank) {
+            return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+        }
+    }
+
+    return hist->max / 1000.0;
+}
+
+static void latency_report(latency_hist_t const *hist, bool bVsync, bool bThreaded) {
+    printf("input-to-swap latency (%s, %s), %llu events\n",
+            bVsync ? "vsync" : "no vsync",
+            bThreaded ? "input thread" : "single thread",
+            (unsigned long long)hist->count);
+    if(hist->count == 0) {
+        return;
+    }
+
+    printf("  mean %.2f ms\n", hist->sum / 1000.0 / hist->count);
+    printf("  p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms\n",
+            latency_percentile(hist, 50), latency_percentile(hist, 90),
+            latency_percentile(hist, 99), latency_percentile(hist, 99.9));
+    printf("  max %.2f ms\n", hist->max / 1000.0);
+}
+
+// Frames rendered in idle mode after anything changed
+#define IDLE_SETTLE_FRAMES (2)
+// Longest sleep in idle mode without an input thread, in milliseconds
+#define IDLE_POLL_INTERVAL (10)
+
+static void usage(char const *pszArgv0) {
+    printf("usage: %s [--latency] [--no-vsync] [--single-thread] [--idle] [--frames N]\n", pszArgv0);
+    printf("  --latency   measure the time from packet receipt to buffer swap\n");
+    printf("  --no-vsync  don't wait for the display refresh when swapping\n");
+    printf("  --single-thread  poll input from the render loop, once per frame\n");
+    printf("  --idle      only redraw when input arrived or the window needs it\n");
+    printf("  --frames N  exit after rendering N frames\n");
+}
+
 int main(int argc, char **argv) {
     wnd_t wnd;
     motion_input_config_t cfg;
-    input_state_t inp;
-
-    memset(&inp, 0, sizeof(inp));
+    static input_state_t inp;
+
+    bool bLatency = false;
+    bool bVsync = true;
+    bool bThreaded = true;
+    bool bIdle = false;
+    long nMaxFrames = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--latency") == 0) {
+            bLatency = true;
+        } else if(strcmp(argv[i], "--no-vsync") == 0) {
+            bVsync = false;
+        } else if(strcmp(argv[i], "--single-thread") == 0) {
+            bThreaded = false;
+        } else if(strcmp(argv[i], "--idle") == 0) {
+            bIdle = true;
+        } else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            nMaxFrames = strtol(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    if(!open_window(&wnd)) {
+    static input_thread_t input;
+    static plots_t plots;
+    static latency_hist_t hist;
+    uint64_t nDisplayedSeq = 0;
+    // Time the last swap returned, and the smoothed time between swaps,
+    // to guess when the frame being drawn will be displayed
+    uint64_t nLastSwap = 0;
+    double flFrameInterval = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.flags = MOTION_INPUT_FLAG_HOTPLUG;
+    cfg.device_cache_path = "known_wiimotes.txt";
+    cfg.calibration_cache_path = "wiimote_calibration.txt";
+
+    if(!open_window(&wnd, bVsync)) {
         printf("open_window() failed\n");
         return 1;
     }
 
+    for(int i = 0; i < 3; i++) {
+        if(!gpu_plot_init(&plots.axes[i], PLOT_HISTORY_COUNT)) {
+            printf("gpu_plot_init() failed\n");
+            return 1;
+        }
+    }
+
+    motion_subscribe(MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL | MOTION_STREAM_IR);
+
     if(motion_init(&cfg) != 0) {
         printf("motion_init() failed\n");
         return 1;
     }
 
+    Uint32 wake_event = bIdle ? SDL_RegisterEvents(1) : 0;
+    if(wake_event == (Uint32)-1) {
+        wake_event = 0;
+    }
+
+    if(bThreaded && !start_input_thread(&input, wake_event)) {
+        printf("failed to start the input thread\n");
+        return 1;
+    }
+
     bool bExit = false;
     auto &io = ImGui::GetIO();
+    long nFrames = 0;
+    // Frames still to render in idle mode; ImGui needs a couple of frames
+    // to settle after its input changed
+    int nRedrawFrames = IDLE_SETTLE_FRAMES;
+    input_state_t *state = &inp;
 
     while(!bExit) {
-        motion_event_t ev;
-        int already_have_accel = 0;
-        int cancel_motion_poll = 0;
-        while(motion_poll(&ev) && !cancel_motion_poll) {
-            switch(ev.kind) {
-                case MI_EV_BUTTON:
-                {
-                    mutate(&inp, ev);
-                    break;
-                }
-                case MI_EV_ACCEL:
-                {
-                    if(!already_have_accel) {
-                        mutate(&inp, ev);
-                        already_have_accel = 1;
-                    } else {
-                        cancel_motion_poll = 1;
-                    }
-                    break;
-                }
-                default:
-                {
-                    break;
+        if(bIdle && nRedrawFrames == 0) {
+            // Nothing to draw; sleep until that changes. The input thread
+            // wakes us with wake_event, without it we have to poll.
+            MOTION_TRACE_BEGIN("frame.idle");
+            if(bThreaded) {
+                SDL_WaitEvent(NULL);
+            } else {
+                int timeout = motion_get_timeout();
+                if(timeout < 0 || timeout > IDLE_POLL_INTERVAL) {
+                    timeout = IDLE_POLL_INTERVAL;
                 }
+                SDL_WaitEventTimeout(NULL, timeout);
             }
+            MOTION_TRACE_END("frame.idle");
+        }
+
+        MOTION_TRACE_BEGIN("frame.poll");
+        bool bChanged = false;
+        if(bThreaded) {
+            state = acquire_input_state(&input, &bChanged);
+        } else {
+            bChanged = drain_events(&inp) > 0;
         }
 
         SDL_Event sev;
         while(SDL_PollEvent(&sev)) {
+            bChanged = true;
+            if(wake_event != 0 && sev.type == wake_event) {
+                __atomic_store_n(&input.wake_pending, 0, __ATOMIC_RELEASE);
+                continue;
+            }
+
             ImGui_ImplSDL2_ProcessEvent(&sev);
             if(sev.type == SDL_QUIT) {
                 bExit = true;
@@ -191,27 +523,102 @@ int main(int argc, char **argv) {
             }
         }
 
+        MOTION_TRACE_END("frame.poll");
+
+        if(bChanged) {
+            nRedrawFrames = IDLE_SETTLE_FRAMES;
+        }
+        if(bIdle && nRedrawFrames == 0) {
+            continue;
+        }
+
+        MOTION_TRACE_BEGIN("frame.imgui");
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL2_NewFrame(wnd.hWindow);
         ImGui::NewFrame();
 
-        if(display_input_state(&inp) != 0) {
+        update_plots(&plots, state);
+
+        // Draw the motion as it will be by the next swap rather than as it
+        // was when the newest packet arrived
+        motion_prediction_t pred;
+        uint64_t nNextSwap = nLastSwap + (uint64_t)flFrameInterval;
+        bool bPredicted = motion_predict(1, nLastSwap != 0 ? nNextSwap : now_micros(), &pred) == 0;
+
+        if(display_input_state(state, &plots, bPredicted ? &pred : NULL) != 0) {
             bExit = true;
         }
 
         ImGui::Render();
+        MOTION_TRACE_END("frame.imgui");
+
+        MOTION_TRACE_BEGIN("frame.render");
         glViewport(0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y);
         glClearColor(0, 0, 0, 1);
         glClear(GL_COLOR_BUFFER_BIT);
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        MOTION_TRACE_END("frame.render");
+
+        MOTION_TRACE_BEGIN("frame.swap");
         SDL_GL_SwapWindow(wnd.hWindow);
+        MOTION_TRACE_END("frame.swap");
+
+        uint64_t nSwap = now_micros();
+        if(nLastSwap != 0) {
+            flFrameInterval += ((double)(nSwap - nLastSwap) - flFrameInterval) / 16;
+        }
+        nLastSwap = nSwap;
+
+        if(bLatency) {
+            // Swap returns once the frame is queued for scanout (or, with
+            // vsync, once the previous one was); that's as close to photons
+            // as we can get without external hardware
+            uint64_t now = now_micros();
+            uint64_t seq = state->seq;
+            if(seq - nDisplayedSeq > STAMP_RING_SIZ) {
+                // Older stamps were already overwritten
+                nDisplayedSeq = seq - STAMP_RING_SIZ;
+            }
+            for(; nDisplayedSeq < seq; nDisplayedSeq++) {
+                latency_record(&hist, now - gStamps[nDisplayedSeq % STAMP_RING_SIZ]);
+            }
+        }
+
+        if(nRedrawFrames > 0 && !ImGui::IsAnyItemActive()) {
+            nRedrawFrames--;
+        }
+
+        nFrames++;
+        if(nMaxFrames > 0 && nFrames >= nMaxFrames) {
+            bExit = true;
+        }
+    }
+
+    if(bThreaded) {
+        stop_input_thread(&input);
     }
 
+    if(bLatency) {
+        latency_report(&hist, bVsync, bThreaded);
+    }
+
+#ifdef MOTION_TRACE
+    if(motion_trace_dump("wm_trace.json") == 0) {
+        printf("trace written to wm_trace.json\n");
+    } else {
+        perror("can't write wm_trace.json");
+    }
+#endif
+
     if(motion_shutdown() != 0) {
         printf("motion_shutdown() failed\n");
         return 1;
     }
 
+    for(int i = 0; i < 3; i++) {
+        gpu_plot_destroy(&plots.axes[i]);
+    }
+
     destroy_window(&wnd);
     return 0;
 }
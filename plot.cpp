@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+#include "glad/glad.h"
+
+#include "plot.h"
+
+#define PLOT_DEFAULT_HEIGHT (80.0f)
+// Widest plot we draw at full resolution, in framebuffer pixels
+#define PLOT_MAX_COLUMNS (8192)
+// Narrowest view, in samples
+#define PLOT_MIN_SPAN (16.0)
+
+// Vertices are either raw samples spread across the plot, or a min/max pair
+// per pixel column, ordered so consecutive columns connect
+static char const *pszPlotVertexShader =
+    "#version 330 core\n"
+    "uniform samplerBuffer uVertices;\n"
+    "uniform int uCount;\n"
+    "uniform int uPairs;\n"
+    "uniform vec2 uRange;\n"
+    "void main() {\n"
+    "    float v = texelFetch(uVertices, gl_VertexID).r;\n"
+    "    float x;\n"
+    "    if(uPairs != 0) {\n"
+    "        x = (float(gl_VertexID / 2) + 0.5) / float(uCount / 2);\n"
+    "    } else {\n"
+    "        x = float(gl_VertexID) / float(max(uCount - 1, 1));\n"
+    "    }\n"
+    "    float y = (v - uRange.x) / (uRange.y - uRange.x);\n"
+    "    gl_Position = vec4(x * 2.0 - 1.0, clamp(y, 0.0, 1.0) * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static char const *pszPlotFragmentShader =
+    "#version 330 core\n"
+    "uniform vec4 uColor;\n"
+    "out vec4 oColor;\n"
+    "void main() {\n"
+    "    oColor = uColor;\n"
+    "}\n";
+
+static GLuint hPlotProgram = 0;
+static GLuint hPlotVao = 0;
+static GLint iVerticesLoc, iCountLoc, iPairsLoc, iRangeLoc, iColorLoc;
+
+// Staging area for the vertices of the plot being laid out
+static float aVertices[2 * PLOT_MAX_COLUMNS];
+
+static GLuint compile_shader(GLenum type, char const *pszSource) {
+    GLuint hShader = glCreateShader(type);
+    glShaderSource(hShader, 1, &pszSource, NULL);
+    glCompileShader(hShader);
+
+    GLint status = 0;
+    glGetShaderiv(hShader, GL_COMPILE_STATUS, &status);
+    if(!status) {
+        char log[512];
+        glGetShaderInfoLog(hShader, sizeof(log), NULL, log);
+        printf("gpu_plot: shader compilation failed: %s\n", log);
+        glDeleteShader(hShader);
+        return 0;
+    }
+
+    return hShader;
+}
+
+int gpu_plot_setup() {
+    GLuint hVert = compile_shader(GL_VERTEX_SHADER, pszPlotVertexShader);
+    GLuint hFrag = compile_shader(GL_FRAGMENT_SHADER, pszPlotFragmentShader);
+    if(hVert == 0 || hFrag == 0) {
+        return 0;
+    }
+
+    hPlotProgram = glCreateProgram();
+    glAttachShader(hPlotProgram, hVert);
+    glAttachShader(hPlotProgram, hFrag);
+    glLinkProgram(hPlotProgram);
+    glDeleteShader(hVert);
+    glDeleteShader(hFrag);
+
+    GLint status = 0;
+    glGetProgramiv(hPlotProgram, GL_LINK_STATUS, &status);
+    if(!status) {
+        printf("gpu_plot: program link failed\n");
+        glDeleteProgram(hPlotProgram);
+        hPlotProgram = 0;
+        return 0;
+    }
+
+    iVerticesLoc = glGetUniformLocation(hPlotProgram, "uVertices");
+    iCountLoc = glGetUniformLocation(hPlotProgram, "uCount");
+    iPairsLoc = glGetUniformLocation(hPlotProgram, "uPairs");
+    iRangeLoc = glGetUniformLocation(hPlotProgram, "uRange");
+    iColorLoc = glGetUniformLocation(hPlotProgram, "uColor");
+
+    // Core profile wants a VAO bound even though there are no attributes
+    glGenVertexArrays(1, &hPlotVao);
+
+    return 1;
+}
+
+void gpu_plot_teardown() {
+    glDeleteVertexArrays(1, &hPlotVao);
+    glDeleteProgram(hPlotProgram);
+    hPlotVao = 0;
+    hPlotProgram = 0;
+}
+
+int gpu_plot_init(gpu_plot_t *plot, int history) {
+    assert(plot != NULL);
+    assert(history > 0);
+
+    *plot = gpu_plot_t();
+    plot->history = history;
+    plot->capacity = 1 << PLOT_LOD_LEVELS;
+    while(plot->capacity < history + (1 << PLOT_LOD_LEVELS)) {
+        plot->capacity <<= 1;
+    }
+
+    plot->samples = (float *)calloc(plot->capacity, sizeof(float));
+    if(plot->samples == NULL) {
+        return 0;
+    }
+
+    for(int k = 1; k <= PLOT_LOD_LEVELS; k++) {
+        plot->lod_min[k] = (float *)calloc(plot->capacity >> k, sizeof(float));
+        plot->lod_max[k] = (float *)calloc(plot->capacity >> k, sizeof(float));
+        if(plot->lod_min[k] == NULL || plot->lod_max[k] == NULL) {
+            gpu_plot_destroy(plot);
+            return 0;
+        }
+    }
+
+    plot->texture_capacity = 2 * PLOT_MAX_COLUMNS;
+
+    glGenBuffers(1, &plot->hBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, plot->hBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, plot->texture_capacity * sizeof(float), NULL, GL_STREAM_DRAW);
+
+    glGenTextures(1, &plot->hTexture);
+    glBindTexture(GL_TEXTURE_BUFFER, plot->hTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, plot->hBuffer);
+
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    return plot->hBuffer != 0 && plot->hTexture != 0;
+}
+
+void gpu_plot_destroy(gpu_plot_t *plot) {
+    glDeleteTextures(1, &plot->hTexture);
+    glDeleteBuffers(1, &plot->hBuffer);
+    plot->hTexture = 0;
+    plot->hBuffer = 0;
+
+    free(plot->samples);
+    plot->samples = NULL;
+    for(int k = 1; k <= PLOT_LOD_LEVELS; k++) {
+        free(plot->lod_min[k]);
+        free(plot->lod_max[k]);
+        plot->lod_min[k] = NULL;
+        plot->lod_max[k] = NULL;
+    }
+}
+
+void gpu_plot_push(gpu_plot_t *plot, float const *samples, int count) {
+    uint64_t mask = plot->capacity - 1;
+
+    for(int i = 0; i < count; i++) {
+        uint64_t g = plot->written++;
+        float v = samples[i];
+
+        plot->samples[g & mask] = v;
+
+        for(int k = 1; k <= PLOT_LOD_LEVELS; k++) {
+            uint64_t n = (g >> k) & (mask >> k);
+            if((g & ((1ull << k) - 1)) == 0) {
+                // First sample of a new node
+                plot->lod_min[k][n] = v;
+                plot->lod_max[k][n] = v;
+            } else {
+                if(v < plot->lod_min[k][n]) plot->lod_min[k][n] = v;
+                if(v > plot->lod_max[k][n]) plot->lod_max[k][n] = v;
+            }
+        }
+    }
+}
+
+// Min and max of samples [lo, hi) using the nodes of level k that overlap it
+static void range_min_max(gpu_plot_t const *plot, int k, uint64_t lo, uint64_t hi, float *pmin, float *pmax) {
+    uint64_t mask = (uint64_t)(plot->capacity - 1) >> k;
+    float mn, mx;
+
+    if(k == 0) {
+        mn = mx = plot->samples[lo & mask];
+        for(uint64_t g = lo + 1; g < hi; g++) {
+            float v = plot->samples[g & mask];
+            if(v < mn) mn = v;
+            if(v > mx) mx = v;
+        }
+    } else {
+        uint64_t n = lo >> k;
+        uint64_t last = (hi - 1) >> k;
+        mn = plot->lod_min[k][n & mask];
+        mx = plot->lod_max[k][n & mask];
+        for(n++; n <= last; n++) {
+            if(plot->lod_min[k][n & mask] < mn) mn = plot->lod_min[k][n & mask];
+            if(plot->lod_max[k][n & mask] > mx) mx = plot->lod_max[k][n & mask];
+        }
+    }
+
+    *pmin = mn;
+    *pmax = mx;
+}
+
+// Fills aVertices for samples [first, first + span) across the given
+// number of pixel columns, returns the vertex count
+static int build_vertices(gpu_plot_t *plot, double first, double span, int columns) {
+    double spp = span / columns;
+    uint64_t mask = plot->capacity - 1;
+
+    if(spp <= 1.0) {
+        // At most one sample per column: draw them as they are
+        uint64_t a = (uint64_t)first;
+        uint64_t b = (uint64_t)ceil(first + span);
+        if(b > plot->written) {
+            b = plot->written;
+        }
+
+        int n = 0;
+        for(uint64_t g = a; g < b; g++) {
+            aVertices[n++] = plot->samples[g & mask];
+        }
+
+        plot->pairs = 0;
+        return n;
+    }
+
+    // Coarsest level whose nodes still fit in a column
+    int k = 0;
+    while(k < PLOT_LOD_LEVELS && (double)(2ull << k) <= spp) {
+        k++;
+    }
+
+    for(int p = 0; p < columns; p++) {
+        uint64_t lo = (uint64_t)(first + p * spp);
+        uint64_t hi = (uint64_t)(first + (p + 1) * spp);
+        if(hi > plot->written) {
+            hi = plot->written;
+        }
+        if(hi <= lo) {
+            hi = lo + 1;
+        }
+
+        float mn, mx;
+        range_min_max(plot, k, lo, hi, &mn, &mx);
+
+        // Alternate the order so the strip runs min-max-max-min-...
+        aVertices[2 * p + 0] = (p & 1) ? mx : mn;
+        aVertices[2 * p + 1] = (p & 1) ? mn : mx;
+    }
+
+    plot->pairs = 1;
+    return 2 * columns;
+}
+
+static void draw_callback(ImDrawList const *list, ImDrawCmd const *cmd) {
+    gpu_plot_t *plot = (gpu_plot_t *)cmd->UserCallbackData;
+    ImDrawData *data = ImGui::GetDrawData();
+
+    if(plot->vertex_count < 2) {
+        return;
+    }
+
+    // Convert from display to framebuffer coordinates, with Y pointing up
+    float sx = data->FramebufferScale.x;
+    float sy = data->FramebufferScale.y;
+    float fbh = data->DisplaySize.y * sy;
+    ImVec2 pos = data->DisplayPos;
+
+    glViewport(
+            (GLint)((plot->rmin.x - pos.x) * sx),
+            (GLint)(fbh - (plot->rmax.y - pos.y) * sy),
+            (GLsizei)((plot->rmax.x - plot->rmin.x) * sx),
+            (GLsizei)((plot->rmax.y - plot->rmin.y) * sy));
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(
+            (GLint)((cmd->ClipRect.x - pos.x) * sx),
+            (GLint)(fbh - (cmd->ClipRect.w - pos.y) * sy),
+            (GLsizei)((cmd->ClipRect.z - cmd->ClipRect.x) * sx),
+            (GLsizei)((cmd->ClipRect.w - cmd->ClipRect.y) * sy));
+
+    glUseProgram(hPlotProgram);
+    glBindVertexArray(hPlotVao);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, plot->hTexture);
+
+    glUniform1i(iVerticesLoc, 0);
+    glUniform1i(iCountLoc, plot->vertex_count);
+    glUniform1i(iPairsLoc, plot->pairs);
+    glUniform2f(iRangeLoc, plot->min, plot->max);
+    glUniform4f(iColorLoc,
+            ((plot->color >> 0) & 0xFF) / 255.0f,
+            ((plot->color >> 8) & 0xFF) / 255.0f,
+            ((plot->color >> 16) & 0xFF) / 255.0f,
+            ((plot->color >> 24) & 0xFF) / 255.0f);
+
+    glDrawArrays(GL_LINE_STRIP, 0, plot->vertex_count);
+
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+void gpu_plot_draw(gpu_plot_t *plot, char const *label, float min, float max, ImVec2 size) {
+    if(size.x <= 0) {
+        size.x = ImGui::CalcItemWidth();
+    }
+    if(size.y <= 0) {
+        size.y = PLOT_DEFAULT_HEIGHT;
+    }
+
+    ImVec2 p0 = ImGui::GetCursorScreenPos();
+    ImVec2 p1 = ImVec2(p0.x + size.x, p0.y + size.y);
+    ImGui::InvisibleButton(label, size);
+
+    ImGuiIO &io = ImGui::GetIO();
+    ImDrawList *list = ImGui::GetWindowDrawList();
+    ImVec2 pad = ImGui::GetStyle().FramePadding;
+
+    plot->rmin = ImVec2(p0.x + pad.x, p0.y + pad.y);
+    plot->rmax = ImVec2(p1.x - pad.x, p1.y - pad.y);
+    plot->min = min;
+    plot->max = max;
+    plot->color = ImGui::GetColorU32(ImGuiCol_PlotLines);
+
+    float width = plot->rmax.x - plot->rmin.x;
+    int columns = (int)(width * io.DisplayFramebufferScale.x);
+    if(columns > PLOT_MAX_COLUMNS) {
+        columns = PLOT_MAX_COLUMNS;
+    }
+
+    // Resolve the visible window against what's retained
+    double retained = plot->written < (uint64_t)plot->history ? (double)plot->written : plot->history;
+    double span = plot->view_span > 0 && plot->view_span < retained ? plot->view_span : retained;
+
+    if(width > 0 && retained > 0 && ImGui::IsItemHovered() && io.MouseWheel != 0) {
+        // Zoom around the sample under the cursor
+        double t = (io.MousePos.x - plot->rmin.x) / width;
+        double anchor = plot->view_offset + (1.0 - t) * span;
+        span *= pow(0.8, io.MouseWheel);
+        if(span < PLOT_MIN_SPAN) {
+            span = PLOT_MIN_SPAN;
+        }
+        plot->view_span = span < retained ? span : 0;
+        plot->view_offset = anchor - (1.0 - t) * span;
+    }
+
+    if(width > 0 && ImGui::IsItemActive() && ImGui::IsMouseDragging(0)) {
+        plot->view_offset += ImGui::GetMouseDragDelta(0).x * span / width;
+        ImGui::ResetMouseDragDelta(0);
+    }
+
+    if(span > retained) {
+        span = retained;
+    }
+    if(plot->view_offset > retained - span) {
+        plot->view_offset = retained - span;
+    }
+    if(plot->view_offset < 0) {
+        plot->view_offset = 0;
+    }
+
+    plot->vertex_count = 0;
+    if(columns > 0 && span > 0) {
+        double first = (double)plot->written - plot->view_offset - span;
+        plot->vertex_count = build_vertices(plot, first, span, columns);
+
+        glBindBuffer(GL_TEXTURE_BUFFER, plot->hBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, plot->vertex_count * sizeof(float), aVertices);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    list->AddRectFilled(p0, p1, ImGui::GetColorU32(ImGuiCol_FrameBg));
+    list->AddCallback(draw_callback, plot);
+    list->AddCallback(ImDrawCallback_ResetRenderState, NULL);
+
+    ImGui::SameLine(0, ImGui::GetStyle().ItemInnerSpacing.x);
+    ImGui::TextUnformatted(label);
+}
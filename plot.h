@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <imgui.h>
+
+// Line plot over a long sample history
+//
+// Samples go into a ring that also maintains a min/max pyramid: node n of
+// level k covers samples [n << k, (n + 1) << k). Drawing picks the level
+// whose nodes are about a pixel wide and uploads a single min/max pair per
+// horizontal pixel, so the cost of a frame only depends on the plot's width
+// and not on how many samples it shows.
+//
+// Scroll over a plot to zoom, drag it to pan; panning back to the present
+// resumes following new samples.
+
+#define PLOT_LOD_LEVELS (12)
+
+typedef struct gpu_plot {
+    unsigned hBuffer;
+    unsigned hTexture;
+    int texture_capacity;
+
+    // Ring of raw samples, a power of two larger than `history` by at least
+    // one top level node, so no node covering a retained sample is ever
+    // partially overwritten
+    int capacity;
+    int history;
+    float *samples;
+    float *lod_min[PLOT_LOD_LEVELS + 1];
+    float *lod_max[PLOT_LOD_LEVELS + 1];
+
+    // Total number of samples pushed so far
+    uint64_t written;
+
+    // Visible window: `view_span` samples ending `view_offset` samples
+    // before the newest one; a span of zero shows the whole history
+    double view_span;
+    double view_offset;
+
+    // Parameters of the pending draw, read by the draw list callback
+    ImVec2 rmin, rmax;
+    float min, max;
+    ImU32 color;
+    int vertex_count;
+    int pairs;
+} gpu_plot_t;
+
+// Compiles the shared shader; call once after the GL context was created
+int gpu_plot_setup();
+void gpu_plot_teardown();
+
+// Retains the newest `history` samples
+int gpu_plot_init(gpu_plot_t *plot, int history);
+void gpu_plot_destroy(gpu_plot_t *plot);
+
+// Appends samples, updating the pyramid in O(log n) per sample
+void gpu_plot_push(gpu_plot_t *plot, float const *samples, int count);
+
+// Lays out a plot widget showing the current view scaled to [min, max].
+// A size of zero picks the item width and a default height.
+void gpu_plot_draw(gpu_plot_t *plot, char const *label, float min, float max, ImVec2 size);
@@ -0,0 +1,45 @@
+//
+// Calibration time per accelerometer sample
+//
+// Built twice, as bench_calib and as bench_calib_fixed with
+// MOTION_FIXED_POINT, to compare make FIXED=1 with the float default.
+//
+
+#include "harness.h"
+#include "motion_input.c"
+
+#define BENCH_SAMPLES (10000000)
+
+int main() {
+    uint32_t const center[3] = { 512, 508, 530 };
+    uint32_t const unit[3] = { 104, 101, 98 };
+    accel_calib_t calib;
+    set_accel_calib(&calib, center, unit);
+
+    // A slow sweep, so the branch predictor has nothing to learn either way
+    static uint32_t raw[1024][3];
+    for(int i = 0; i < 1024; i++) {
+        raw[i][0] = (i * 7) & 1023;
+        raw[i][1] = (i * 13 + 300) & 1023;
+        raw[i][2] = (i * 29 + 600) & 1023;
+    }
+
+    float sum = 0;
+    double start = bench_seconds();
+    for(int i = 0; i < BENCH_SAMPLES; i++) {
+        motion_accel_t a;
+        apply_accel_calib(&calib, raw[i & 1023], &a);
+        sum += a.x + a.y + a.z;
+    }
+    double elapsed = bench_seconds() - start;
+    gBenchSink = sum;
+
+#ifdef MOTION_FIXED_POINT
+    char const *name = "fixed point";
+#else
+    char const *name = "float";
+#endif
+    printf("bench_calib: %-12s %5.2f ns/sample\n", name, elapsed / BENCH_SAMPLES * 1e9);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+//
+// Decode time per report, for every data report layout and extension
+//
+// Each case decodes a report as a Wiimote lying still sends it, with the
+// Nunchuk or MotionPlus at rest, over and over on one device; the time
+// includes emitting the events.
+//
+
+#include "harness.h"
+#include "motion_input.c"
+#include "sim_device.h"
+
+#define BENCH_REPORTS (1000000)
+
+// Core buttons and acceleration, without the report header
+#define CORE_ACCEL 0x40, 0x60, 0x82, 0x7F, 0x9A
+
+static uint8_t const gReportAccel[] = { 0xA1, 0x31, CORE_ACCEL };
+
+static uint8_t const gReportNunchuk[] = {
+    0xA1, 0x35, CORE_ACCEL,
+    0x7E, 0x80, 0x7F, 0x82, 0xB2, 0x93,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static uint8_t const gReportMotionPlus[] = {
+    0xA1, 0x35, CORE_ACCEL,
+    0x8A, 0x2C, 0x71, 0x7F, 0x7E, 0x7E,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+// The Nunchuk frame a MotionPlus in passthrough mode sends between its own
+static uint8_t const gReportPassthru[] = {
+    0xA1, 0x35, CORE_ACCEL,
+    0x7E, 0x80, 0x7F, 0x82, 0xB2, 0x8C,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+// Both clusters of a sensor bar in basic IR format, and a Nunchuk
+static uint8_t const gReportIrNunchuk[] = {
+    0xA1, 0x37, CORE_ACCEL,
+    0x9C, 0x80, 0x56, 0x64, 0x80, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x7E, 0x80, 0x7F, 0x82, 0xB2, 0x93,
+};
+
+static void bench_case(
+        struct motion_device *dev,
+        char const *name,
+        wiimote_ext_kind_t ext_kind,
+        uint8_t const *a, uint8_t const *b, int len) {
+    reset_device_state(dev);
+    dev->ext_status = EXT_STATUS_FOUND;
+    dev->ext_kind = ext_kind;
+    dev->ir_mode = WIIM_IR_MODE_BASIC;
+
+    uint64_t t = now_nanos();
+    double start = bench_seconds();
+    for(int i = 0; i < BENCH_REPORTS; i++) {
+        feed_report(dev, (i & 1) ? b : a, len, t);
+        t += 10000000;
+    }
+    double elapsed = bench_seconds() - start;
+
+    printf("  %-28s %7.1f ns/report\n", name, elapsed / BENCH_REPORTS * 1e9);
+}
+
+int main() {
+    struct motion_device *dev = open_sim_devices(1);
+    motion_subscribe(MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL |
+            MOTION_STREAM_EXTENSION | MOTION_STREAM_IR);
+
+    printf("bench_decode:\n");
+    bench_case(dev, "0x31 accel", EXT_KIND_NONE,
+            gReportAccel, gReportAccel, sizeof(gReportAccel));
+    bench_case(dev, "0x35 accel + nunchuk", EXT_KIND_NUNCHUCK,
+            gReportNunchuk, gReportNunchuk, sizeof(gReportNunchuk));
+    bench_case(dev, "0x35 accel + motionplus", EXT_KIND_ACTIVE_MOTION_PLUS,
+            gReportMotionPlus, gReportMotionPlus, sizeof(gReportMotionPlus));
+    bench_case(dev, "0x35 accel + passthrough",
+            EXT_KIND_ACTIVE_MOTION_PLUS_NUNCHUCK_PASSTHRU,
+            gReportMotionPlus, gReportPassthru, sizeof(gReportPassthru));
+    bench_case(dev, "0x37 accel + ir + nunchuk", EXT_KIND_NUNCHUCK,
+            gReportIrNunchuk, gReportIrNunchuk, sizeof(gReportIrNunchuk));
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+//
+// Gesture matching time, scalar against AVX2
+//
+// A grid of template counts, devices and report rates. Every device
+// pushes two seconds of noisy motion that replays one of the templates now
+// and then, so most windows are pruned and some go through DTW. The time
+// is per second of input over all devices, and the share of one core
+// that takes.
+//
+
+#include "harness.h"
+#include "gesture.c"
+
+#define BENCH_SECONDS (2)
+#define MAX_DEVICES (8)
+
+static gesture_template_t gTemplates[MOTION_GESTURE_MAX_TEMPLATES];
+static float gSamples[MOTION_GESTURE_MAX_TEMPLATES][MOTION_GESTURE_MAX_LEN * GESTURE_CHANNELS];
+static int gLens[MOTION_GESTURE_MAX_TEMPLATES];
+
+static uint32_t gSeed = 1;
+
+static float noise(float amp) {
+    gSeed = gSeed * 1664525 + 1013904223;
+    return amp * ((gSeed >> 8) / (float)(1 << 24) * 2 - 1);
+}
+
+// Swings of different speed and shape, half of them with gyro rates
+static void make_templates() {
+    for(int k = 0; k < MOTION_GESTURE_MAX_TEMPLATES; k++) {
+        int len = 40 + (k * 37) % (MOTION_GESTURE_MAX_LEN - 40);
+        int channels = (k & 1) ? GESTURE_CHANNELS : GESTURE_ACCEL_CHANNELS;
+        float *s = gSamples[k];
+
+        for(int i = 0; i < len; i++) {
+            float p = 2 * (float)M_PI * i / len;
+            float f[GESTURE_CHANNELS] = {
+                1.5f * sinf(p * (1 + k % 3)), cosf(p * (1 + k % 2)) - 1, 1 + 0.5f * sinf(2 * p + k),
+                200 * sinf(p), 150 * cosf(p * 2), 100 * sinf(p + k),
+            };
+            memcpy(s + i * channels, f, channels * sizeof(float));
+        }
+
+        gLens[k] = len;
+        if(gesture_template_init(&gTemplates[k], k, s, len, channels, 0.05f) != 0) {
+            fprintf(stderr, "bench_gesture: template %d rejected\n", k);
+        }
+    }
+}
+
+// Two seconds at `rate` for each of `devices` devices; returns seconds
+// taken and adds to the match and window counts
+static double run(int templates, int devices, int rate, unsigned long *matches, uint64_t *windows, uint64_t *pruned) {
+    static gesture_stream_t streams[MAX_DEVICES];
+    motion_gesture_t out[MOTION_GESTURE_MAX_TEMPLATES];
+    int const frames = BENCH_SECONDS * rate;
+    // Replay a template every 1.5 s, at a different offset per device
+    int const period = rate * 3 / 2;
+
+    for(int d = 0; d < devices; d++) {
+        gesture_stream_init(&streams[d]);
+    }
+
+    gSeed = 1;
+    double elapsed = 0;
+    for(int i = 0; i < frames; i++) {
+        for(int d = 0; d < devices; d++) {
+            // Resting, with sensor noise
+            float frame[GESTURE_CHANNELS] = {
+                noise(0.05f), noise(0.05f), 1 + noise(0.05f), noise(5), noise(5), noise(5),
+            };
+
+            int k = (i / period + d) % templates;
+            int at = (i + d * 17) % period;
+            if(at < gLens[k]) {
+                int channels = gTemplates[k].channels;
+                for(int c = 0; c < channels; c++) {
+                    frame[c] = gSamples[k][at * channels + c] + noise(0.05f);
+                }
+            }
+
+            double start = bench_seconds();
+            *matches += gesture_stream_push(&streams[d], frame, 1, gTemplates, templates, out);
+            elapsed += bench_seconds() - start;
+        }
+    }
+
+    for(int d = 0; d < devices; d++) {
+        *windows += streams[d].windows;
+        *pruned += streams[d].pruned;
+    }
+
+    return elapsed;
+}
+
+int main() {
+    static int const templates[] = { 1, 8, 32 };
+    static int const devices[] = { 1, 4, 8 };
+    static int const rates[] = { 100, 200 };
+
+    make_templates();
+    lb_keogh_fn const lb_dispatched = gLbKeogh;
+    band_row_fn const row_dispatched = gBandRow;
+    int const have_simd = lb_dispatched != lb_keogh_scalar;
+
+    printf("bench_gesture: us per second of input (%% of a core)%s\n",
+            have_simd ? "" : ", no AVX2 on this machine");
+    printf("  %-9s %-7s %-5s %18s %18s %8s %7s\n",
+            "templates", "devices", "rate", "scalar", "avx2", "speedup", "pruned");
+
+    for(size_t t = 0; t < sizeof(templates) / sizeof(templates[0]); t++) {
+        for(size_t d = 0; d < sizeof(devices) / sizeof(devices[0]); d++) {
+            for(size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+                unsigned long scalar_matches = 0, simd_matches = 0;
+                uint64_t windows = 0, pruned = 0, unused = 0;
+
+                gLbKeogh = lb_keogh_scalar;
+                gBandRow = band_row_scalar;
+                double scalar = run(templates[t], devices[d], rates[r], &scalar_matches, &windows, &pruned) / BENCH_SECONDS;
+
+                gLbKeogh = lb_dispatched;
+                gBandRow = row_dispatched;
+                double simd = run(templates[t], devices[d], rates[r], &simd_matches, &unused, &unused) / BENCH_SECONDS;
+
+                printf("  %-9d %-7d %-5d %9.0f (%5.2f%%) %9.0f (%5.2f%%) %7.2fx %6.1f%%\n",
+                        templates[t], devices[d], rates[r],
+                        scalar * 1e6, scalar * 100, simd * 1e6, simd * 100,
+                        scalar / simd, windows ? 100.0 * pruned / windows : 0.0);
+
+                // FMA rounds differently, which may only move a match
+                // that was right at the threshold
+                if(scalar_matches != simd_matches) {
+                    printf("    matches differ: %lu scalar, %lu avx2\n", scalar_matches, simd_matches);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
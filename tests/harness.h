@@ -0,0 +1,52 @@
+//
+// Helpers shared by the unit tests and benchmarks
+//
+// Tests and benchmarks include the library source they exercise, after
+// this header, so they can reach its static functions; the rest comes from
+// wiimote.a built with SIM=1.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+static int gTestFailures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        gTestFailures++; \
+    } \
+} while(0)
+
+#define CHECK_NEAR(a, b, tol) do { \
+    double _a = (a), _b = (b); \
+    if(!(fabs(_a - _b) <= (tol))) { \
+        printf("%s:%d: check failed: %s = %g, expected %g within %g\n", \
+                __FILE__, __LINE__, #a, _a, _b, (double)(tol)); \
+        gTestFailures++; \
+    } \
+} while(0)
+
+// Prints the verdict; returned from main
+static inline int test_result(char const *name) {
+    if(gTestFailures > 0) {
+        printf("%s: %d check(s) failed\n", name, gTestFailures);
+        return 1;
+    }
+
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+static inline double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Keeps the compiler from optimizing away work whose result is unused
+static volatile float gBenchSink;
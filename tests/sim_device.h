@@ -0,0 +1,51 @@
+//
+// Simulated devices for tests that include motion_input.c
+//
+// Include after motion_input.c. The devices skip the init sequence: they
+// come up ready, with the default calibration and no extension, and
+// reports are fed to them directly instead of being received.
+//
+
+#pragma once
+
+#include <stdlib.h>
+
+// Connects `count` simulated Wiimotes; returns the first one
+static inline struct motion_device *open_sim_devices(int count) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", count);
+    setenv("WIIMOTE_SIM_DEVICES", buf, 1);
+
+    wiimote_init();
+    struct wiimote_listener l = { wm_on_device_found };
+    wiimote_scan(&l, NULL);
+
+    for(struct motion_device *cur = gDevices; cur != NULL; cur = cur->next) {
+        reset_device_state(cur);
+        cur->state = DEV_STATE_READY;
+    }
+
+    return gDevices;
+}
+
+// Decodes a report the way poll_device would, at receive time `rx_nanos`
+static inline void feed_report(struct motion_device *dev, uint8_t const *data, int len, uint64_t rx_nanos) {
+    dev->rx_timestamp = rx_nanos / 1000;
+    handle_input_report(dev, (char const *)data, len);
+}
+
+// Takes the oldest event of `kind` out of the device's ring, dropping the
+// ones before it. Returns zero if there was none.
+static inline int take_event(struct motion_device *dev, motion_event_kind_t kind, motion_event_t *ev) {
+    while(get_event_ring(&dev->ev_ring, ev)) {
+        if(ev->kind == kind) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline void clear_events(struct motion_device *dev) {
+    init_event_ring(&dev->ev_ring);
+}
@@ -0,0 +1,59 @@
+//
+// The integer-only calibration (make FIXED=1) against the float one
+//
+// Always built without MOTION_FIXED_POINT, so apply_accel_calib is the
+// float path, while accel_recip and accel_fixed are what the fixed build
+// runs.
+// Sweeps every 10-bit reading through every usable unit at a range of
+// centers, and checks the error bound stated at accel_calib_t.
+//
+
+#include "harness.h"
+
+// Even in a make FIXED=1 tree
+#undef MOTION_FIXED_POINT
+#include "motion_input.c"
+
+static uint32_t const gCenters[] = { 0, 100, 400, 500, 512, 530, 600, 923, 1023 };
+
+int main() {
+    double worst = 0;
+
+    for(size_t c = 0; c < sizeof(gCenters) / sizeof(gCenters[0]); c++) {
+        for(uint32_t unit = 8; unit < 1024; unit++) {
+            uint32_t const center[3] = { gCenters[c], gCenters[c], gCenters[c] };
+            uint32_t const units[3] = { unit, unit, unit };
+            accel_calib_t calib;
+            set_accel_calib(&calib, center, units);
+            int32_t recip = accel_recip(unit);
+
+            for(uint32_t raw = 0; raw < 1024; raw++) {
+                uint32_t const r[3] = { raw, raw, raw };
+                motion_accel_t ref;
+                apply_accel_calib(&calib, r, &ref);
+
+                double fixed = accel_fixed(raw, (int32_t)center[0], recip) / (double)(1 << ACCEL_Q_SHIFT);
+                double bound = unit / (double)(1 << (ACCEL_RECIP_SHIFT + 1)) * fabs(ref.x) +
+                    1.0 / (1 << ACCEL_Q_SHIFT);
+                // Float rounding of the reference itself
+                bound += 1e-6 * fabs(ref.x);
+
+                double err = fabs(fixed - ref.x);
+                if(err > bound && gTestFailures < 10) {
+                    printf("center %u unit %u raw %u: fixed %.7f float %.7f\n",
+                            center[0], unit, raw, fixed, ref.x);
+                }
+                CHECK(err <= bound);
+
+                worst = err > worst ? err : worst;
+            }
+        }
+    }
+
+    // Units below 8 would overflow; they're treated as unusable
+    CHECK(accel_recip(7) == 0);
+    CHECK(accel_recip(8) == 1 << (ACCEL_RECIP_SHIFT - 3));
+
+    printf("test_accel_calib: worst error %.2e g\n", worst);
+    return test_result("test_accel_calib");
+}
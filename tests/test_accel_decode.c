@@ -0,0 +1,116 @@
+//
+// 10-bit acceleration decoded from every report mode that carries it
+//
+// The least significant bits of X, Y and Z ride in the core button bytes;
+// see accel_data_t. Each report is checked against values worked out by
+// hand from the bytes, with a calibration of center 0 and unit 1 so the
+// events carry the raw readings. Then a calibration block from the EEPROM
+// is read, and a reading checked in g.
+//
+
+#include "harness.h"
+
+// The raw readings only come out unchanged through the float path
+#undef MOTION_FIXED_POINT
+#include "motion_input.c"
+#include "sim_device.h"
+
+typedef struct accel_case {
+    // Core buttons and acceleration bytes, after the report header
+    uint8_t core[5];
+    uint32_t x, y, z;
+} accel_case_t;
+
+static accel_case_t const gCases[] = {
+    // Lying flat: X bits 1:0 = 2, Y and Z bit 1 set
+    { { 0x40, 0x60, 0x82, 0x7F, 0x9A }, 522, 510, 618 },
+    // Left, plus, A and B held; X bits 1:0 = 3; Y and Z bit 1 clear
+    { { 0x71, 0x0C, 0xFF, 0xFF, 0xFF }, 1023, 1020, 1020 },
+    // Every button held, which must not leak into the readings
+    { { 0x9F, 0x9F, 0x00, 0x00, 0x00 }, 0, 0, 0 },
+    // All the low bits set, no buttons
+    { { 0x60, 0x60, 0x00, 0x00, 0x00 }, 3, 2, 2 },
+    // X bits 1:0 = 1, only Z bit 1
+    { { 0x20, 0x40, 0x80, 0x80, 0x66 }, 513, 512, 410 },
+};
+
+#define NUM_CASES (sizeof(gCases) / sizeof(gCases[0]))
+
+// Report modes with acceleration and the size of their payload behind it
+static struct {
+    uint8_t mode;
+    int extra;
+} const gModes[] = {
+    { WIIM_REPORT_DATA_BUTTONS_ACCEL, 0 },
+    { WIIM_REPORT_DATA_BUTTONS_ACCEL_IR12, 12 },
+    { WIIM_REPORT_DATA_BUTTONS_ACCEL_EXT16, 16 },
+    { WIIM_REPORT_DATA_BUTTONS_ACCEL_IR10_EXT6, 16 },
+};
+
+int main() {
+    struct motion_device *dev = open_sim_devices(1);
+    uint32_t const center[3] = { 0, 0, 0 };
+    uint32_t const unit[3] = { 1, 1, 1 };
+    set_accel_calib(&dev->calib, center, unit);
+
+    uint64_t t = 1000000000;
+    for(size_t m = 0; m < sizeof(gModes) / sizeof(gModes[0]); m++) {
+        for(size_t i = 0; i < NUM_CASES; i++) {
+            uint8_t rep[32];
+            int len = 7 + gModes[m].extra;
+            memset(rep, 0xFF, sizeof(rep));
+            rep[0] = HID_INPUT_REPORT;
+            rep[1] = gModes[m].mode;
+            memcpy(rep + 2, gCases[i].core, sizeof(gCases[i].core));
+
+            clear_events(dev);
+            feed_report(dev, rep, len, t);
+            t += 10000000;
+
+            motion_event_t ev;
+            if(!take_event(dev, MI_EV_ACCEL, &ev)) {
+                printf("mode 0x%02x case %zu: no MI_EV_ACCEL\n", gModes[m].mode, i);
+                gTestFailures++;
+            } else if(ev.accel.x != gCases[i].x || ev.accel.y != gCases[i].y || ev.accel.z != gCases[i].z) {
+                printf("mode 0x%02x case %zu: got %g %g %g, expected %u %u %u\n",
+                        gModes[m].mode, i, ev.accel.x, ev.accel.y, ev.accel.z,
+                        gCases[i].x, gCases[i].y, gCases[i].z);
+                gTestFailures++;
+            }
+        }
+    }
+
+    // Calibration block at EEPROM 0x16 as a memory read returns it: 0 g
+    // at 515, 513, 514 and 1 g at 617, 623, 624, with the checksum
+    uint8_t const calib[] = {
+        HID_INPUT_REPORT, WIIM_REPORT_READ_MEM_AND_REGS_DATA, 0x00, 0x00,
+        0x90, 0x00, 0x16,
+        0x80, 0x80, 0x80, 0x36, 0x9A, 0x9B, 0x9C, 0x1C, 0x00, 0xF8,
+        0, 0, 0, 0, 0, 0,
+    };
+    feed_report(dev, calib, sizeof(calib), t);
+    CHECK(dev->calib_raw_valid);
+
+    // X at 617 and Z at 624 read 1 g; Y at 514 is 1 / 110 g above 0 g
+    uint8_t const rest[] = { HID_INPUT_REPORT, WIIM_REPORT_DATA_BUTTONS_ACCEL, 0x20, 0x20, 0x9A, 0x80, 0x9C };
+    motion_event_t ev;
+    clear_events(dev);
+    feed_report(dev, rest, sizeof(rest), t);
+    if(take_event(dev, MI_EV_ACCEL, &ev)) {
+        CHECK_NEAR(ev.accel.x, 1.0, 1e-6);
+        CHECK_NEAR(ev.accel.y, 1.0 / 110, 1e-6);
+        CHECK_NEAR(ev.accel.z, 1.0, 1e-6);
+    } else {
+        CHECK(!"no MI_EV_ACCEL after the calibration");
+    }
+
+    // A report too short for its mode is counted and not decoded
+    uint8_t const shortrep[] = { HID_INPUT_REPORT, WIIM_REPORT_DATA_BUTTONS_ACCEL, 0x40, 0x60, 0x82 };
+    unsigned long unhandled = dev->counters.unhandled_packets;
+    clear_events(dev);
+    feed_report(dev, shortrep, sizeof(shortrep), t);
+    CHECK(!take_event(dev, MI_EV_ACCEL, &ev));
+    CHECK(dev->counters.unhandled_packets == unhandled + 1);
+
+    return test_result("test_accel_decode");
+}
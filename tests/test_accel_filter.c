@@ -0,0 +1,134 @@
+//
+// MI_EV_ACCEL_FILTERED stages and their per-device state
+//
+// Step responses of the biquads and the one euro filter at
+// MOTION_FILTER_RATE, the low-pass gain at its cutoff, and filtered
+// events for more players than the filter was once sized for.
+//
+
+#include "harness.h"
+
+#include "motion_input.c"
+#include "sim_device.h"
+
+#define NUM_DEVICES (20)
+
+// Runs `n` samples of `x` on every axis through the device's stages and
+// returns the last output's x
+static float filter_const(struct motion_device *dev, float x, int n) {
+    motion_accel_t a = { x, x, x };
+    for(int i = 0; i < n; i++) {
+        a.x = a.y = a.z = x;
+        run_filters(dev, &a);
+    }
+    return a.x;
+}
+
+static void set_filter(motion_filter_kind_t kind, float cutoff_hz, float beta) {
+    motion_filter_t const f = { kind, cutoff_hz, 0, beta };
+    CHECK(motion_set_accel_filter(&f, 1) == 0);
+}
+
+static void test_biquads(struct motion_device *dev) {
+    // Primed on the first sample, so a constant input passes unchanged
+    set_filter(MOTION_FILTER_LOWPASS, 5, 0);
+    CHECK_NEAR(filter_const(dev, 1, 1), 1, 1e-5);
+    CHECK_NEAR(filter_const(dev, 1, 100), 1, 1e-5);
+
+    // Step down: starts at b0 of the way, settles at the new level
+    float first = filter_const(dev, 0, 1);
+    CHECK(first < 1 && first > 0.9f);
+    CHECK_NEAR(filter_const(dev, 0, 200), 0, 1e-5);
+
+    // High-pass: a step goes through at first and decays to nothing
+    set_filter(MOTION_FILTER_HIGHPASS, 5, 0);
+    CHECK_NEAR(filter_const(dev, 1, 1), 0, 1e-5);
+    first = filter_const(dev, 0, 1);
+    CHECK(first < -0.7f && first > -1);
+    CHECK_NEAR(filter_const(dev, 0, 200), 0, 1e-4);
+
+    // Gravity removal: gravity at rest, and a jolt, both drop out
+    set_filter(MOTION_FILTER_GRAVITY, 1, 0);
+    CHECK_NEAR(filter_const(dev, 1, 1), 0, 1e-5);
+    first = filter_const(dev, 3, 1);
+    CHECK(first > 1.9f && first < 2);
+    CHECK_NEAR(filter_const(dev, 3, 1000), 0, 1e-4);
+
+    // Butterworth low-pass: -3 dB at the cutoff
+    set_filter(MOTION_FILTER_LOWPASS, 10, 0);
+    filter_const(dev, 0, 1);
+    double sum = 0;
+    for(int i = 0; i < 2000; i++) {
+        float y = filter_const(dev, sinf(2 * (float)M_PI * 10 * i / MOTION_FILTER_RATE), 1);
+        sum += i >= 1000 ? y * y : 0;
+    }
+    CHECK_NEAR(sqrt(sum / 1000 * 2), M_SQRT1_2, 0.01);
+}
+
+static void test_one_euro(struct motion_device *dev) {
+    // Without beta, a one-pole low-pass at the cutoff
+    set_filter(MOTION_FILTER_ONE_EURO, 2, 0);
+    CHECK_NEAR(filter_const(dev, 0, 1), 0, 1e-6);
+    float alpha = 1.0f / (1.0f + MOTION_FILTER_RATE / (2.0f * (float)M_PI * 2));
+    for(int n = 1; n <= 20; n++) {
+        CHECK_NEAR(filter_const(dev, 1, 1), 1 - powf(1 - alpha, n), 1e-5);
+    }
+    CHECK_NEAR(filter_const(dev, 1, 500), 1, 1e-5);
+
+    // Speed opens it up, so the same step settles sooner
+    set_filter(MOTION_FILTER_ONE_EURO, 2, 1);
+    filter_const(dev, 0, 1);
+    float fast = filter_const(dev, 1, 10);
+    CHECK(fast > 1 - powf(1 - alpha, 10) + 0.05f);
+    CHECK_NEAR(filter_const(dev, 1, 500), 1, 1e-5);
+}
+
+// Every player gets a filtered stream of its own
+static void test_devices(struct motion_device *devs) {
+    set_filter(MOTION_FILTER_ONE_EURO, 1, 0);
+    motion_subscribe(MOTION_STREAM_ACCEL_FILTERED);
+
+    // Player p holds still at (p - 10) / 100 g on X, then every one but
+    // the last moves to 1 g
+    uint64_t t = 1000000000;
+    int p = 1;
+    for(int step = 0; step < 2; step++) {
+        p = 1;
+        for(struct motion_device *dev = devs; dev != NULL; dev = dev->next, p++) {
+            set_accel_calib(&dev->calib, (uint32_t const[3]){ 500, 500, 500 }, (uint32_t const[3]){ 100, 100, 100 });
+            uint32_t x = step == 0 || p == NUM_DEVICES ? 500 + (p - 10) : 600;
+            uint8_t const rep[] = {
+                HID_INPUT_REPORT, WIIM_REPORT_DATA_BUTTONS_ACCEL,
+                (x & 3) << 5, 0, x >> 2, 500 >> 2, 500 >> 2,
+            };
+
+            clear_events(dev);
+            feed_report(dev, rep, sizeof(rep), t);
+
+            motion_event_t ev;
+            if(!take_event(dev, MI_EV_ACCEL_FILTERED, &ev)) {
+                printf("player %d: no MI_EV_ACCEL_FILTERED\n", p);
+                gTestFailures++;
+            } else if(step == 0 || p == NUM_DEVICES) {
+                CHECK_NEAR(ev.accel.x, (p - 10) / 100.0, 1e-5);
+            } else {
+                // One sample into the step from its own level
+                CHECK(ev.accel.x > (p - 10) / 100.0 + 0.01 && ev.accel.x < 0.5);
+            }
+        }
+        t += 10000000;
+    }
+    CHECK(p == NUM_DEVICES + 1);
+
+    motion_unsubscribe(MOTION_STREAM_ACCEL_FILTERED);
+}
+
+int main() {
+    struct motion_device *dev = open_sim_devices(NUM_DEVICES);
+
+    test_biquads(dev);
+    test_one_euro(dev);
+    test_devices(dev);
+
+    return test_result("test_accel_filter");
+}
@@ -0,0 +1,137 @@
+//
+// Rumble patterns: the timer wheel, PWM duty and the output rate budget
+//
+// PWM is stepped through on a made-up clock, with no rate limit, so every
+// edge goes out as a report of its own. The wheel and the rate limit are
+// run on the real clock.
+//
+
+#include "harness.h"
+
+#include "motion_input.c"
+#include "sim_device.h"
+
+// Plays one step of `level` for `duration` milliseconds from `start`, and
+// returns the milliseconds the motor was on
+static uint64_t play_step(struct motion_device *dev, float level, uint64_t start, unsigned duration) {
+    haptics_t *h = &dev->haptics;
+    motion_rumble_step_t const step = { level, duration };
+
+    memcpy(h->steps, &step, sizeof(step));
+    h->count = 1;
+    h->repeat = 0;
+    h->step = 0;
+    h->step_start = start;
+    h->step_end = start + duration;
+
+    uint64_t on = 0, t = start;
+    advance_haptics(dev, t);
+    while(h->count > 0) {
+        CHECK(h->scheduled && h->due > t && h->due <= start + duration);
+        on += dev->rumble ? h->due - t : 0;
+        t = h->due;
+        advance_haptics(dev, t);
+    }
+
+    CHECK(!dev->rumble && !h->scheduled);
+    return on;
+}
+
+static void test_pwm_duty(struct motion_device *dev) {
+    static float const levels[] = { 0.0f, 0.1f, 0.25f, 0.5f, 0.75f, 1.0f };
+    gOutputInterval = 0;
+
+    for(size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        unsigned long sent = dev->out_queue.sent;
+        uint64_t on = play_step(dev, levels[i], 1000000, 10 * MOTION_RUMBLE_PWM_PERIOD);
+        unsigned long edges = dev->out_queue.sent - sent;
+
+        CHECK(on == (uint64_t)(levels[i] * 10 * MOTION_RUMBLE_PWM_PERIOD + 0.5f));
+        // Each period switches on and off, unless the motor never changes
+        if(levels[i] == 0.0f) {
+            CHECK(edges == 0);
+        } else if(levels[i] == 1.0f) {
+            CHECK(edges == 2);
+        } else {
+            CHECK(edges == 20);
+        }
+    }
+}
+
+static void test_rate_budget(struct motion_device *dev) {
+    output_queue_t *q = &dev->out_queue;
+    gOutputInterval = 10000;
+    drain_output_queue(dev);
+    sleep_micros(gOutputInterval);
+
+    // Switching faster than the limit allows neither sends nor queues more
+    unsigned long sent = q->sent;
+    uint64_t start = now_micros();
+    for(int i = 0; i < 1000; i++) {
+        rumble(dev, i & 1);
+        CHECK(q->count <= 1);
+    }
+    uint64_t elapsed = now_micros() - start;
+    CHECK(q->sent - sent <= 1 + elapsed / gOutputInterval);
+
+    // The last state still goes out
+    drain_output_queue(dev);
+    CHECK(q->count == 0 && dev->rumble == 1);
+    rumble(dev, 0);
+    drain_output_queue(dev);
+}
+
+static void test_wheel_order(struct motion_device *devs) {
+    // The last one is due after the wheel went round once
+    static unsigned const durations[] = { 30, 10, 300 };
+    static int const expected[] = { 1, 0, 2 };
+    struct motion_device *dev[3];
+    uint64_t end[3];
+    int order[3], stopped = 0;
+
+    gOutputInterval = 0;
+    for(int i = 0; i < 3; i++) {
+        motion_rumble_step_t const step = { 1.0f, durations[i] };
+        dev[i] = i == 0 ? devs : dev[i - 1]->next;
+        play_haptics(dev[i], &step, 1, 0);
+        end[i] = dev[i]->haptics.step_end;
+        CHECK(dev[i]->rumble);
+    }
+
+    uint64_t last = 0;
+    while(gWheelCount > 0) {
+        uint64_t due = next_haptics_due();
+        CHECK(due >= last);
+        last = due;
+
+        uint64_t now = now_millis();
+        if(due > now) {
+            sleep_micros((due - now) * 1000);
+        }
+        turn_haptics_wheel();
+
+        for(int i = 0; i < 3; i++) {
+            if(dev[i]->haptics.count == 0 && dev[i]->rumble == 0 && end[i] != 0) {
+                CHECK(now_millis() >= end[i]);
+                end[i] = 0;
+                order[stopped++] = i;
+            }
+        }
+    }
+
+    CHECK(stopped == 3);
+    for(int i = 0; i < stopped; i++) {
+        CHECK(order[i] == expected[i]);
+    }
+    CHECK(next_haptics_due() == UINT64_MAX);
+}
+
+int main() {
+    struct motion_device *dev = open_sim_devices(3);
+
+    test_pwm_duty(dev);
+    test_rate_budget(dev);
+    test_wheel_order(dev);
+
+    return test_result("test_haptics");
+}
@@ -0,0 +1,123 @@
+//
+// Sensor bar tracking along a generated trajectory
+//
+// The two clusters are projected from a known pose: the pointer, the roll
+// and the distance. Each is moved in turn, then the right cluster drops
+// out of view while the pointer keeps moving, and comes back. The pose
+// must be followed with little lag while moving, and settle on the true
+// one after each move.
+//
+
+#include <math.h>
+#include <string.h>
+
+#include "harness.h"
+#include "ir_tracker.h"
+
+typedef struct pose {
+    float x, y, distance, roll;
+} pose_t;
+
+// Dots of both clusters, rounded to whole pixels as the camera reports
+// them; the inverse of what ir_tracker_update works out
+static void project(pose_t const *p, ir_dot_t *left, ir_dot_t *right) {
+    float const half_w = IR_CAMERA_WIDTH / 2.0f, half_h = IR_CAMERA_HEIGHT / 2.0f;
+    float const focal = half_w / tanf(IR_CAMERA_FOV / 2);
+    float const sep = IR_BAR_WIDTH * focal / p->distance;
+
+    float ux = -p->x * half_w, uy = p->y * half_h;
+    float c = cosf(p->roll), s = sinf(p->roll);
+    float mx = half_w + ux * c - uy * s, my = half_h + ux * s + uy * c;
+
+    *left = (ir_dot_t){ roundf(mx - sep / 2 * c), roundf(my - sep / 2 * s), 5 };
+    *right = (ir_dot_t){ roundf(mx + sep / 2 * c), roundf(my + sep / 2 * s), 5 };
+}
+
+static ir_tracker_t gTracker;
+static pose_t gPose = { 0, 0, 2.0f, 0 };
+static int gReport = 0;
+
+// Largest lag seen while moving
+static float gLag[4];
+
+static void check_pose(char const *what, motion_pointer_t const *out, float tol_xy, float tol_dist, float tol_roll) {
+    float const err[4] = {
+        fabsf(out->x - gPose.x), fabsf(out->y - gPose.y),
+        fabsf(out->distance - gPose.distance), fabsf(out->roll - gPose.roll),
+    };
+    if(err[0] > tol_xy || err[1] > tol_xy || err[2] > tol_dist || err[3] > tol_roll) {
+        printf("%s, report %d: got %.3f %.3f %.3f m %.3f rad, expected %.3f %.3f %.3f m %.3f rad\n",
+                what, gReport, out->x, out->y, out->distance, out->roll,
+                gPose.x, gPose.y, gPose.distance, gPose.roll);
+        gTestFailures++;
+    }
+}
+
+// Moves the pose towards `to` over `reports`, then holds it for `hold`
+// more, feeding a report at every step. With `drop_right` the right
+// cluster is out of view throughout.
+static void move(char const *what, pose_t to, int reports, int hold, int drop_right, float tol_moving) {
+    pose_t const from = gPose;
+    motion_pointer_t out;
+
+    for(int i = 1; i <= reports + hold; i++, gReport++) {
+        float f = i < reports ? (float)i / reports : 1.0f;
+        gPose.x = from.x + f * (to.x - from.x);
+        gPose.y = from.y + f * (to.y - from.y);
+        gPose.distance = from.distance + f * (to.distance - from.distance);
+        gPose.roll = from.roll + f * (to.roll - from.roll);
+
+        ir_dot_t dots[2];
+        project(&gPose, &dots[0], &dots[1]);
+        if(!ir_tracker_update(&gTracker, dots, drop_right ? 1 : 2, &out)) {
+            printf("%s, report %d: sensor bar lost\n", what, gReport);
+            gTestFailures++;
+            return;
+        }
+
+        if(i <= reports) {
+            gLag[0] = fmaxf(gLag[0], fmaxf(fabsf(out.x - gPose.x), fabsf(out.y - gPose.y)));
+            gLag[1] = fmaxf(gLag[1], fabsf(out.distance - gPose.distance));
+            gLag[2] = fmaxf(gLag[2], fabsf(out.roll - gPose.roll));
+            // The distance is smoothed hardest, and its error is in meters
+            check_pose(what, &out, tol_moving, 2 * tol_moving, tol_moving);
+        }
+    }
+
+    // Settled; the roll is good to about a pixel over the separation
+    check_pose(what, &out, 0.005f, 0.02f, 0.015f);
+}
+
+int main() {
+    ir_tracker_init(&gTracker);
+
+    // A new pair is taken once it was the best for a few reports, and
+    // then reported without smoothing
+    motion_pointer_t out;
+    ir_dot_t dots[2];
+    project(&gPose, &dots[0], &dots[1]);
+    int found = 0;
+    for(; gReport < 10 && !found; gReport++) {
+        found = ir_tracker_update(&gTracker, dots, 2, &out);
+    }
+    CHECK(found && gReport <= 3);
+    check_pose("found", &out, 0.005f, 0.02f, 0.015f);
+    // Until then both dots were stray
+    unsigned long outliers = gTracker.outliers;
+
+    move("translation", (pose_t){ 0.5f, -0.3f, 2.0f, 0 }, 150, 150, 0, 0.05f);
+    move("roll", (pose_t){ 0.5f, -0.3f, 2.0f, 0.6f }, 100, 150, 0, 0.05f);
+    move("distance", (pose_t){ 0.5f, -0.3f, 3.5f, 0.6f }, 100, 150, 0, 0.05f);
+
+    // One cluster out of view for most of a second, the longest the
+    // other carries the pointer on its own; roll and distance stay
+    // where they were
+    move("right dropped", (pose_t){ 0.2f, -0.1f, 3.5f, 0.6f }, 50, 40, 1, 0.05f);
+    move("right back", (pose_t){ 0, 0, 3.5f, 0.6f }, 100, 150, 0, 0.05f);
+
+    // Neither cluster was taken for a stray dot since
+    CHECK(gTracker.outliers == outliers);
+
+    printf("test_ir_tracker: worst lag %.3f pointer, %.3f m, %.3f rad\n", gLag[0], gLag[1], gLag[2]);
+    return test_result("test_ir_tracker");
+}
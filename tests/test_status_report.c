@@ -0,0 +1,52 @@
+//
+// Status reports and the data report mode
+//
+// The mode is set again after a status report only when one arrived that
+// wasn't asked for, or the extension came or went; answers to the
+// periodic battery polls leave it alone.
+//
+
+#include "harness.h"
+
+#include "motion_input.c"
+#include "sim_device.h"
+
+// Feeds a status report and returns how many output reports it caused
+static unsigned long feed_status(struct motion_device *dev, int extension, uint64_t rx_nanos) {
+    uint8_t const rep[] = {
+        HID_INPUT_REPORT, WIIM_REPORT_STATUS_INFO, 0x00, 0x00,
+        0x10 | (extension ? WIIM_STATUS_FLAG_EXTENSION : 0), 0x00, 0x00, 0xC8,
+    };
+    unsigned long sent = dev->out_queue.sent;
+    feed_report(dev, rep, sizeof(rep), rx_nanos);
+    return dev->out_queue.sent - sent;
+}
+
+int main() {
+    struct motion_device *dev = open_sim_devices(1);
+    uint64_t t = 1000000000;
+
+    // Nothing queued and no rate limit, so every report goes out at once
+    gOutputInterval = 0;
+    dev->current_reporting_mode = WIIM_REPORT_DATA_BUTTONS_ACCEL;
+
+    // Battery polls
+    for(int i = 0; i < 3; i++) {
+        request_status_info(dev);
+        CHECK(dev->out_queue.count == 0);
+        CHECK(feed_status(dev, 0, t += 10000000) == 0);
+        CHECK(dev->status_valid && !dev->status.extension_connected);
+    }
+
+    // Unsolicited: the mode is set again
+    CHECK(feed_status(dev, 0, t += 10000000) == 1);
+    output_report_t const *last = &dev->out_queue.rep[(dev->out_queue.rd + OUTPUT_QUEUE_SIZ - 1) % OUTPUT_QUEUE_SIZ];
+    CHECK(last->data[1] == WIIM_REPORT_DATA_REPORT_MODE && last->data[3] == WIIM_REPORT_DATA_BUTTONS_ACCEL);
+
+    // An answer to a poll that also says an extension was plugged in
+    request_status_info(dev);
+    CHECK(feed_status(dev, 1, t += 10000000) == 1);
+    CHECK(dev->ext_changed);
+
+    return test_result("test_status_report");
+}
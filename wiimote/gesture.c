@@ -0,0 +1,273 @@
+//
+// Banded DTW gesture matching with LB_Keogh pruning
+//
+
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GESTURE_HAVE_AVX2 (1)
+#endif
+
+#include "gesture.h"
+
+typedef float (*lb_keogh_fn)(gesture_template_t const *t, float const *const *q);
+typedef void (*band_row_fn)(float const *ti, int channels, float const *const *q,
+        float const *prev, int lo, int hi, float *dist, float *m);
+
+// LB_Keogh: squared distance of the window to the template's envelope.
+// Only one of the two terms is nonzero, as lower never exceeds upper.
+static float lb_keogh_scalar(gesture_template_t const *t, float const *const *q) {
+    float acc = 0;
+    for(int c = 0; c < t->channels; c++) {
+        for(int i = 0; i < t->len; i++) {
+            float e = fmaxf(q[c][i] - t->upper[c][i], 0) + fmaxf(t->lower[c][i] - q[c][i], 0);
+            acc += e * e;
+        }
+    }
+
+    return acc;
+}
+
+// First half of a DTW row: for the columns in [lo, hi], the local
+// distance to template sample `ti`, and that plus the cheaper of the
+// diagonal and vertical predecessors. `prev` is indexed by column and
+// valid from lo - 1.
+static void band_row_scalar(float const *ti, int channels, float const *const *q,
+        float const *prev, int lo, int hi, float *dist, float *m) {
+    for(int j = lo; j <= hi; j++) {
+        float d = 0;
+        for(int c = 0; c < channels; c++) {
+            float e = ti[c] - q[c][j];
+            d += e * e;
+        }
+        dist[j] = d;
+        m[j] = d + fminf(prev[j], prev[j - 1]);
+    }
+}
+
+#ifdef GESTURE_HAVE_AVX2
+__attribute__((target("avx2,fma")))
+static float lb_keogh_avx2(gesture_template_t const *t, float const *const *q) {
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 acc = zero;
+    float tail = 0;
+
+    for(int c = 0; c < t->channels; c++) {
+        float const *u = t->upper[c], *l = t->lower[c], *x = q[c];
+        int i = 0;
+        for(; i + 8 <= t->len; i += 8) {
+            __m256 v = _mm256_loadu_ps(x + i);
+            __m256 above = _mm256_max_ps(_mm256_sub_ps(v, _mm256_loadu_ps(u + i)), zero);
+            __m256 below = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(l + i), v), zero);
+            __m256 e = _mm256_add_ps(above, below);
+            acc = _mm256_fmadd_ps(e, e, acc);
+        }
+        for(; i < t->len; i++) {
+            float e = fmaxf(x[i] - u[i], 0) + fmaxf(l[i] - x[i], 0);
+            tail += e * e;
+        }
+    }
+
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s) + tail;
+}
+
+__attribute__((target("avx2,fma")))
+static void band_row_avx2(float const *ti, int channels, float const *const *q,
+        float const *prev, int lo, int hi, float *dist, float *m) {
+    int j = lo;
+    for(; j + 8 <= hi + 1; j += 8) {
+        __m256 d = _mm256_setzero_ps();
+        for(int c = 0; c < channels; c++) {
+            __m256 e = _mm256_sub_ps(_mm256_set1_ps(ti[c]), _mm256_loadu_ps(q[c] + j));
+            d = _mm256_fmadd_ps(e, e, d);
+        }
+        _mm256_storeu_ps(dist + j, d);
+
+        __m256 p = _mm256_min_ps(_mm256_loadu_ps(prev + j), _mm256_loadu_ps(prev + j - 1));
+        _mm256_storeu_ps(m + j, _mm256_add_ps(d, p));
+    }
+
+    if(j <= hi) {
+        band_row_scalar(ti, channels, q, prev, j, hi, dist, m);
+    }
+}
+#endif
+
+static lb_keogh_fn gLbKeogh = lb_keogh_scalar;
+static band_row_fn gBandRow = band_row_scalar;
+static pthread_once_t gDispatchOnce = PTHREAD_ONCE_INIT;
+
+static void init_dispatch() {
+#ifdef GESTURE_HAVE_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        gLbKeogh = lb_keogh_avx2;
+        gBandRow = band_row_avx2;
+    }
+#endif
+}
+
+int gesture_template_init(gesture_template_t *t, int id, float const *samples, int len, int channels, float threshold) {
+    if(len < 2 || len > MOTION_GESTURE_MAX_LEN || threshold <= 0 ||
+            (channels != GESTURE_ACCEL_CHANNELS && channels != GESTURE_CHANNELS)) {
+        return 1;
+    }
+
+    pthread_once(&gDispatchOnce, init_dispatch);
+
+    memset(t, 0, sizeof(*t));
+    t->id = id;
+    t->len = len;
+    t->channels = channels;
+    t->band = len * GESTURE_BAND_PERCENT / 100;
+    t->band = t->band > 0 ? t->band : 1;
+    t->cutoff = threshold * len;
+
+    for(int i = 0; i < len; i++) {
+        for(int c = 0; c < channels; c++) {
+            float v = samples[i * channels + c];
+            t->t[c][i] = c < GESTURE_ACCEL_CHANNELS ? v : v * GESTURE_GYRO_SCALE;
+        }
+    }
+
+    for(int c = 0; c < channels; c++) {
+        for(int i = 0; i < len; i++) {
+            int lo = i - t->band > 0 ? i - t->band : 0;
+            int hi = i + t->band < len - 1 ? i + t->band : len - 1;
+            float u = t->t[c][lo], l = t->t[c][lo];
+            for(int k = lo + 1; k <= hi; k++) {
+                u = fmaxf(u, t->t[c][k]);
+                l = fminf(l, t->t[c][k]);
+            }
+            t->upper[c][i] = u;
+            t->lower[c][i] = l;
+        }
+    }
+
+    return 0;
+}
+
+void gesture_stream_init(gesture_stream_t *s) {
+    memset(s, 0, sizeof(*s));
+    for(int i = 0; i < MOTION_GESTURE_MAX_TEMPLATES; i++) {
+        s->cand[i].best = INFINITY;
+    }
+}
+
+// DTW distance between the template and the window `q`, or INFINITY once
+// it is certain to exceed the template's cutoff
+static float banded_dtw(gesture_template_t const *t, float const *const *q) {
+    // Rows indexed by column plus one; slot zero stands for column -1
+    float rows[2][MOTION_GESTURE_MAX_LEN + 2];
+    float dist[MOTION_GESTURE_MAX_LEN], m[MOTION_GESTURE_MAX_LEN];
+    float *prev = rows[0] + 1, *cur = rows[1] + 1;
+    int const len = t->len, band = t->band;
+
+    // Before the first row only the corner is reachable
+    for(int j = -1; j <= band + 1 && j < len; j++) {
+        prev[j] = INFINITY;
+    }
+    prev[-1] = 0;
+
+    for(int i = 0; i < len; i++) {
+        int lo = i - band > 0 ? i - band : 0;
+        int hi = i + band < len - 1 ? i + band : len - 1;
+
+        float ti[GESTURE_CHANNELS];
+        for(int c = 0; c < t->channels; c++) {
+            ti[c] = t->t[c][i];
+        }
+
+        gBandRow(ti, t->channels, q, prev, lo, hi, dist, m);
+
+        // The horizontal predecessor is the one step that can't be
+        // vectorised
+        float row_min = INFINITY;
+        cur[lo - 1] = INFINITY;
+        for(int j = lo; j <= hi; j++) {
+            cur[j] = fminf(m[j], dist[j] + cur[j - 1]);
+            row_min = fminf(row_min, cur[j]);
+        }
+        // Outside this row's band, as read by the next one
+        if(hi + 1 < len) {
+            cur[hi + 1] = INFINITY;
+        }
+
+        // Every path crosses every row, and costs only grow
+        if(row_min > t->cutoff) {
+            return INFINITY;
+        }
+
+        float *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    return prev[len - 1];
+}
+
+int gesture_stream_push(
+        gesture_stream_t *s,
+        float const *frame, int has_gyro,
+        gesture_template_t const *templates, int count,
+        motion_gesture_t *out) {
+    for(int c = 0; c < GESTURE_CHANNELS; c++) {
+        float v = c < GESTURE_ACCEL_CHANNELS ? frame[c] : frame[c] * GESTURE_GYRO_SCALE;
+        s->hist[c][s->pos] = v;
+        s->hist[c][s->pos + MOTION_GESTURE_MAX_LEN] = v;
+    }
+    int newest = s->pos + MOTION_GESTURE_MAX_LEN;
+    s->pos = (s->pos + 1) % MOTION_GESTURE_MAX_LEN;
+    s->count += s->count < MOTION_GESTURE_MAX_LEN ? 1 : 0;
+
+    int n = 0;
+    for(int k = 0; k < count; k++) {
+        gesture_template_t const *t = &templates[k];
+        gesture_candidate_t *cand = &s->cand[k];
+
+        if(cand->refractory > 0) {
+            cand->refractory--;
+            continue;
+        }
+
+        if(s->count < t->len || (t->channels > GESTURE_ACCEL_CHANNELS && !has_gyro)) {
+            continue;
+        }
+
+        float const *q[GESTURE_CHANNELS];
+        for(int c = 0; c < t->channels; c++) {
+            q[c] = &s->hist[c][newest - t->len + 1];
+        }
+
+        __atomic_fetch_add(&s->windows, 1, __ATOMIC_RELAXED);
+        float d = INFINITY;
+        if(gLbKeogh(t, q) <= t->cutoff) {
+            d = banded_dtw(t, q);
+        } else {
+            __atomic_fetch_add(&s->pruned, 1, __ATOMIC_RELAXED);
+        }
+
+        if(d <= t->cutoff && d < cand->best) {
+            // Still getting closer
+            cand->best = d;
+            continue;
+        }
+
+        if(cand->best <= t->cutoff) {
+            out[n].id = t->id;
+            out[n].confidence = 1.0f - cand->best / t->cutoff;
+            n++;
+
+            cand->best = INFINITY;
+            cand->refractory = t->len / 2;
+        }
+    }
+
+    return n;
+}
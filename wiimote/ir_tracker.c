@@ -0,0 +1,387 @@
+//
+// Sensor bar tracking from the IR camera's dots
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "ir_tracker.h"
+#include "one_euro.h"
+
+// Farthest a dot may be from where its track was heading, in pixels
+#define IR_GATE (80.0f)
+// Reports a track is kept after its dot disappeared
+#define IR_TRACK_HOLD (10)
+// Closest the two clusters may appear, in pixels; a bar 10 m away is
+// about 35 pixels wide
+#define IR_MIN_SEPARATION (16.0f)
+// Reports the pair is extrapolated from a single cluster, and the last
+// pose is taken as a hint for finding the bar again
+#define IR_EXTRAPOLATE_MAX (100)
+#define IR_PRIOR_MAX (300)
+// Highest score of the previous pair to keep it, of any other pair to
+// take it instead, and how much better than the previous pair that one
+// has to be
+#define IR_MAX_SCORE (1.5f)
+#define IR_ACQUIRE_SCORE (0.6f)
+#define IR_KEEP_BONUS (0.5f)
+// Reports in a row a new pair has to be the best candidate before it is
+// taken
+#define IR_CONFIRM_REPORTS (3)
+#define IR_REPORT_RATE (100.0f)
+
+// 1 euro filter parameters of x, y, distance and roll: the cutoff at
+// rest, in Hz, and how much it rises per unit of speed
+static float const gMinCutoff[4] = { 1.0f, 1.0f, 0.5f, 1.0f };
+static float const gBeta[4] = { 2.0f, 2.0f, 1.0f, 0.5f };
+
+static int valid_dot(unsigned x, unsigned y) {
+    return x < IR_CAMERA_WIDTH && y < IR_CAMERA_HEIGHT;
+}
+
+int ir_decode_basic(uint8_t const *data, ir_dot_t *dots) {
+    int n = 0;
+    for(int i = 0; i < 2; i++) {
+        uint8_t const *p = data + 5 * i;
+        unsigned x1 = p[0] | ((p[2] >> 4) & 0x03) << 8;
+        unsigned y1 = p[1] | ((p[2] >> 6) & 0x03) << 8;
+        unsigned x2 = p[3] | (p[2] & 0x03) << 8;
+        unsigned y2 = p[4] | ((p[2] >> 2) & 0x03) << 8;
+
+        if(valid_dot(x1, y1)) {
+            dots[n++] = (ir_dot_t){ (float)x1, (float)y1, -1 };
+        }
+        if(valid_dot(x2, y2)) {
+            dots[n++] = (ir_dot_t){ (float)x2, (float)y2, -1 };
+        }
+    }
+
+    return n;
+}
+
+int ir_decode_extended(uint8_t const *data, ir_dot_t *dots) {
+    int n = 0;
+    for(int i = 0; i < IR_MAX_DOTS; i++) {
+        uint8_t const *p = data + 3 * i;
+        unsigned x = p[0] | ((p[2] >> 4) & 0x03) << 8;
+        unsigned y = p[1] | ((p[2] >> 6) & 0x03) << 8;
+
+        if(valid_dot(x, y)) {
+            dots[n++] = (ir_dot_t){ (float)x, (float)y, p[2] & 0x0F };
+        }
+    }
+
+    return n;
+}
+
+void ir_tracker_init(ir_tracker_t *t) {
+    memset(t, 0, sizeof(*t));
+    t->left = t->right = -1;
+    t->cand_left = t->cand_right = -1;
+    t->lost = IR_PRIOR_MAX;
+}
+
+static float wrap_angle(float a) {
+    while(a > (float)M_PI) {
+        a -= 2.0f * (float)M_PI;
+    }
+    while(a < -(float)M_PI) {
+        a += 2.0f * (float)M_PI;
+    }
+    return a;
+}
+
+static ir_track_t *find_track(ir_tracker_t *t, int id) {
+    for(int k = 0; k < t->num_tracks; k++) {
+        if(t->tracks[k].id == id) {
+            return &t->tracks[k];
+        }
+    }
+
+    return NULL;
+}
+
+// Matches the dots to the tracks, closest pairs first, and starts tracks
+// for the dots left over
+static void associate(ir_tracker_t *t, ir_dot_t const *dots, int count) {
+    float d2[IR_MAX_DOTS][IR_MAX_TRACKS];
+    int dot_taken[IR_MAX_DOTS] = { 0 };
+    int track_taken[IR_MAX_TRACKS] = { 0 };
+
+    for(int i = 0; i < count; i++) {
+        for(int k = 0; k < t->num_tracks; k++) {
+            ir_track_t const *tr = &t->tracks[k];
+            float ex = dots[i].x - (tr->x + tr->vx * (tr->missed + 1));
+            float ey = dots[i].y - (tr->y + tr->vy * (tr->missed + 1));
+            d2[i][k] = ex * ex + ey * ey;
+        }
+    }
+
+    for(int n = 0; n < count; n++) {
+        int bi = -1, bk = -1;
+        float best = IR_GATE * IR_GATE;
+        for(int i = 0; i < count; i++) {
+            for(int k = 0; k < t->num_tracks; k++) {
+                if(!dot_taken[i] && !track_taken[k] && d2[i][k] < best) {
+                    best = d2[i][k];
+                    bi = i;
+                    bk = k;
+                }
+            }
+        }
+
+        if(bi < 0) {
+            break;
+        }
+
+        ir_track_t *tr = &t->tracks[bk];
+        float steps = (float)(tr->missed + 1);
+        tr->vx = 0.5f * tr->vx + 0.5f * (dots[bi].x - tr->x) / steps;
+        tr->vy = 0.5f * tr->vy + 0.5f * (dots[bi].y - tr->y) / steps;
+        tr->x = dots[bi].x;
+        tr->y = dots[bi].y;
+        tr->size = dots[bi].size;
+        tr->missed = -1;
+        dot_taken[bi] = track_taken[bk] = 1;
+    }
+
+    // Age the tracks, dropping those gone for too long
+    int kept = 0;
+    for(int k = 0; k < t->num_tracks; k++) {
+        ir_track_t *tr = &t->tracks[k];
+        if(++tr->missed > IR_TRACK_HOLD) {
+            continue;
+        }
+        t->tracks[kept++] = *tr;
+    }
+    t->num_tracks = kept;
+
+    for(int i = 0; i < count; i++) {
+        if(dot_taken[i]) {
+            continue;
+        }
+
+        // When full, a dot replaces the track missing the longest
+        int slot = t->num_tracks;
+        if(slot == IR_MAX_TRACKS) {
+            slot = -1;
+            for(int k = 0; k < t->num_tracks; k++) {
+                if(t->tracks[k].missed > 0 && (slot < 0 || t->tracks[k].missed > t->tracks[slot].missed)) {
+                    slot = k;
+                }
+            }
+            if(slot < 0) {
+                break;
+            }
+        } else {
+            t->num_tracks++;
+        }
+
+        t->tracks[slot] = (ir_track_t){ t->next_id++, dots[i].x, dots[i].y, 0, 0, dots[i].size, 0 };
+    }
+}
+
+// Lower is more like the sensor bar; INFINITY if it can't be. Swaps the
+// tracks so `*a` is the left cluster.
+static float score_pair(ir_tracker_t const *t, ir_track_t const **a, ir_track_t const **b) {
+    float dx = (*b)->x - (*a)->x, dy = (*b)->y - (*a)->y;
+    float sep = sqrtf(dx * dx + dy * dy);
+    if(sep < IR_MIN_SEPARATION) {
+        return INFINITY;
+    }
+
+    // Without a recent pose the Wiimote is assumed to be within 90
+    // degrees of upright, and only slightly more likely level
+    int recent = t->lost < IR_PRIOR_MAX;
+    float off = wrap_angle(atan2f(dy, dx) - (recent ? t->roll : 0));
+    if(fabsf(off) > (float)M_PI / 2) {
+        ir_track_t const *tmp = *a;
+        *a = *b;
+        *b = tmp;
+        off = wrap_angle(off + (float)M_PI);
+    }
+
+    float score = fabsf(off) * (recent ? 1.0f : 0.3f);
+
+    // The clusters are alike and usually the brightest dots around
+    if((*a)->size >= 0 && (*b)->size >= 0) {
+        score += 0.1f * abs((*a)->size - (*b)->size) - 0.02f * ((*a)->size + (*b)->size);
+    }
+
+    if(recent) {
+        float prev = sqrtf(t->sep_x * t->sep_x + t->sep_y * t->sep_y);
+        score += fabsf(logf(sep / prev));
+    }
+
+    return score;
+}
+
+static int same_pair(ir_track_t const *a, ir_track_t const *b, int id1, int id2) {
+    return (a->id == id1 && b->id == id2) || (a->id == id2 && b->id == id1);
+}
+
+static int set_pair(ir_tracker_t *t, ir_track_t const *left, ir_track_t const *right, int visible,
+        float *lx, float *ly, float *rx, float *ry) {
+    t->left = left->id;
+    t->right = right->id;
+    t->sep_x = right->x - left->x;
+    t->sep_y = right->y - left->y;
+    t->extrapolated = 0;
+    t->lost = 0;
+    t->confirmed = 0;
+    t->outliers += visible - 2;
+
+    *lx = left->x;
+    *ly = left->y;
+    *rx = right->x;
+    *ry = right->y;
+    return 1;
+}
+
+// Picks the pair of visible tracks most like the sensor bar. Returns
+// nonzero and the cluster positions if there is one, or if one cluster of
+// the previous pair is still in view.
+static int choose_pair(ir_tracker_t *t, float *lx, float *ly, float *rx, float *ry) {
+    ir_track_t const *l = t->left >= 0 ? find_track(t, t->left) : NULL;
+    ir_track_t const *r = t->right >= 0 ? find_track(t, t->right) : NULL;
+    l = l != NULL && l->missed == 0 ? l : NULL;
+    r = r != NULL && r->missed == 0 ? r : NULL;
+
+    // Where the cluster out of view should be, if one is
+    float ex = l != NULL ? l->x + t->sep_x : (r != NULL ? r->x - t->sep_x : 0);
+    float ey = l != NULL ? l->y + t->sep_y : (r != NULL ? r->y - t->sep_y : 0);
+
+    ir_track_t const *kl = NULL, *kr = NULL, *cl = NULL, *cr = NULL;
+    float kept_score = INFINITY, best = IR_ACQUIRE_SCORE;
+    int visible = 0;
+
+    for(int i = 0; i < t->num_tracks; i++) {
+        if(t->tracks[i].missed > 0) {
+            continue;
+        }
+        visible++;
+
+        for(int j = i + 1; j < t->num_tracks; j++) {
+            if(t->tracks[j].missed > 0) {
+                continue;
+            }
+
+            ir_track_t const *a = &t->tracks[i], *b = &t->tracks[j];
+            float score = score_pair(t, &a, &b);
+
+            if(same_pair(a, b, t->left, t->right)) {
+                kl = a;
+                kr = b;
+                kept_score = score;
+            } else if((l == NULL) != (r == NULL) && (a == l || a == r || b == l || b == r)) {
+                // The cluster that was out of view came back
+                ir_track_t const *o = (a == l || a == r) ? b : a;
+                float d2 = (o->x - ex) * (o->x - ex) + (o->y - ey) * (o->y - ey);
+                if(d2 < IR_GATE * IR_GATE && score < kept_score) {
+                    kl = a;
+                    kr = b;
+                    kept_score = score;
+                }
+            } else if(score < best) {
+                best = score;
+                cl = a;
+                cr = b;
+            }
+        }
+    }
+
+    // Anything else must be the best candidate for a few reports in a row,
+    // and clearly better than the previous pair
+    if(cl != NULL && same_pair(cl, cr, t->cand_left, t->cand_right)) {
+        t->confirmed++;
+    } else {
+        t->confirmed = cl != NULL ? 1 : 0;
+        t->cand_left = cl != NULL ? cl->id : -1;
+        t->cand_right = cl != NULL ? cr->id : -1;
+    }
+    int switch_ok = cl != NULL && t->confirmed >= IR_CONFIRM_REPORTS &&
+        (kl == NULL || best < kept_score - IR_KEEP_BONUS);
+
+    if(switch_ok) {
+        return set_pair(t, cl, cr, visible, lx, ly, rx, ry);
+    }
+    if(kl != NULL && kept_score <= IR_MAX_SCORE) {
+        return set_pair(t, kl, kr, visible, lx, ly, rx, ry);
+    }
+
+    // Keep the previous pair going on the cluster still in view
+    if((l != NULL || r != NULL) && t->extrapolated < IR_EXTRAPOLATE_MAX) {
+        t->extrapolated++;
+        t->outliers += visible - 1;
+        *lx = l != NULL ? l->x : ex;
+        *ly = l != NULL ? l->y : ey;
+        *rx = l != NULL ? ex : r->x;
+        *ry = l != NULL ? ey : r->y;
+        return 1;
+    }
+
+    t->left = t->right = -1;
+    t->lost += t->lost < IR_PRIOR_MAX ? 1 : 0;
+    t->outliers += visible;
+    return 0;
+}
+
+static void smooth_pose(ir_tracker_t *t, float const *raw) {
+    if(!t->primed) {
+        memcpy(t->smooth, raw, sizeof(t->smooth));
+        memset(t->speed, 0, sizeof(t->speed));
+        t->primed = 1;
+        return;
+    }
+
+    float const d_alpha = one_euro_d_alpha(IR_REPORT_RATE);
+    for(int c = 0; c < 4; c++) {
+        float delta = raw[c] - t->smooth[c];
+        if(c == 3) {
+            delta = wrap_angle(delta);
+        }
+
+        one_euro_step(&t->smooth[c], &t->speed[c], delta,
+                IR_REPORT_RATE, gMinCutoff[c], gBeta[c], d_alpha);
+    }
+    t->smooth[3] = wrap_angle(t->smooth[3]);
+}
+
+int ir_tracker_update(ir_tracker_t *t, ir_dot_t const *dots, int count, motion_pointer_t *out) {
+    count = count < IR_MAX_DOTS ? count : IR_MAX_DOTS;
+    associate(t, dots, count);
+
+    float lx, ly, rx, ry;
+    if(!choose_pair(t, &lx, &ly, &rx, &ry)) {
+        t->primed = 0;
+        return 0;
+    }
+
+    float const half_w = IR_CAMERA_WIDTH / 2.0f, half_h = IR_CAMERA_HEIGHT / 2.0f;
+    float const focal = half_w / tanf(IR_CAMERA_FOV / 2);
+
+    float sx = rx - lx, sy = ry - ly;
+    float roll = atan2f(sy, sx);
+    t->roll = roll;
+
+    // Undo the roll around the image center. The bar moves against the
+    // pointer: left when pointing right, down when pointing up.
+    float mx = (lx + rx) / 2 - half_w, my = (ly + ry) / 2 - half_h;
+    float c = cosf(roll), s = sinf(roll);
+    float ux = mx * c + my * s, uy = -mx * s + my * c;
+
+    float raw[4] = {
+        -ux / half_w,
+        uy / half_h,
+        IR_BAR_WIDTH * focal / sqrtf(sx * sx + sy * sy),
+        roll,
+    };
+    smooth_pose(t, raw);
+
+    out->x = t->smooth[0];
+    out->y = t->smooth[1];
+    out->distance = t->smooth[2];
+    out->roll = t->smooth[3];
+    return 1;
+}
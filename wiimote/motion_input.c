@@ -3,8 +3,19 @@
 #include <assert.h>
 #include <time.h>
 #include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "motion_input.h"
+#include "motion_trace.h"
+#include "speaker_codec.h"
+#include "gesture.h"
+#include "ir_tracker.h"
+#include "one_euro.h"
 #include "wiimote_protocol.h"
 
 typedef enum ext_status {
@@ -25,88 +36,715 @@ typedef enum wiimote_ext_kind {
     EXT_KIND_MAX
 } wiimote_ext_kind_t;
 
-#define BUTTON_PRESS_RING_SIZ (32)
-typedef struct button_press_ring {
+// Counters readable from other threads while the polling thread updates
+// them; only atomicity is needed, not ordering.
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define STAT_SET(counter, v) __atomic_store_n(&(counter), (v), __ATOMIC_RELAXED)
+
+#define EVENT_RING_SIZ (128)
+typedef struct event_ring {
     int rd, wr;
-    motion_button_press_t ev[BUTTON_PRESS_RING_SIZ];
-} button_press_ring_t;
+    unsigned long dropped;
+    motion_event_t ev[EVENT_RING_SIZ];
+} event_ring_t;
 
-inline void init_btn_press_ring(button_press_ring_t* r) {
+static inline void init_event_ring(event_ring_t* r) {
     r->rd = 0;
     r->wr = 0;
+    r->dropped = 0;
 }
 
-inline void put_btn_press_ring(
-        button_press_ring_t* r,
-        motion_button_press_t *mb) {
-    r->ev[r->wr] = *mb;
-    r->wr = (r->wr + 1) % BUTTON_PRESS_RING_SIZ;
+static inline void put_event_ring(
+        event_ring_t* r,
+        motion_event_t const *ev) {
+    r->ev[r->wr] = *ev;
+    r->wr = (r->wr + 1) % EVENT_RING_SIZ;
     if(r->wr == r->rd) {
-        r->rd = r->rd + 1;
+        // Overwrite the oldest event
+        r->rd = (r->rd + 1) % EVENT_RING_SIZ;
+        STAT_INC(r->dropped);
+    }
+}
+
+static inline motion_event_t const *peek_event_ring(event_ring_t const* r) {
+    if(r->rd == r->wr) {
+        return NULL;
     }
+
+    return &r->ev[r->rd];
 }
 
-inline int get_btn_press_ring(
-        button_press_ring_t* r,
-        motion_button_press_t *mb) {
+static inline int get_event_ring(
+        event_ring_t* r,
+        motion_event_t *ev) {
     if(r->rd == r->wr) {
         return 0;
     }
 
-    *mb = r->ev[r->rd];
-    r->rd = (r->rd + 1) % BUTTON_PRESS_RING_SIZ;
+    *ev = r->ev[r->rd];
+    r->rd = (r->rd + 1) % EVENT_RING_SIZ;
 
     return 1;
 }
 
+// Largest output report we send: a memory write is 2 + 5 + 16 bytes
+#define OUTPUT_REPORT_MAX_SIZ (23)
+#define OUTPUT_QUEUE_SIZ (32)
+#define DEFAULT_MAX_OUTPUT_RATE (100)
+
+typedef struct output_report {
+    uint8_t len;
+    uint8_t data[OUTPUT_REPORT_MAX_SIZ];
+} output_report_t;
+
+typedef struct output_queue {
+    int rd, wr, count;
+    output_report_t rep[OUTPUT_QUEUE_SIZ];
+
+    // Earliest time the next report may be sent, in microseconds
+    uint64_t next_send_time;
+
+    unsigned peak_count;
+    unsigned long sent;
+    unsigned long coalesced;
+} output_queue_t;
+
 typedef struct accel_data_f32 {
     float x, y, z;
 } accel_data_f32_t;
 
+// Maps raw 10-bit accelerometer readings to g: (raw - center) / unit
+//
+// The integer-only variant for targets without an FPU turns the division
+// into a multiplication by a reciprocal with ACCEL_RECIP_SHIFT fractional
+// bits; |raw - center| < 1024 and unit >= 8 keep the product within 32
+// bits. Rounding the reciprocal costs at most unit / 2^21 < 5e-4 of the
+// value, truncating to ACCEL_Q_SHIFT bits at most another 2^-16 g.
+#define ACCEL_RECIP_SHIFT (20)
+// Fractional bits of the calibrated values
+#define ACCEL_Q_SHIFT (16)
+
+// Also built without MOTION_FIXED_POINT, for the tests comparing both
+static inline int32_t accel_recip(uint32_t unit) {
+    return unit >= 8 ? (int32_t)(((1u << ACCEL_RECIP_SHIFT) + unit / 2) / unit) : 0;
+}
+
+static inline int32_t accel_fixed(uint32_t raw, int32_t center, int32_t recip) {
+    return (((int32_t)raw - center) * recip) >> (ACCEL_RECIP_SHIFT - ACCEL_Q_SHIFT);
+}
+
+#ifdef MOTION_FIXED_POINT
+typedef struct accel_calib {
+    int32_t center[3];
+    int32_t recip[3];
+} accel_calib_t;
+#else
+typedef struct accel_calib {
+    float center[3];
+    float unit[3];
+} accel_calib_t;
+#endif
+
+// Encoded audio buffered per device, two samples per byte
+#define SPEAKER_BUFFER_SIZ (4096)
+// Playback starts once this many bytes are buffered, or once the first of
+// them waited as long as playing them takes
+#define SPEAKER_PREBUFFER (3 * WIIM_SPEAKER_DATA_MAX)
+// Reports the speaker thread may fall behind before it skips ahead rather
+// than catching up in a burst that would overrun the device's buffer
+#define SPEAKER_MAX_LAG (2)
+
+typedef enum speaker_state {
+    SPEAKER_OFF = 0,
+    // Setup reports are queued; becomes active once they were sent
+    SPEAKER_CONFIGURING,
+    SPEAKER_ACTIVE,
+} speaker_state_t;
+
+typedef struct speaker {
+    // Used by the polling thread only
+    speaker_resampler_t resampler;
+    speaker_adpcm_t adpcm;
+
+    // Written by the polling thread with gSpeakerLock held, read by the
+    // speaker thread
+    speaker_state_t state;
+
+    // Protected by gSpeakerLock. `rd` and `wr` count every byte ever
+    // taken and queued.
+    uint8_t buf[SPEAKER_BUFFER_SIZ];
+    uint64_t rd, wr;
+    int playing;
+    // While playing, report deadlines are base_time plus the play time of
+    // every sample sent since, in nanoseconds, so they never drift
+    uint64_t base_time;
+    uint64_t samples_sent;
+    // When the buffer last stopped being empty
+    uint64_t fill_time;
+} speaker_t;
+
+// Microseconds between battery polls of a device
+#define STATUS_POLL_INTERVAL (60 * 1000000ull)
+
+// Reports the remote's sample clock is fitted to. The interval is the
+// least-squares slope of their receive times, which delivery jitter
+// doesn't bias; the phase is the lower envelope, as jitter only ever
+// delays a report.
+#define UNIFORM_HISTORY_SIZ (64)
+// Reports needed before output starts
+#define UNIFORM_WARMUP (16)
+// Jitter buffer delay bounds, in microseconds
+#define UNIFORM_MIN_DELAY (2000.0)
+#define UNIFORM_MAX_DELAY (200000.0)
+// Reports over which the delay comes back down once the jitter subsides
+#define UNIFORM_DELAY_DECAY (256)
+
+// Channels extrapolated by motion_predict: acceleration x, y, z, then
+// MotionPlus yaw, roll, pitch
+#define PREDICT_CHANNELS (6)
+// Fading-memory factor of the predictor; lower follows changes faster
+// and smooths less
+#define PREDICT_THETA (0.5f)
+// Furthest motion_predict extrapolates past the newest sample, in
+// microseconds
+#define PREDICT_MAX_HORIZON (100000.0)
+// Samples the error statistics average over
+#define PREDICT_ERROR_WINDOW (256)
+
+// Position, rate and acceleration of every channel, each group of
+// channels stamped with the sample time of its newest sample
+typedef enum predict_ready {
+    PREDICT_NONE = 0,
+    // Repeating the newest sample
+    PREDICT_HOLDING,
+    PREDICT_TRACKING,
+} predict_ready_t;
+
+typedef struct predict_state {
+    double time[2];
+    predict_ready_t ready[2];
+    float x[PREDICT_CHANNELS], v[PREDICT_CHANNELS], a[PREDICT_CHANNELS];
+} predict_state_t;
+
+typedef struct predictor {
+    predict_state_t state;
+    // Copy of `state` for motion_predict, behind a sequence lock: odd
+    // while the polling thread writes it
+    unsigned seq;
+    predict_state_t pub;
+
+    // The newest samples, and the mean squared one-step error of
+    // predicting and of holding them
+    float last[PREDICT_CHANNELS];
+    double predict_err2, hold_err2;
+    unsigned stat_predict, stat_hold;
+} predictor_t;
+
+typedef struct uniform_report {
+    uint64_t rx_time;
+    motion_accel_t accel;
+} uniform_report_t;
+
+typedef struct uniform_stage {
+    uniform_report_t hist[UNIFORM_HISTORY_SIZ];
+    // Reports seen; the newest is at (reports - 1) % UNIFORM_HISTORY_SIZ
+    uint64_t reports;
+
+    // Fitted clock: sample time of the newest report and the interval,
+    // in microseconds
+    double clock, period;
+    // Spread of the recent reports above the clock
+    double jitter;
+    double delay;
+
+    // Sample time of the next output is `base` plus `outputs` output
+    // periods
+    double base;
+    uint64_t outputs;
+
+    // For motion_get_stats
+    unsigned stat_interval, stat_jitter, stat_delay;
+    unsigned long underruns;
+} uniform_stage_t;
+
+// Rumble patterns are rendered by a timer wheel with one slot per
+// millisecond, turned by motion_poll
+#define HAPTICS_WHEEL_SIZ (256)
+
+typedef struct haptics {
+    motion_rumble_step_t steps[MOTION_RUMBLE_MAX_STEPS];
+    // Zero when no pattern is playing
+    int count;
+    int repeat;
+    int step;
+    // Bounds of the current step, in milliseconds
+    uint64_t step_start, step_end;
+
+    // Timer wheel linkage; `due` is in milliseconds
+    struct motion_device *wheel_next;
+    int scheduled;
+    uint64_t due;
+} haptics_t;
+
+// Calibration and extension kind of a Wiimote seen in an earlier session
+typedef struct calib_cache_entry {
+    char address[WIIMOTE_ADDRESS_SIZ];
+    // Raw calibration_data_t, checksum included
+    uint8_t calib[sizeof(calibration_data_t)];
+    wiimote_ext_kind_t ext_kind;
+} calib_cache_entry_t;
+
+#define CALIB_CACHE_SIZ (64)
+
+// Lanes per device: x, y, z and one of padding, so a device's axes make
+// up one vector
+#define FILTER_LANES (4)
+
+typedef struct filter_stage {
+    motion_filter_kind_t kind;
+    // Biquad, normalised to a0 = 1
+    float b0, b1, b2, a1, a2;
+    // One euro
+    float min_cutoff, beta, d_alpha;
+} filter_stage_t;
+
+// The stages every device's acceleration runs through
+typedef struct filter_bank {
+    int count;
+    filter_stage_t stages[MOTION_FILTER_MAX_STAGES];
+} filter_bank_t;
+
+// A device's state of every stage, one lane per axis. Biquads are in
+// transposed direct form II; the one euro filter keeps its last output in
+// z1 and the smoothed speed in z2.
+typedef struct filter_state {
+    float z1[MOTION_FILTER_MAX_STAGES][FILTER_LANES] __attribute__((aligned(16)));
+    float z2[MOTION_FILTER_MAX_STAGES][FILTER_LANES] __attribute__((aligned(16)));
+} filter_state_t;
+
+typedef enum device_state {
+    // Running the init sequence; see advance_init
+    DEV_STATE_INITIALIZING = 0,
+    DEV_STATE_READY,
+    // Connection lost; waiting for the discovery thread to reconnect
+    DEV_STATE_DISCONNECTED,
+} device_state_t;
+
+typedef enum init_step {
+    INIT_STEP_START = 0,
+    // Ready on the cached calibration; the extension is detected afterwards
+    INIT_STEP_CACHED,
+    INIT_STEP_UNLOCK_EXTENSION,
+    INIT_STEP_DISABLE_ENCRYPTION,
+    INIT_STEP_PROBE_PORT,
+    INIT_STEP_WAIT_PORT,
+    INIT_STEP_WAIT_MOTIONPLUS,
+    INIT_STEP_MOTIONPLUS_MODE,
+    INIT_STEP_MOTIONPLUS_DONE,
+} init_step_t;
+
+typedef struct device_counters {
+    unsigned long packets[MOTION_STATS_NUM_REPORT_CODES];
+    unsigned long long bytes;
+    unsigned long unhandled_packets;
+    unsigned long unknown_extensions;
+    unsigned long failed_reads;
+    unsigned long decode_time[MOTION_STATS_NUM_DECODE_BUCKETS];
+    unsigned long events_emitted;
+    unsigned long disconnects;
+    unsigned long reconnects;
+    unsigned long ir_outliers;
+    // Microseconds; zero if no packet arrived yet
+    uint64_t last_packet_time;
+} device_counters_t;
+
 struct motion_device {
     struct motion_device *next;
+    // 1-based position in the device list
+    int player;
 
     HWIIMOTE hDevice;
+    // Bluetooth address, empty if the transport has none
+    char address[WIIMOTE_ADDRESS_SIZ];
+    // Descriptor of hDevice registered with gEpollFd, or -1
+    int fd;
+    device_state_t state;
+    device_counters_t counters;
+
+    init_step_t init_step;
+    // The current init step runs init_delay microseconds after the
+    // output queue drained, at init_wake_time
+    uint64_t init_delay, init_wake_time;
+
+    output_queue_t out_queue;
     uint8_t current_reporting_mode;
+    // WIIM_IR_MODE_* the camera was set up for
+    uint8_t ir_mode;
+    ir_tracker_t ir;
+    // Whether the last MI_EV_POINTER had the sensor bar in view
+    int pointer_visible;
+    // Motor state, stamped onto every output report as it is sent; also
+    // read by the speaker thread
     int rumble;
+    haptics_t haptics;
+    // Allocated when the speaker is first enabled
+    speaker_t *speaker;
 
     ext_status_t ext_status;
     wiimote_ext_kind_t ext_kind;
+    // A status report said an extension was plugged in or removed
+    int ext_changed;
+    // Extension detection is running again on a ready device, after the
+    // extension was plugged in
+    int ext_redetect;
+    // Address space (0xA4 or 0xA6) of the signature read in flight
+    uint8_t ext_probe;
+    int ext_probe_failed;
+    uint64_t ext_probe_deadline;
+    // What answered at 0xA400FA
+    wiimote_ext_kind_t port_kind;
+    int has_nunchuk;
+
+    // Last status report, valid once one arrived
+    motion_status_t status;
+    int status_valid;
+    uint64_t next_status_poll;
+    // A status request is out; the next status report answers it
+    int status_requested;
 
     int btn_state_ready;
     buttons_t btn_state;
-    button_press_ring_t btn_press_ring;
-
-    int accel_changed;
-    accel_data_f32_t accel;
-    accel_data_f32_t calib_center, calib_unit;
+    event_ring_t ev_ring;
+    // Receive time of the packet being processed
+    uint64_t rx_timestamp;
+
+    accel_calib_t calib;
+    // Latest samples, for gesture matching
+    motion_accel_t accel;
+    motion_gyro_t gyro;
+    // A MotionPlus frame arrived since the extension was detected
+    int gyro_valid;
+    filter_state_t filter;
+    // `filter` holds state from an earlier sample
+    int filter_primed;
+    uniform_stage_t uniform;
+    predictor_t predictor;
+    // Allocated when the first frame is matched against gestures
+    gesture_stream_t *gestures;
+    // Calibration block as read from the device, valid once one with a
+    // matching checksum arrived
+    uint8_t calib_raw[sizeof(calibration_data_t)];
+    int calib_raw_valid;
+
+    int nunchuk_btn_ready;
+    int nunchuk_c, nunchuk_z;
+    accel_calib_t nunchuk_calib;
+    accel_data_f32_t nunchuk_stick_center, nunchuk_stick_unit;
 };
 
 static struct motion_device *gDevices = NULL;
 static int gIsInit = 0;
 
+#define MAX_PENDING_HANDLES (16)
+// Seconds between inquiries for new devices on the discovery thread
+#define DISCOVERY_INQUIRY_INTERVAL (30)
+// Seconds between attempts to reconnect lost devices
+#define DISCOVERY_RETRY_INTERVAL (1)
+#define DEFAULT_MAX_PLAYERS (4)
+
+#define NUM_STREAMS (5)
+// Number of subscribers of each MOTION_STREAM_* bit
+static int gStreamRefs[NUM_STREAMS] = { 0 };
+static int gStreamsChanged = 0;
+
+typedef struct report_layout {
+    uint8_t mode;
+    // Payload size, used to order the candidates
+    uint8_t len;
+    unsigned streams;
+    // Offsets into the packet, zero where absent
+    uint8_t accel_off, ir_off, ext_off;
+    uint8_t ir_mode;
+} report_layout_t;
+
+// Data reporting modes that include the core buttons, smallest first
+static report_layout_t const gReportLayouts[] = {
+    { WIIM_REPORT_MODE_BUTTONS,                  2,
+        MOTION_STREAM_BUTTONS,
+        0, 0, 0, WIIM_IR_MODE_OFF },
+    { WIIM_REPORT_MODE_BUTTONS_ACCEL,            5,
+        MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL,
+        4, 0, 0, WIIM_IR_MODE_OFF },
+    { WIIM_REPORT_MODE_BUTTONS_EXT8,             10,
+        MOTION_STREAM_BUTTONS | MOTION_STREAM_EXTENSION,
+        0, 0, 4, WIIM_IR_MODE_OFF },
+    { WIIM_REPORT_MODE_BUTTONS_ACCEL_IR12,       17,
+        MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL | MOTION_STREAM_IR,
+        4, 7, 0, WIIM_IR_MODE_EXTENDED },
+    { WIIM_REPORT_MODE_BUTTONS_ACCEL_EXT16,      21,
+        MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL | MOTION_STREAM_EXTENSION,
+        4, 0, 7, WIIM_IR_MODE_OFF },
+    { WIIM_REPORT_MODE_BUTTONS_IR10_EXT9,        21,
+        MOTION_STREAM_BUTTONS | MOTION_STREAM_IR | MOTION_STREAM_EXTENSION,
+        0, 4, 14, WIIM_IR_MODE_BASIC },
+    { WIIM_REPORT_MODE_BUTTONS_ACCEL_IR10_EXT6,  21,
+        MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL | MOTION_STREAM_IR | MOTION_STREAM_EXTENSION,
+        4, 7, 17, WIIM_IR_MODE_BASIC },
+};
+
+#define NUM_REPORT_LAYOUTS (sizeof(gReportLayouts) / sizeof(gReportLayouts[0]))
+
+static report_layout_t const *find_report_layout(uint8_t mode) {
+    for(size_t i = 0; i < NUM_REPORT_LAYOUTS; i++) {
+        if(gReportLayouts[i].mode == mode) {
+            return &gReportLayouts[i];
+        }
+    }
+
+    return NULL;
+}
+
+static pthread_t gDiscoveryThread;
+static int gDiscoveryRunning = 0;
+// The discovery thread's first inquiry runs right away, for the players
+// the device cache didn't bring
+static int gDiscoveryInquireNow = 0;
+static pthread_mutex_t gHotplugLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gHotplugCond = PTHREAD_COND_INITIALIZER;
+// Handles whose connection was lost; the discovery thread reconnects them
+static HWIIMOTE gLostHandles[MAX_PENDING_HANDLES];
+static int gNumLostHandles = 0;
+// Handles (re)connected by the discovery thread, picked up by motion_poll
+static HWIIMOTE gFoundHandles[MAX_PENDING_HANDLES];
+static int gNumFoundHandles = 0;
+// Background inquiries that failed
+static unsigned long gFailedInquiries = 0;
+// Minimum time between two output reports to the same device
+static uint64_t gOutputInterval = 1000000 / DEFAULT_MAX_OUTPUT_RATE;
+
+// Returned by motion_get_fd; watches every device and gWakeFd
+static int gEpollFd = -1;
+// Signalled when motion_poll has work that no device descriptor shows
+static int gWakeFd = -1;
+// Poll interval of devices whose transport has no descriptor, and of
+// devices running their init sequence, in milliseconds
+#define UNWATCHED_POLL_INTERVAL (1)
+
+// Devices with a pending haptics timer, by due time modulo the wheel size
+static struct motion_device *gWheel[HAPTICS_WHEEL_SIZ];
+static int gWheelCount = 0;
+// Last millisecond the wheel was turned to
+static uint64_t gWheelTick = 0;
+
+// Streams speaker reports of every device; started by the first
+// motion_speaker_enable
+static pthread_t gSpeakerThread;
+static int gSpeakerRunning = 0;
+static pthread_mutex_t gSpeakerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gSpeakerCond = PTHREAD_COND_INITIALIZER;
+
+// Loaded from gCalibCachePath by motion_init and rewritten whenever a
+// device reports something new; used by the polling thread only
+static char *gCalibCachePath = NULL;
+static calib_cache_entry_t gCalibCache[CALIB_CACHE_SIZ];
+static int gNumCalibCache = 0;
+
+// Coefficients only. Each device keeps its own filter_state_t and is
+// filtered on its own, as its report is decoded: reports arrive one
+// device at a time, so batching every device's axes into one pass would
+// mean holding samples back until the end of the poll loop. SIMD runs
+// across a device's lanes instead.
+static filter_bank_t gFilters;
+
+// Output rate of the uniform-rate stage, zero when off. The sample clock
+// is fitted either way, for the predictor.
+static int gUniformRate = 0;
+
+// Matched against every device's frames on the polling thread
+static gesture_template_t gGestures[MOTION_GESTURE_MAX_TEMPLATES];
+static int gNumGestures = 0;
+
+static uint64_t now_nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_micros() {
+    return now_nanos() / 1000;
+}
+
+static void sleep_micros(uint64_t micros) {
+    struct timespec ts = { micros / 1000000, (micros % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+// Output reports that only set a piece of device state; a newer one of the
+// same kind makes any pending older one redundant.
+static int is_state_report(uint8_t code) {
+    switch(code) {
+        case WIIM_REPORT_RUMBLE:
+        case WIIM_REPORT_LED:
+        case WIIM_REPORT_DATA_REPORT_MODE:
+        case WIIM_REPORT_IR_CAMERA_ENABLE:
+        case WIIM_REPORT_SPEAKER_ENABLE:
+        case WIIM_REPORT_STATUS_INFO_REQUEST:
+        case WIIM_REPORT_SPEAKER_MUTE:
+        case WIIM_REPORT_IR_CAMERA_ENABLE_2:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void send_head_of_queue(struct motion_device *dev, uint64_t now) {
+    output_queue_t *q = &dev->out_queue;
+    output_report_t *rep = &q->rep[q->rd];
+
+    // Every output report carries the rumble flag in its first byte; a
+    // stale one would switch the motor
+    rep->data[2] &= ~WIIM_DRM_FLAG_RUMBLE;
+    rep->data[2] |= dev->rumble ? WIIM_DRM_FLAG_RUMBLE : 0;
+
+    wiimote_send(dev->hDevice, rep->data, rep->len);
+
+    q->rd = (q->rd + 1) % OUTPUT_QUEUE_SIZ;
+    STAT_SET(q->count, q->count - 1);
+    STAT_INC(q->sent);
+    q->next_send_time = now + gOutputInterval;
+}
+
+// Sends as many queued output reports as the rate limit allows right now
+static void pump_output_queue(struct motion_device *dev) {
+    output_queue_t *q = &dev->out_queue;
+    uint64_t now = now_micros();
+
+    while(q->count > 0 && now >= q->next_send_time) {
+        send_head_of_queue(dev, now);
+    }
+}
+
+// Blocks until every queued output report has been sent
+static void drain_output_queue(struct motion_device *dev) {
+    output_queue_t *q = &dev->out_queue;
+
+    while(q->count > 0) {
+        uint64_t now = now_micros();
+        if(now < q->next_send_time) {
+            sleep_micros(q->next_send_time - now);
+        }
+        pump_output_queue(dev);
+    }
+}
+
+static void queue_output_report(
+        struct motion_device *dev,
+        void const *data,
+        size_t len) {
+    output_queue_t *q = &dev->out_queue;
+    struct wiimote_header const *hdr = (struct wiimote_header const *)data;
+    assert(len <= OUTPUT_REPORT_MAX_SIZ);
+
+    if(is_state_report(hdr->code)) {
+        // Walk back from the newest report; stop at anything that isn't
+        // a state report so we never move a state change across e.g. a
+        // register write that depends on it.
+        int n = q->count;
+        int i = q->wr;
+        while(n-- > 0) {
+            i = (i + OUTPUT_QUEUE_SIZ - 1) % OUTPUT_QUEUE_SIZ;
+            uint8_t code = q->rep[i].data[1];
+            if(!is_state_report(code)) {
+                break;
+            }
+
+            if(code == hdr->code) {
+                memcpy(q->rep[i].data, data, len);
+                q->rep[i].len = len;
+                STAT_INC(q->coalesced);
+                return;
+            }
+        }
+    }
+
+    if(q->count == OUTPUT_QUEUE_SIZ) {
+        // Never drop reports; make room by sending the oldest one early
+        send_head_of_queue(dev, now_micros());
+    }
+
+    memcpy(q->rep[q->wr].data, data, len);
+    q->rep[q->wr].len = len;
+    q->wr = (q->wr + 1) % OUTPUT_QUEUE_SIZ;
+    STAT_SET(q->count, q->count + 1);
+
+    if(q->count > q->peak_count) {
+        STAT_SET(q->peak_count, q->count);
+    }
+
+    pump_output_queue(dev);
+}
+
+static void wake_waiter() {
+    if(gWakeFd >= 0) {
+        uint64_t one = 1;
+        (void)!write(gWakeFd, &one, sizeof(one));
+    }
+}
+
+static void watch_device(struct motion_device *dev) {
+    dev->fd = wiimote_get_fd(dev->hDevice);
+    if(dev->fd >= 0 && gEpollFd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = dev };
+        if(epoll_ctl(gEpollFd, EPOLL_CTL_ADD, dev->fd, &ev) != 0) {
+            dev->fd = -1;
+        }
+    }
+}
+
+static void unwatch_device(struct motion_device *dev) {
+    if(dev->fd >= 0 && gEpollFd >= 0) {
+        epoll_ctl(gEpollFd, EPOLL_CTL_DEL, dev->fd, NULL);
+    }
+    dev->fd = -1;
+}
+
 static void wm_on_device_found(HWIIMOTE hDevice, void *user) {
     struct motion_device **next_ptr = &gDevices;
+    int player = 1;
 
     while(*next_ptr != NULL) {
         next_ptr = &(*next_ptr)->next;
+        player++;
     }
 
-    *next_ptr = (struct motion_device*)malloc(sizeof(struct motion_device));
-    memset(*next_ptr, 0, sizeof(struct motion_device));
-    (*next_ptr)->next = NULL;
-    (*next_ptr)->hDevice = hDevice;
+    struct motion_device *dev = (struct motion_device*)malloc(sizeof(struct motion_device));
+    memset(dev, 0, sizeof(struct motion_device));
+    dev->next = NULL;
+    dev->player = player;
+    dev->hDevice = hDevice;
+    dev->state = DEV_STATE_INITIALIZING;
+    dev->init_step = INIT_STEP_START;
+
+    dev->current_reporting_mode = 0x30;
+    if(wiimote_get_address(hDevice, dev->address, sizeof(dev->address)) != 0) {
+        dev->address[0] = '\0';
+    }
+    init_event_ring(&dev->ev_ring);
+    watch_device(dev);
 
-    (*next_ptr)->current_reporting_mode = 0x30;
+    // motion_get_stats may be walking the list on another thread
+    __atomic_store_n(next_ptr, dev, __ATOMIC_RELEASE);
 }
 
-static void send_led_output_report(HWIIMOTE hDev, uint8_t led_ctl) {
+static void send_led_output_report(struct motion_device *dev, uint8_t led_ctl) {
     struct pkt_led pkt;
     pkt.hdr.hdr.code = HID_OUTPUT_REPORT;
     pkt.hdr.code = WIIM_REPORT_LED;
     pkt.led_ctl = led_ctl;
 
-    wiimote_send(hDev, &pkt, sizeof(pkt));
+    queue_output_report(dev, &pkt, sizeof(pkt));
 }
 
 static void read_memory(
@@ -116,7 +754,7 @@ static void read_memory(
         uint32_t size) {
     struct pkt_memory_read pkt;
     init_memory_read(&pkt, address_space, address, size);
-    wiimote_send(dev->hDevice, &pkt, sizeof(pkt));
+    queue_output_report(dev, &pkt, sizeof(pkt));
 }
 
 static void write_memory(
@@ -147,7 +785,7 @@ static void write_memory(
         cur += 16;
         cur_data += 16;
 
-        wiimote_send(dev->hDevice, &pkt, sizeof(pkt));
+        queue_output_report(dev, &pkt, sizeof(pkt));
     }
 
     if(remains > 0) {
@@ -160,8 +798,9 @@ static void write_memory(
 
         pkt.siz = remains;
 
-        memcpy(pkt.data, cur_data, 16);
-        wiimote_send(dev->hDevice, &pkt, sizeof(pkt));
+        memset(pkt.data, 0, sizeof(pkt.data));
+        memcpy(pkt.data, cur_data, remains);
+        queue_output_report(dev, &pkt, sizeof(pkt));
     }
 }
 
@@ -171,20 +810,35 @@ static void set_report_mode(struct motion_device *dev, int is_continuous, uint8_
     pkt.hdr.code = WIIM_REPORT_DATA_REPORT_MODE;
     pkt.flags = 0;
     pkt.flags |= (is_continuous) ? WIIM_DRM_FLAG_CONTINUOUS : 0;
-    pkt.flags |= (dev->rumble) ? WIIM_DRM_FLAG_RUMBLE : 0;
     pkt.mode = report_mode;
 
-    wiimote_send(dev->hDevice, &pkt, sizeof(pkt));
+    queue_output_report(dev, &pkt, sizeof(pkt));
 }
 
+// Switches the motor. Every output report carries the flag, so the change
+// rides on whatever is queued; with nothing queued, a rumble report is.
+// Either way it goes out no faster than gOutputInterval allows, and a
+// change back before it went out replaces it.
 static void rumble(struct motion_device *dev, int rumble) {
+    rumble = rumble ? 1 : 0;
+    if(dev->rumble == rumble) {
+        return;
+    }
+
+    __atomic_store_n(&dev->rumble, rumble, __ATOMIC_RELAXED);
+
+    if(dev->out_queue.count > 0) {
+        pump_output_queue(dev);
+        return;
+    }
+
+    // The flag is stamped by send_head_of_queue
     struct pkt_status_request pkt;
     pkt.hdr.hdr.code = HID_OUTPUT_REPORT;
     pkt.hdr.code = WIIM_REPORT_RUMBLE;
-    pkt.flags = WIIM_DRM_FLAG_RUMBLE;
+    pkt.flags = 0;
 
-    wiimote_send(dev->hDevice, &pkt, sizeof(pkt));
-    dev->rumble = rumble;
+    queue_output_report(dev, &pkt, sizeof(pkt));
 }
 
 static void request_status_info(struct motion_device *dev) {
@@ -192,9 +846,164 @@ static void request_status_info(struct motion_device *dev) {
     pkt.hdr.hdr.code = HID_OUTPUT_REPORT;
     pkt.hdr.code = WIIM_REPORT_STATUS_INFO_REQUEST;
     pkt.flags = 0;
-    pkt.flags |= (dev->rumble) ? WIIM_DRM_FLAG_RUMBLE : 0;
 
-    wiimote_send(dev->hDevice, &pkt, sizeof(pkt));
+    dev->status_requested = 1;
+    queue_output_report(dev, &pkt, sizeof(pkt));
+}
+
+static uint64_t now_millis() {
+    return now_nanos() / 1000000;
+}
+
+static void unschedule_haptics(struct motion_device *dev) {
+    haptics_t *h = &dev->haptics;
+    if(!h->scheduled) {
+        return;
+    }
+
+    struct motion_device **link = &gWheel[h->due % HAPTICS_WHEEL_SIZ];
+    while(*link != dev) {
+        link = &(*link)->haptics.wheel_next;
+    }
+    *link = h->wheel_next;
+
+    h->scheduled = 0;
+    gWheelCount--;
+}
+
+static void schedule_haptics(struct motion_device *dev, uint64_t due) {
+    haptics_t *h = &dev->haptics;
+    unschedule_haptics(dev);
+
+    if(gWheelCount == 0) {
+        // The wheel stood still; don't replay the slots it skipped
+        gWheelTick = now_millis();
+    }
+
+    h->due = due;
+    h->wheel_next = gWheel[due % HAPTICS_WHEEL_SIZ];
+    gWheel[due % HAPTICS_WHEEL_SIZ] = dev;
+    h->scheduled = 1;
+    gWheelCount++;
+}
+
+static void stop_haptics(struct motion_device *dev) {
+    unschedule_haptics(dev);
+    dev->haptics.count = 0;
+}
+
+// Sets the motor for time `now` of the pattern and schedules the next
+// change: the end of the step, or the next PWM edge within it
+static void advance_haptics(struct motion_device *dev, uint64_t now) {
+    haptics_t *h = &dev->haptics;
+
+    while(now >= h->step_end) {
+        if(++h->step == h->count) {
+            if(!h->repeat) {
+                stop_haptics(dev);
+                rumble(dev, 0);
+                return;
+            }
+            h->step = 0;
+        }
+
+        h->step_start = h->step_end;
+        h->step_end += h->steps[h->step].duration_ms;
+    }
+
+    float level = h->steps[h->step].level;
+    uint64_t on_time = (uint64_t)(level * MOTION_RUMBLE_PWM_PERIOD + 0.5f);
+    uint64_t next = h->step_end;
+    int on;
+
+    if(on_time == 0 || on_time >= MOTION_RUMBLE_PWM_PERIOD) {
+        on = on_time != 0;
+    } else {
+        uint64_t phase = (now - h->step_start) % MOTION_RUMBLE_PWM_PERIOD;
+        on = phase < on_time;
+        uint64_t edge = now - phase + (on ? on_time : MOTION_RUMBLE_PWM_PERIOD);
+        next = edge < next ? edge : next;
+    }
+
+    rumble(dev, on);
+    schedule_haptics(dev, next);
+}
+
+static void play_haptics(
+        struct motion_device *dev,
+        motion_rumble_step_t const *steps,
+        int count,
+        int repeat) {
+    haptics_t *h = &dev->haptics;
+
+    stop_haptics(dev);
+    if(count == 0) {
+        rumble(dev, 0);
+        return;
+    }
+
+    memcpy(h->steps, steps, count * sizeof(steps[0]));
+    h->count = count;
+    h->repeat = repeat;
+    h->step = 0;
+    h->step_start = now_millis();
+    h->step_end = h->step_start + steps[0].duration_ms;
+    advance_haptics(dev, h->step_start);
+}
+
+// Fires the haptics timers that came due since the last turn
+static void turn_haptics_wheel() {
+    uint64_t now = now_millis();
+
+    if(gWheelCount == 0) {
+        gWheelTick = now;
+        return;
+    }
+
+    // Visiting every slot once covers any gap
+    uint64_t first = gWheelTick + 1;
+    if(now - gWheelTick > HAPTICS_WHEEL_SIZ) {
+        first = now - HAPTICS_WHEEL_SIZ + 1;
+    }
+    gWheelTick = now;
+
+    for(uint64_t t = first; t <= now; t++) {
+        struct motion_device **link = &gWheel[t % HAPTICS_WHEEL_SIZ];
+        while(*link != NULL) {
+            struct motion_device *dev = *link;
+            if(dev->haptics.due > now) {
+                // Due in a later turn of the wheel
+                link = &dev->haptics.wheel_next;
+                continue;
+            }
+
+            // Reschedules into a slot for a time after `now`
+            *link = dev->haptics.wheel_next;
+            dev->haptics.scheduled = 0;
+            gWheelCount--;
+            advance_haptics(dev, now);
+        }
+    }
+}
+
+// Earliest haptics timer in milliseconds, or UINT64_MAX if there is none
+static uint64_t next_haptics_due() {
+    uint64_t best = UINT64_MAX;
+
+    if(gWheelCount == 0) {
+        return best;
+    }
+
+    for(uint64_t t = gWheelTick + 1; t <= gWheelTick + HAPTICS_WHEEL_SIZ; t++) {
+        for(struct motion_device *cur = gWheel[t % HAPTICS_WHEEL_SIZ]; cur != NULL; cur = cur->haptics.wheel_next) {
+            if(cur->haptics.due <= t) {
+                return cur->haptics.due;
+            }
+            best = cur->haptics.due < best ? cur->haptics.due : best;
+        }
+    }
+
+    return best;
 }
 
 static void sleep_millis(int millis) {
@@ -204,67 +1013,272 @@ static void sleep_millis(int millis) {
     nanosleep(&ts, NULL);
 }
 
-static void process_extension_signature(struct motion_device *dev, void const *sig) {
-    dev->ext_status = EXT_STATUS_FOUND;
-    dev->ext_kind = EXT_KIND_NONE;
-
-    extension_signature_t* s = (extension_signature_t*)sig;
-
-    if(s->id == EXT_ID_MOTIONPLUS) {
-        if(s->base == 0xA620) {
+static void process_extension_signature(
+        struct motion_device *dev,
+        void const *sig,
+        int error) {
+    extension_signature_t const* s = (extension_signature_t const*)sig;
+
+    if(error) {
+        // Nothing answers at this address
+        dev->ext_probe_failed = 1;
+    } else if(s->id == EXT_ID_MOTIONPLUS) {
+        if(s->base_hi == 0xA6) {
             dev->ext_kind = EXT_KIND_INACTIVE_MOTION_PLUS;
+        } else if(s->state == EXT_MP_STATE_NUNCHUCK_PASSTHRU) {
+            dev->ext_kind = EXT_KIND_ACTIVE_MOTION_PLUS_NUNCHUCK_PASSTHRU;
         } else {
             dev->ext_kind = EXT_KIND_ACTIVE_MOTION_PLUS;
         }
+    } else if(s->id == EXT_ID_NUNCHUCK && s->state == 0x00) {
+        dev->has_nunchuk = 1;
+        dev->ext_kind = EXT_KIND_NUNCHUCK;
     } else {
-        printf("Unknown extension id %u\n", s->id);
+        STAT_INC(dev->counters.unknown_extensions);
+    }
+
+    dev->ext_status = EXT_STATUS_FOUND;
+}
+
+static void set_accel_calib(accel_calib_t *c, uint32_t const center[3], uint32_t const unit[3]) {
+    for(int i = 0; i < 3; i++) {
+#ifdef MOTION_FIXED_POINT
+        c->center[i] = (int32_t)center[i];
+        c->recip[i] = accel_recip(unit[i]);
+#else
+        c->center[i] = (float)center[i];
+        c->unit[i] = (float)unit[i];
+#endif
+    }
+}
+
+static void apply_accel_calib(accel_calib_t const *c, uint32_t const raw[3], motion_accel_t *out) {
+#ifdef MOTION_FIXED_POINT
+    int32_t q[3];
+    for(int i = 0; i < 3; i++) {
+        q[i] = accel_fixed(raw[i], c->center[i], c->recip[i]);
+    }
+
+    // The public event is still float; scaling by a power of two is exact
+    out->x = q[0] * (1.0f / (1 << ACCEL_Q_SHIFT));
+    out->y = q[1] * (1.0f / (1 << ACCEL_Q_SHIFT));
+    out->z = q[2] * (1.0f / (1 << ACCEL_Q_SHIFT));
+#else
+    out->x = ((float)raw[0] - c->center[0]) / c->unit[0];
+    out->y = ((float)raw[1] - c->center[1]) / c->unit[1];
+    out->z = ((float)raw[2] - c->center[2]) / c->unit[2];
+#endif
+}
+
+static void process_nunchuk_calibration_data(struct motion_device *dev, void const *data) {
+    nunchuk_calibration_data_t const* c = (nunchuk_calibration_data_t const*)data;
+
+    uint32_t x_0g = ((uint32_t)c->x_0g_hi << 2) | c->x_0g_lo;
+    uint32_t y_0g = ((uint32_t)c->y_0g_hi << 2) | c->y_0g_lo;
+    uint32_t z_0g = ((uint32_t)c->z_0g_hi << 2) | c->z_0g_lo;
+    uint32_t x_1g = ((uint32_t)c->x_1g_hi << 2) | c->x_1g_lo;
+    uint32_t y_1g = ((uint32_t)c->y_1g_hi << 2) | c->y_1g_lo;
+    uint32_t z_1g = ((uint32_t)c->z_1g_hi << 2) | c->z_1g_lo;
+
+    if(x_1g <= x_0g || y_1g <= y_0g || z_1g <= z_0g) {
+        // Garbage or an unprogrammed clone; keep the defaults
+        return;
+    }
+
+    uint32_t const center[3] = { x_0g, y_0g, z_0g };
+    uint32_t const unit[3] = { x_1g - x_0g, y_1g - y_0g, z_1g - z_0g };
+    set_accel_calib(&dev->nunchuk_calib, center, unit);
+
+    if(c->stick_x_max > c->stick_x_center && c->stick_x_center > c->stick_x_min &&
+            c->stick_y_max > c->stick_y_center && c->stick_y_center > c->stick_y_min) {
+        dev->nunchuk_stick_center.x = c->stick_x_center;
+        dev->nunchuk_stick_center.y = c->stick_y_center;
+        dev->nunchuk_stick_unit.x = (c->stick_x_max - c->stick_x_min) / 2.0f;
+        dev->nunchuk_stick_unit.y = (c->stick_y_max - c->stick_y_min) / 2.0f;
+    }
+}
+
+// The last byte of the calibration block is the sum of the others plus 0x55
+static int calibration_checksum_ok(uint8_t const *raw) {
+    uint8_t sum = 0x55;
+    for(size_t i = 0; i < sizeof(calibration_data_t) - 1; i++) {
+        sum += raw[i];
+    }
+
+    return sum == raw[sizeof(calibration_data_t) - 1];
+}
+
+static calib_cache_entry_t *find_calib_cache_entry(char const *address) {
+    for(int i = 0; i < gNumCalibCache; i++) {
+        if(strcmp(gCalibCache[i].address, address) == 0) {
+            return &gCalibCache[i];
+        }
+    }
+
+    return NULL;
+}
+
+// One line per device: address, calibration block in hex, extension kind
+static void load_calib_cache() {
+    FILE *f = fopen(gCalibCachePath, "r");
+    if(f == NULL) {
+        return;
+    }
+
+    char line[128];
+    while(gNumCalibCache < CALIB_CACHE_SIZ && fgets(line, sizeof(line), f) != NULL) {
+        calib_cache_entry_t *e = &gCalibCache[gNumCalibCache];
+        char hex[2 * sizeof(e->calib) + 1];
+        int ext_kind;
+
+        if(sscanf(line, "%17s %20s %d", e->address, hex, &ext_kind) != 3 ||
+                strlen(hex) != 2 * sizeof(e->calib) ||
+                ext_kind < 0 || ext_kind >= EXT_KIND_MAX) {
+            continue;
+        }
+
+        size_t i = 0;
+        while(i < sizeof(e->calib) && sscanf(hex + 2 * i, "%2hhx", &e->calib[i]) == 1) {
+            i++;
+        }
+
+        // A damaged entry only costs reading the calibration on connect
+        if(i < sizeof(e->calib) || !calibration_checksum_ok(e->calib) ||
+                find_calib_cache_entry(e->address) != NULL) {
+            continue;
+        }
+
+        e->ext_kind = (wiimote_ext_kind_t)ext_kind;
+        gNumCalibCache++;
+    }
+
+    fclose(f);
+}
+
+static void save_calib_cache() {
+    // Write a copy and move it over the original, so a crash halfway
+    // never leaves a truncated cache behind
+    size_t len = strlen(gCalibCachePath) + 5;
+    char *tmp = (char*)malloc(len);
+    snprintf(tmp, len, "%s.tmp", gCalibCachePath);
+
+    FILE *f = fopen(tmp, "w");
+    if(f == NULL) {
+        perror("motion_input: can't write calibration cache");
+        free(tmp);
+        return;
+    }
+
+    for(int i = 0; i < gNumCalibCache; i++) {
+        calib_cache_entry_t const *e = &gCalibCache[i];
+        fprintf(f, "%s ", e->address);
+        for(size_t j = 0; j < sizeof(e->calib); j++) {
+            fprintf(f, "%02x", e->calib[j]);
+        }
+        fprintf(f, " %d\n", (int)e->ext_kind);
+    }
+
+    if(fclose(f) != 0 || rename(tmp, gCalibCachePath) != 0) {
+        perror("motion_input: can't write calibration cache");
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+// Records the calibration and extension of a ready device, once both are
+// known, if they differ from the cache
+static void update_calib_cache(struct motion_device *dev) {
+    if(gCalibCachePath == NULL || dev->address[0] == '\0' || !dev->calib_raw_valid ||
+            dev->state != DEV_STATE_READY || dev->ext_redetect) {
+        return;
+    }
+
+    calib_cache_entry_t *e = find_calib_cache_entry(dev->address);
+    if(e == NULL) {
+        if(gNumCalibCache == CALIB_CACHE_SIZ) {
+            // Forget the oldest device
+            memmove(&gCalibCache[0], &gCalibCache[1], (CALIB_CACHE_SIZ - 1) * sizeof(gCalibCache[0]));
+            gNumCalibCache--;
+        }
+
+        e = &gCalibCache[gNumCalibCache++];
+        memcpy(e->address, dev->address, sizeof(e->address));
+    } else if(memcmp(e->calib, dev->calib_raw, sizeof(e->calib)) == 0 && e->ext_kind == dev->ext_kind) {
+        return;
     }
+
+    memcpy(e->calib, dev->calib_raw, sizeof(e->calib));
+    e->ext_kind = dev->ext_kind;
+    save_calib_cache();
 }
 
 static void process_calibration_data(struct motion_device *dev, void *data) {
     calibration_data_t* c = (calibration_data_t*)data;
 
-    uint32_t x_0g = ((uint32_t)c->x_0g_hi << 2);
-    uint32_t y_0g = ((uint32_t)c->y_0g_hi << 2);
-    uint32_t z_0g = ((uint32_t)c->z_0g_hi << 2);
-
-    x_0g |= c->x_0g_lo;
-    y_0g |= c->y_0g_lo;
-    z_0g |= c->z_0g_lo;
+    uint32_t x_0g = ((uint32_t)c->x_0g_hi << 2) | c->x_0g_lo;
+    uint32_t y_0g = ((uint32_t)c->y_0g_hi << 2) | c->y_0g_lo;
+    uint32_t z_0g = ((uint32_t)c->z_0g_hi << 2) | c->z_0g_lo;
+    uint32_t x_1g = ((uint32_t)c->x_1g_hi << 2) | c->x_1g_lo;
+    uint32_t y_1g = ((uint32_t)c->y_1g_hi << 2) | c->y_1g_lo;
+    uint32_t z_1g = ((uint32_t)c->z_1g_hi << 2) | c->z_1g_lo;
 
-    uint32_t x_1g = ((uint32_t)c->x_1g_hi << 2);
-    uint32_t y_1g = ((uint32_t)c->y_1g_hi << 2);
-    uint32_t z_1g = ((uint32_t)c->z_1g_hi << 2);
+    if(x_1g <= x_0g || y_1g <= y_0g || z_1g <= z_0g) {
+        // Garbage or an unprogrammed clone; keep the defaults
+        return;
+    }
 
-    x_1g |= c->x_0g_lo;
-    y_1g |= c->y_0g_lo;
-    z_1g |= c->z_0g_lo;
+    // One g is the distance between the two points, not the 1 g reading
+    uint32_t const center[3] = { x_0g, y_0g, z_0g };
+    uint32_t const unit[3] = { x_1g - x_0g, y_1g - y_0g, z_1g - z_0g };
+    set_accel_calib(&dev->calib, center, unit);
+}
 
-    dev->calib_center.x = (float)x_0g;
-    dev->calib_center.y = (float)y_0g;
-    dev->calib_center.z = (float)z_0g;
+static void on_calibration_read(struct motion_device *dev, void *data) {
+    process_calibration_data(dev, data);
 
-    dev->calib_unit.x   = (float)x_1g;
-    dev->calib_unit.y   = (float)y_1g;
-    dev->calib_unit.z   = (float)z_1g;
+    // Only a block that passes the checksum is trusted across sessions
+    if(calibration_checksum_ok((uint8_t const *)data)) {
+        memcpy(dev->calib_raw, data, sizeof(dev->calib_raw));
+        dev->calib_raw_valid = 1;
+        update_calib_cache(dev);
+    }
 }
 
 static void on_memory_read_results(struct motion_device *dev, struct wiimote_header *hdr) {
     struct pkt_memory_read_response* res = (struct pkt_memory_read_response*)hdr;
     if(res->off_mi == 0x00 && res->off_lo == 0xFA && dev->ext_status < EXT_STATUS_FOUND) {
-        process_extension_signature(dev, res->data);
+        process_extension_signature(dev, res->data, res->error != 0);
+    } else if(res->error != 0) {
+        STAT_INC(dev->counters.failed_reads);
     } else if(res->off_mi == 0x00 && res->off_lo == 0x16) {
         // Incoming calibration data
-        process_calibration_data(dev, res->data);
+        on_calibration_read(dev, res->data);
+    } else if(res->off_mi == 0x00 && res->off_lo == 0x20) {
+        process_nunchuk_calibration_data(dev, res->data);
     }
 }
 
+static void put_event_at(struct motion_device *dev, motion_event_t *ev, uint64_t timestamp) {
+    ev->player = dev->player;
+    ev->timestamp = timestamp;
+    MOTION_TRACE_INSTANT("enqueue", ev->kind);
+    put_event_ring(&dev->ev_ring, ev);
+    STAT_INC(dev->counters.events_emitted);
+}
+
+static void put_event(struct motion_device *dev, motion_event_t *ev) {
+    put_event_at(dev, ev, dev->rx_timestamp);
+}
+
 static void put_button_event(
         struct motion_device *dev,
         motion_button_t btn,
         int released) {
-    motion_button_press_t ev = { btn, released };
-    put_btn_press_ring(&dev->btn_press_ring, &ev);
+    motion_event_t ev;
+    ev.kind = MI_EV_BUTTON;
+    ev.btn.btn = btn;
+    ev.btn.released = released;
+    put_event(dev, &ev);
 }
 
 static void process_core_buttons(
@@ -295,128 +1309,1205 @@ static void process_core_buttons(
     dev->btn_state = rep->btn;
 }
 
-static void process_normal_accel_data(
-        struct motion_device *dev,
-        struct wiimote_header *hdr) {
-    struct button_accel_hdr *rep = (struct button_accel_hdr*)hdr;
+static int subscribed(unsigned stream) {
+    return gStreamRefs[__builtin_ctz(stream)] > 0;
+}
 
-    process_core_buttons(dev, hdr);
+// Sets every stage of a device to the steady state for a constant input
+// `x`, so filtering starts without a transient
+static void prime_filters(filter_state_t *fs, float const *x) {
+    float v[FILTER_LANES];
+    memcpy(v, x, sizeof(v));
+
+    for(int s = 0; s < gFilters.count; s++) {
+        filter_stage_t const *st = &gFilters.stages[s];
+        float *z1 = fs->z1[s], *z2 = fs->z2[s];
+
+        for(int a = 0; a < FILTER_LANES; a++) {
+            if(st->kind == MOTION_FILTER_ONE_EURO) {
+                z1[a] = v[a];
+                z2[a] = 0;
+                continue;
+            }
+
+            float y = v[a] * (st->b0 + st->b1 + st->b2) / (1.0f + st->a1 + st->a2);
+            z2[a] = st->b2 * v[a] - st->a2 * y;
+            z1[a] = st->b1 * v[a] - st->a1 * y + z2[a];
+            v[a] = st->kind == MOTION_FILTER_GRAVITY ? v[a] - y : y;
+        }
+    }
+}
 
-    dev->accel_changed = 1;
+// Runs a device's axes through every stage. Each stage handles all of a
+// device's lanes in straight-line loops, left for the compiler to
+// vectorise.
+static void run_filters(struct motion_device *dev, motion_accel_t *accel) {
+    filter_state_t *fs = &dev->filter;
+    float v[FILTER_LANES] = { accel->x, accel->y, accel->z, 0 };
 
-    uint32_t x32 = ((uint32_t)rep->accel.x) << 2;
-    uint32_t y32 = ((uint32_t)rep->accel.y) << 2;
-    uint32_t z32 = ((uint32_t)rep->accel.z) << 2;
+    if(!dev->filter_primed) {
+        prime_filters(fs, v);
+        dev->filter_primed = 1;
+    }
 
-    x32 |= (rep->accel.x2 << 0);
-    y32 |= (rep->accel.y2 << 1);
-    z32 |= (rep->accel.z2 << 1);
+    for(int s = 0; s < gFilters.count; s++) {
+        filter_stage_t const *st = &gFilters.stages[s];
+        float *z1 = fs->z1[s], *z2 = fs->z2[s];
+
+        if(st->kind == MOTION_FILTER_ONE_EURO) {
+            for(int a = 0; a < FILTER_LANES; a++) {
+                one_euro_step(&z1[a], &z2[a], v[a] - z1[a],
+                        MOTION_FILTER_RATE, st->min_cutoff, st->beta, st->d_alpha);
+                v[a] = z1[a];
+            }
+            continue;
+        }
 
-    dev->accel.x = ((float)x32 - dev->calib_center.x) / dev->calib_unit.x;
-    dev->accel.y = ((float)y32 - dev->calib_center.y) / dev->calib_unit.y;
-    dev->accel.z = ((float)z32 - dev->calib_center.z) / dev->calib_unit.z;
-}
+        float y[FILTER_LANES];
+        for(int a = 0; a < FILTER_LANES; a++) {
+            y[a] = st->b0 * v[a] + z1[a];
+            z1[a] = st->b1 * v[a] - st->a1 * y[a] + z2[a];
+            z2[a] = st->b2 * v[a] - st->a2 * y[a];
+        }
 
-static void handle_input_report(
-        struct motion_device *dev,
-        char const* buf,
-        int len
-) {
-    struct wiimote_header *hdr = (struct wiimote_header *)buf;
-    if(hdr->hdr.code != HID_INPUT_REPORT) {
-        assert(0);
-        return;
+        // Gravity removal keeps what the low-pass took out
+        float const keep = st->kind == MOTION_FILTER_GRAVITY ? 1.0f : 0.0f;
+        float const sign = st->kind == MOTION_FILTER_GRAVITY ? -1.0f : 1.0f;
+        for(int a = 0; a < FILTER_LANES; a++) {
+            v[a] = keep * v[a] + sign * y[a];
+        }
     }
 
-    switch(hdr->code) {
-        case WIIM_REPORT_STATUS_INFO:
-            set_report_mode(dev, 0, WIIM_REPORT_MODE_BUTTONS_ACCEL_EXT16);
-            break;
-        case WIIM_REPORT_READ_MEM_AND_REGS_DATA:
-            on_memory_read_results(dev, hdr);
-            break;
-        case WIIM_REPORT_DATA_BUTTONS_ACCEL_EXT16:
-            process_normal_accel_data(dev, hdr);
-            break;
-        default:
-            printf("packet code=%d len=%d was not handled\n", hdr->code, len);
-            break;
-    }
+    accel->x = v[0];
+    accel->y = v[1];
+    accel->z = v[2];
 }
 
-static void poll_device(struct motion_device *dev) {
-    char buffer[128];
-    int rd;
-    do {
-        rd = wiimote_recv(dev->hDevice, buffer, 128);
-
-        if(rd > 0) {
-            handle_input_report(dev, buffer, rd);
-        }
-    } while(rd != 0);
+// Fits the sample clock to the receive times of the reports in the
+// history, after one was added
+static void fit_uniform_clock(uniform_stage_t *u) {
+    int n = u->reports < UNIFORM_HISTORY_SIZ ? (int)u->reports : UNIFORM_HISTORY_SIZ;
+    uint64_t newest = u->hist[(u->reports - 1) % UNIFORM_HISTORY_SIZ].rx_time;
+
+    // Report k back from the newest sits at x = -k; times relative to the
+    // newest keep the sums small
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for(int k = 0; k < n; k++) {
+        double x = -k;
+        double y = (double)u->hist[(u->reports - 1 - k) % UNIFORM_HISTORY_SIZ].rx_time - (double)newest;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    u->period = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+
+    double lo = 0, hi = 0;
+    for(int k = 0; k < n; k++) {
+        double y = (double)u->hist[(u->reports - 1 - k) % UNIFORM_HISTORY_SIZ].rx_time - (double)newest;
+        double offset = y + k * u->period;
+        lo = offset < lo ? offset : lo;
+        hi = offset > hi ? offset : hi;
+    }
+    u->clock = (double)newest + lo;
+    u->jitter = hi - lo;
 }
 
-static int disable_encryption(struct motion_device *dev) {
-    uint8_t b0 = 0x55;
-    uint8_t b1 = 0x00;
-
-    write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA400F0, &b0, 1);
-    sleep_millis(100);
-    write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA400FB, &b1, 1);
-    sleep_millis(100);
+static void push_uniform_report(struct motion_device *dev, motion_accel_t const *accel) {
+    uniform_stage_t *u = &dev->uniform;
+    uniform_report_t *r = &u->hist[u->reports % UNIFORM_HISTORY_SIZ];
+    r->rx_time = dev->rx_timestamp;
+    r->accel = *accel;
+    u->reports++;
+
+    if(u->reports < UNIFORM_WARMUP) {
+        return;
+    }
+
+    fit_uniform_clock(u);
+
+    // Outputs interpolate between two reports, so the buffer covers the
+    // jitter plus one interval
+    double target = u->jitter + u->period + UNIFORM_MIN_DELAY;
+    target = target < UNIFORM_MAX_DELAY ? target : UNIFORM_MAX_DELAY;
+    if(u->reports == UNIFORM_WARMUP) {
+        u->delay = target;
+        u->base = u->clock;
+        u->outputs = 0;
+    } else if(target > u->delay) {
+        u->delay = target;
+    } else {
+        u->delay += (target - u->delay) / UNIFORM_DELAY_DECAY;
+    }
+
+    STAT_SET(u->stat_interval, (unsigned)(u->period * 1000));
+    STAT_SET(u->stat_jitter, (unsigned)u->jitter);
+    STAT_SET(u->stat_delay, (unsigned)u->delay);
+}
+
+// Local time the next uniform output is due, or UINT64_MAX
+static uint64_t uniform_due(struct motion_device *dev) {
+    uniform_stage_t const *u = &dev->uniform;
+    if(gUniformRate == 0 || u->reports < UNIFORM_WARMUP) {
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)(u->base + u->outputs * (1e6 / gUniformRate) + u->delay);
+}
+
+// Emits every uniform output whose jitter buffer delay passed
+static void service_uniform(struct motion_device *dev, uint64_t now) {
+    uniform_stage_t *u = &dev->uniform;
+
+    while(uniform_due(dev) <= now) {
+        double t = u->base + u->outputs * (1e6 / gUniformRate);
+
+        // Reports stopped, e.g. after a report mode change; start over
+        // once they resume
+        if(t - u->clock > UNIFORM_MAX_DELAY) {
+            u->reports = 0;
+            break;
+        }
+        int n = u->reports < UNIFORM_HISTORY_SIZ ? (int)u->reports : UNIFORM_HISTORY_SIZ;
+
+        // Reports lie exactly one interval apart on the fitted clock, so
+        // the pair around `t` follows from its distance to the newest
+        double back = (u->clock - t) / u->period;
+        motion_event_t ev;
+        ev.kind = MI_EV_ACCEL_UNIFORM;
+
+        if(back <= 0) {
+            // The next report is late; repeat the newest
+            ev.accel = u->hist[(u->reports - 1) % UNIFORM_HISTORY_SIZ].accel;
+            STAT_INC(u->underruns);
+        } else {
+            back = back < n - 1 ? back : n - 1;
+            int k = (int)back;
+            float frac = (float)(back - k);
+            motion_accel_t const *a = &u->hist[(u->reports - 1 - k) % UNIFORM_HISTORY_SIZ].accel;
+            motion_accel_t const *b = k + 1 < n ?
+                &u->hist[(u->reports - 2 - k) % UNIFORM_HISTORY_SIZ].accel : a;
+            ev.accel.x = a->x + (b->x - a->x) * frac;
+            ev.accel.y = a->y + (b->y - a->y) * frac;
+            ev.accel.z = a->z + (b->z - a->z) * frac;
+        }
+
+        put_event_at(dev, &ev, (uint64_t)t);
+        u->outputs++;
+    }
+}
+
+// Copies the state for motion_predict
+static void publish_prediction(predictor_t *p) {
+    __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    p->pub = p->state;
+    __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Sample time of the report being decoded on the fitted clock, or a
+// negative value while there is none
+static double sample_time(struct motion_device *dev) {
+    uniform_stage_t const *u = &dev->uniform;
+    if(u->reports >= UNIFORM_WARMUP &&
+            u->hist[(u->reports - 1) % UNIFORM_HISTORY_SIZ].rx_time == dev->rx_timestamp) {
+        return u->clock;
+    }
+
+    return -1;
+}
+
+// Feeds a group of channels (0 for acceleration, 1 for the gyro) to a
+// fading-memory alpha-beta-gamma filter
+static void update_predictor(struct motion_device *dev, int group, float const *z) {
+    predictor_t *p = &dev->predictor;
+    predict_state_t *s = &p->state;
+    int const first = group * 3;
+    double t = sample_time(dev);
+
+    if(t < 0 || s->ready[group] != PREDICT_TRACKING) {
+        // Reports often arrive in bursts, so receive times say little
+        // about when the samples were taken; hold the newest one until
+        // the clock is fitted
+        for(int c = first; c < first + 3; c++) {
+            s->x[c] = z[c - first];
+            s->v[c] = s->a[c] = 0;
+        }
+        s->ready[group] = t < 0 ? PREDICT_HOLDING : PREDICT_TRACKING;
+        s->time[group] = t < 0 ? (double)dev->rx_timestamp : t;
+    } else {
+        float dt = (float)((t - s->time[group]) / 1e6);
+        dt = dt > 0.001f ? dt : 0.001f;
+
+        float const th = PREDICT_THETA;
+        float const alpha = 1 - th * th * th;
+        float const beta = 1.5f * (1 - th * th) * (1 - th);
+        float const gamma = 0.5f * (1 - th) * (1 - th) * (1 - th);
+
+        double err2 = 0, hold2 = 0;
+        for(int c = first; c < first + 3; c++) {
+            float xp = s->x[c] + s->v[c] * dt + 0.5f * s->a[c] * dt * dt;
+            float vp = s->v[c] + s->a[c] * dt;
+            float r = z[c - first] - xp;
+            float h = z[c - first] - p->last[c];
+            err2 += r * r;
+            hold2 += h * h;
+
+            s->x[c] = xp + alpha * r;
+            s->v[c] = vp + beta * r / dt;
+            s->a[c] += 2 * gamma * r / (dt * dt);
+        }
+        s->time[group] = t;
+
+        if(group == 0) {
+            p->predict_err2 += (err2 - p->predict_err2) / PREDICT_ERROR_WINDOW;
+            p->hold_err2 += (hold2 - p->hold_err2) / PREDICT_ERROR_WINDOW;
+            STAT_SET(p->stat_predict, (unsigned)(sqrt(p->predict_err2) * 1000));
+            STAT_SET(p->stat_hold, (unsigned)(sqrt(p->hold_err2) * 1000));
+        }
+    }
+
+    memcpy(&p->last[first], z, 3 * sizeof(float));
+    publish_prediction(p);
+}
+
+static void process_normal_accel_data(
+        struct motion_device *dev,
+        struct wiimote_header *hdr) {
+    struct button_accel_hdr *rep = (struct button_accel_hdr*)hdr;
+
+    // See accel_data_t: X carries two low bits, Y and Z only bit 1
+    uint32_t const raw[3] = {
+        ((uint32_t)rep->accel.x << 2) | rep->accel.x2,
+        ((uint32_t)rep->accel.y << 2) | ((uint32_t)rep->accel.y2 << 1),
+        ((uint32_t)rep->accel.z << 2) | ((uint32_t)rep->accel.z2 << 1),
+    };
+
+    motion_event_t ev;
+    ev.kind = MI_EV_ACCEL;
+    apply_accel_calib(&dev->calib, raw, &ev.accel);
+    dev->accel = ev.accel;
+
+    int filtered = subscribed(MOTION_STREAM_ACCEL_FILTERED);
+    if(!filtered || subscribed(MOTION_STREAM_ACCEL)) {
+        put_event(dev, &ev);
+    }
+
+    if(filtered) {
+        ev.kind = MI_EV_ACCEL_FILTERED;
+        run_filters(dev, &ev.accel);
+        put_event(dev, &ev);
+    }
+
+    push_uniform_report(dev, &dev->accel);
+
+    float const z[3] = { dev->accel.x, dev->accel.y, dev->accel.z };
+    update_predictor(dev, 0, z);
+}
+
+static void put_nunchuk_event(
+        struct motion_device *dev,
+        uint8_t stick_x, uint8_t stick_y,
+        uint32_t x32, uint32_t y32, uint32_t z32,
+        int c, int z) {
+    motion_event_t ev;
+    ev.kind = MI_EV_NUNCHUK;
+    ev.nunchuk.stick_x = (stick_x - dev->nunchuk_stick_center.x) / dev->nunchuk_stick_unit.x;
+    ev.nunchuk.stick_y = (stick_y - dev->nunchuk_stick_center.y) / dev->nunchuk_stick_unit.y;
+    uint32_t const raw[3] = { x32, y32, z32 };
+    apply_accel_calib(&dev->nunchuk_calib, raw, &ev.nunchuk.accel);
+    put_event(dev, &ev);
+
+    if(!dev->nunchuk_btn_ready) {
+        dev->nunchuk_c = c;
+        dev->nunchuk_z = z;
+        dev->nunchuk_btn_ready = 1;
+    }
+
+    if(dev->nunchuk_c != c) put_button_event(dev, MB_C, !c);
+    if(dev->nunchuk_z != z) put_button_event(dev, MB_Z, !z);
+
+    dev->nunchuk_c = c;
+    dev->nunchuk_z = z;
+}
+
+static void process_nunchuk_data(struct motion_device *dev, uint8_t const *ext) {
+    nunchuk_data_t const *d = (nunchuk_data_t const *)ext;
+
+    put_nunchuk_event(dev, d->stick_x, d->stick_y,
+            ((uint32_t)d->accel_x_hi << 2) | d->accel_x_lo,
+            ((uint32_t)d->accel_y_hi << 2) | d->accel_y_lo,
+            ((uint32_t)d->accel_z_hi << 2) | d->accel_z_lo,
+            !d->c, !d->z);
+}
+
+static void process_nunchuk_passthru_data(struct motion_device *dev, uint8_t const *ext) {
+    nunchuk_passthru_data_t const *d = (nunchuk_passthru_data_t const *)ext;
+
+    put_nunchuk_event(dev, d->stick_x, d->stick_y,
+            ((uint32_t)d->accel_x_hi << 2) | (d->accel_x_lo << 1),
+            ((uint32_t)d->accel_y_hi << 2) | (d->accel_y_lo << 1),
+            ((uint32_t)d->accel_z_hi << 3) | (d->accel_z_lo << 1),
+            !d->c, !d->z);
+}
+
+static float motionplus_rate(uint32_t raw, int slow_mode) {
+    // 8192 is the nominal zero point; about 16.4 units per degree per
+    // second in slow mode, 4.5 times less sensitive in fast mode
+    float rate = ((float)raw - 8192.0f) / 16.4f;
+    return slow_mode ? rate : rate * (2000.0f / 440.0f);
+}
+
+static void process_motionplus_data(struct motion_device *dev, uint8_t const *ext) {
+    motionplus_data_t const *d = (motionplus_data_t const *)ext;
+
+    uint32_t yaw   = ((uint32_t)d->yaw_down_speed_hi << 8)   | d->yaw_down_speed_lo;
+    uint32_t roll  = ((uint32_t)d->roll_left_speed_hi << 8)  | d->roll_left_speed_lo;
+    uint32_t pitch = ((uint32_t)d->pitch_left_speed_hi << 8) | d->pitch_left_speed_lo;
+
+    motion_event_t ev;
+    ev.kind = MI_EV_GYRO;
+    ev.gyro.yaw   = motionplus_rate(yaw,   d->yaw_slow_mode);
+    ev.gyro.roll  = motionplus_rate(roll,  d->roll_slow_mode);
+    ev.gyro.pitch = motionplus_rate(pitch, d->pitch_slow_mode);
+    dev->gyro = ev.gyro;
+    dev->gyro_valid = 1;
+    put_event(dev, &ev);
+
+    float const z[3] = { ev.gyro.yaw, ev.gyro.roll, ev.gyro.pitch };
+    update_predictor(dev, 1, z);
+}
+
+static void process_extension_data(struct motion_device *dev, uint8_t const *ext) {
+    switch(dev->ext_kind) {
+        case EXT_KIND_NUNCHUCK:
+            process_nunchuk_data(dev, ext);
+            break;
+        case EXT_KIND_ACTIVE_MOTION_PLUS:
+        case EXT_KIND_ACTIVE_MOTION_PLUS_NUNCHUCK_PASSTHRU:
+            // In passthrough mode the MotionPlus alternates between its own
+            // frames and Nunchuk frames, so each stream runs at half the
+            // report rate.
+            if(((motionplus_data_t const *)ext)->one) {
+                process_motionplus_data(dev, ext);
+            } else if(dev->ext_kind == EXT_KIND_ACTIVE_MOTION_PLUS_NUNCHUCK_PASSTHRU) {
+                process_nunchuk_passthru_data(dev, ext);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Matches the frame just decoded against the gesture templates
+static void match_gestures(struct motion_device *dev) {
+    if(dev->gestures == NULL) {
+        gesture_stream_t *s = (gesture_stream_t*)malloc(sizeof(gesture_stream_t));
+        if(s == NULL) {
+            return;
+        }
+        gesture_stream_init(s);
+        // motion_get_stats reads its counters on another thread
+        __atomic_store_n(&dev->gestures, s, __ATOMIC_RELEASE);
+    }
+
+    float const frame[GESTURE_CHANNELS] = {
+        dev->accel.x, dev->accel.y, dev->accel.z,
+        dev->gyro.yaw, dev->gyro.roll, dev->gyro.pitch,
+    };
+
+    motion_gesture_t matches[MOTION_GESTURE_MAX_TEMPLATES];
+    int n = gesture_stream_push(dev->gestures, frame, dev->gyro_valid, gGestures, gNumGestures, matches);
+
+    for(int i = 0; i < n; i++) {
+        motion_event_t ev;
+        ev.kind = MI_EV_GESTURE;
+        ev.gesture = matches[i];
+        put_event(dev, &ev);
+    }
+}
+
+static void put_pointer_lost(struct motion_device *dev) {
+    motion_event_t ev;
+    ev.kind = MI_EV_POINTER;
+    memset(&ev.pointer, 0, sizeof(ev.pointer));
+    put_event(dev, &ev);
+    dev->pointer_visible = 0;
+}
+
+static void process_ir_data(struct motion_device *dev, uint8_t const *data, uint8_t ir_mode) {
+    ir_dot_t dots[IR_MAX_DOTS];
+    int count = ir_mode == WIIM_IR_MODE_EXTENDED ? ir_decode_extended(data, dots) : ir_decode_basic(data, dots);
+
+    unsigned long outliers = dev->ir.outliers;
+    motion_event_t ev;
+    ev.kind = MI_EV_POINTER;
+    ev.pointer.visible = ir_tracker_update(&dev->ir, dots, count, &ev.pointer);
+    STAT_ADD(dev->counters.ir_outliers, dev->ir.outliers - outliers);
+
+    if(ev.pointer.visible) {
+        put_event(dev, &ev);
+        dev->pointer_visible = 1;
+    } else if(dev->pointer_visible) {
+        put_pointer_lost(dev);
+    }
+}
+
+static void put_status_event(struct motion_device *dev) {
+    motion_event_t ev;
+    ev.kind = MI_EV_STATUS;
+    ev.status = dev->status;
+    put_event(dev, &ev);
+}
+
+static void process_status_report(struct motion_device *dev, struct wiimote_header *hdr) {
+    struct pkt_status_report const *rep = (struct pkt_status_report const *)hdr;
+
+    process_core_buttons(dev, hdr);
+
+    motion_status_t status;
+    status.battery = rep->battery < WIIM_BATTERY_FULL ? rep->battery / (float)WIIM_BATTERY_FULL : 1.0f;
+    status.battery_low = (rep->flags & WIIM_STATUS_FLAG_BATTERY_LOW) != 0;
+    status.extension_connected = (rep->flags & WIIM_STATUS_FLAG_EXTENSION) != 0;
+    status.leds = rep->flags >> 4;
+
+    int ext_changed = dev->status_valid &&
+        status.extension_connected != dev->status.extension_connected;
+    int solicited = dev->status_requested;
+    dev->status = status;
+    dev->status_valid = 1;
+    dev->status_requested = 0;
+
+    // A report nobody asked for, e.g. on plugging in an extension, stops
+    // the data reports until the mode is set again
+    if(!solicited || ext_changed) {
+        set_report_mode(dev, 0, dev->current_reporting_mode);
+    }
+
+    // During init the status is reported along with MI_EV_CONNECTED, and
+    // the extension is being detected anyway
+    if(dev->state != DEV_STATE_READY) {
+        return;
+    }
+
+    put_status_event(dev);
+
+    if(ext_changed) {
+        dev->ext_changed = 1;
+    }
+}
+
+static void handle_input_report(
+        struct motion_device *dev,
+        char const* buf,
+        int len
+) {
+    struct wiimote_header *hdr = (struct wiimote_header *)buf;
+    if(hdr->hdr.code != HID_INPUT_REPORT) {
+        assert(0);
+        return;
+    }
+
+    report_layout_t const *layout;
+
+    switch(hdr->code) {
+        case WIIM_REPORT_STATUS_INFO:
+            if(len < sizeof(struct pkt_status_report)) {
+                STAT_INC(dev->counters.unhandled_packets);
+                break;
+            }
+            process_status_report(dev, hdr);
+            break;
+        case WIIM_REPORT_READ_MEM_AND_REGS_DATA:
+            on_memory_read_results(dev, hdr);
+            break;
+        case WIIM_REPORT_DATA_BUTTONS:
+        case WIIM_REPORT_DATA_BUTTONS_ACCEL:
+        case WIIM_REPORT_DATA_BUTTONS_EXT8:
+        case WIIM_REPORT_DATA_BUTTONS_ACCEL_IR12:
+        case WIIM_REPORT_DATA_BUTTONS_ACCEL_EXT16:
+        case WIIM_REPORT_DATA_BUTTONS_IR10_EXT9:
+        case WIIM_REPORT_DATA_BUTTONS_ACCEL_IR10_EXT6:
+            layout = find_report_layout(hdr->code);
+            if(len < 2 + layout->len) {
+                STAT_INC(dev->counters.unhandled_packets);
+                break;
+            }
+
+            process_core_buttons(dev, hdr);
+            if(layout->accel_off != 0) {
+                process_normal_accel_data(dev, hdr);
+            }
+            if(layout->ext_off != 0 && dev->ext_status == EXT_STATUS_FOUND) {
+                process_extension_data(dev, (uint8_t const *)buf + layout->ext_off);
+            }
+            if(layout->accel_off != 0 && gNumGestures > 0) {
+                match_gestures(dev);
+            }
+            if(layout->ir_off != 0 && layout->ir_mode == dev->ir_mode) {
+                process_ir_data(dev, (uint8_t const *)buf + layout->ir_off, layout->ir_mode);
+            }
+            break;
+        default:
+            STAT_INC(dev->counters.unhandled_packets);
+            break;
+    }
+}
+
+// Union of the streams someone is subscribed to
+static unsigned wanted_streams() {
+    unsigned streams = 0;
+
+    for(int i = 0; i < NUM_STREAMS; i++) {
+        if(gStreamRefs[i] > 0) {
+            streams |= 1u << i;
+        }
+    }
+
+    // Filtered from the raw acceleration; no report mode knows the bit
+    if(streams & MOTION_STREAM_ACCEL_FILTERED) {
+        streams &= ~MOTION_STREAM_ACCEL_FILTERED;
+        streams |= MOTION_STREAM_ACCEL;
+    }
+
+    return (streams != 0) ? streams : MOTION_STREAM_DEFAULT;
+}
+
+static report_layout_t const *choose_report_layout(struct motion_device *dev) {
+    unsigned streams = wanted_streams() | MOTION_STREAM_BUTTONS;
+
+    if(dev->ext_kind == EXT_KIND_NONE || dev->ext_kind == EXT_KIND_INACTIVE_MOTION_PLUS) {
+        streams &= ~MOTION_STREAM_EXTENSION;
+    }
+
+    for(size_t i = 0; i < NUM_REPORT_LAYOUTS; i++) {
+        if((gReportLayouts[i].streams & streams) == streams) {
+            return &gReportLayouts[i];
+        }
+    }
+
+    return &gReportLayouts[NUM_REPORT_LAYOUTS - 1];
+}
+
+static void send_enable_report(struct motion_device *dev, uint8_t code, int enable) {
+    struct pkt_enable pkt;
+    pkt.hdr.hdr.code = HID_OUTPUT_REPORT;
+    pkt.hdr.code = code;
+    pkt.flags = 0;
+    pkt.flags |= (enable) ? WIIM_FLAG_ENABLE : 0;
+
+    queue_output_report(dev, &pkt, sizeof(pkt));
+}
+
+static void set_ir_mode(struct motion_device *dev, uint8_t ir_mode) {
+    if(ir_mode == dev->ir_mode) {
+        return;
+    }
+
+    if(ir_mode == WIIM_IR_MODE_OFF) {
+        send_enable_report(dev, WIIM_REPORT_IR_CAMERA_ENABLE, 0);
+        send_enable_report(dev, WIIM_REPORT_IR_CAMERA_ENABLE_2, 0);
+    } else {
+        // Sensitivity blocks of the Wii's level 3 setting
+        uint8_t const block1[9] = { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xAA, 0x00, 0x64 };
+        uint8_t const block2[2] = { 0x63, 0x03 };
+        uint8_t b0 = 0x08;
+
+        send_enable_report(dev, WIIM_REPORT_IR_CAMERA_ENABLE, 1);
+        send_enable_report(dev, WIIM_REPORT_IR_CAMERA_ENABLE_2, 1);
+        write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xB00030, &b0, 1);
+        write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xB00000, (void*)block1, sizeof(block1));
+        write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xB0001A, (void*)block2, sizeof(block2));
+        write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xB00033, &ir_mode, 1);
+        write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xB00030, &b0, 1);
+    }
+
+    dev->ir_mode = ir_mode;
+    ir_tracker_init(&dev->ir);
+    if(dev->pointer_visible) {
+        put_pointer_lost(dev);
+    }
+}
+
+// Switches the device to the report mode that best fits the current
+// subscriptions; `force` resends the mode even if it didn't change
+static void update_report_mode(struct motion_device *dev, int force) {
+    report_layout_t const *layout = choose_report_layout(dev);
+
+    set_ir_mode(dev, layout->ir_mode);
+
+    if(force || layout->mode != dev->current_reporting_mode) {
+        dev->current_reporting_mode = layout->mode;
+        set_report_mode(dev, 0, layout->mode);
+    }
+}
+
+static void reset_device_state(struct motion_device *dev) {
+    // The motor stopped along with the connection
+    stop_haptics(dev);
+    __atomic_store_n(&dev->rumble, 0, __ATOMIC_RELAXED);
+    // Whatever the camera was doing, it was reset along with the connection
+    dev->ir_mode = WIIM_IR_MODE_OFF;
+    ir_tracker_init(&dev->ir);
+    dev->pointer_visible = 0;
+
+    dev->ext_status = EXT_STATUS_UNKNOWN;
+    dev->ext_kind = EXT_KIND_NONE;
+    dev->ext_changed = 0;
+    dev->ext_redetect = 0;
+    dev->has_nunchuk = 0;
+    dev->status_valid = 0;
+    dev->status_requested = 0;
+    dev->calib_raw_valid = 0;
+    dev->gyro_valid = 0;
+    dev->filter_primed = 0;
+    dev->uniform.reports = 0;
+    dev->predictor.state.ready[0] = dev->predictor.state.ready[1] = PREDICT_NONE;
+    publish_prediction(&dev->predictor);
+
+    dev->btn_state_ready = 0;
+    dev->nunchuk_btn_ready = 0;
+
+    // Typical values, used until the real calibration data arrives
+    uint32_t const center[3] = { 512, 512, 512 };
+    uint32_t const wiimote_unit[3] = { 104, 104, 104 };
+    uint32_t const nunchuk_unit[3] = { 208, 208, 208 };
+    set_accel_calib(&dev->calib, center, wiimote_unit);
+    set_accel_calib(&dev->nunchuk_calib, center, nunchuk_unit);
+    dev->nunchuk_stick_center.x = dev->nunchuk_stick_center.y = 128.0f;
+    dev->nunchuk_stick_unit.x = dev->nunchuk_stick_unit.y = 100.0f;
+}
+
+static void read_accelerometer_calibration_data(struct motion_device *dev) {
+    read_memory(dev, WIIM_ADDRSPACE_EEPROM, 0x00000016, 10);
+}
+
+// Reads the extension signature at 0xXX00FA; see extension_probe_done
+static void start_extension_probe(struct motion_device *dev, uint8_t space) {
+    dev->ext_status = EXT_STATUS_IN_PROGRESS;
+    dev->ext_probe = space;
+    dev->ext_probe_failed = 0;
+    dev->ext_probe_deadline = now_micros() + 1000000;
+    read_memory(dev, WIIM_ADDRSPACE_CTLREG, ((uint32_t)space << 16) | 0x00FA, 6);
+}
+
+// Returns nonzero once the probe was answered or timed out
+static int extension_probe_done(struct motion_device *dev, uint64_t now) {
+    if(dev->ext_status == EXT_STATUS_FOUND) {
+        return 1;
+    }
+
+    if(now >= dev->ext_probe_deadline) {
+        dev->ext_probe_failed = 1;
+        dev->ext_status = EXT_STATUS_FOUND;
+        return 1;
+    }
 
     return 0;
 }
 
-static int detect_extension(struct motion_device *dev) {
-    struct pkt_memory_read pkt;
-    init_memory_read(&pkt, WIIM_ADDRSPACE_CTLREG, 0xa600fa, 6);
+// Moves on to the next init step, which runs once every report queued so
+// far has been sent and `delay` more microseconds passed
+static void init_continue(struct motion_device *dev, init_step_t next, uint64_t delay) {
+    dev->init_step = next;
+    dev->init_delay = delay;
+    dev->init_wake_time = 0;
+}
+
+// Detects the extension again without interrupting the core data
+static void redetect_extension(struct motion_device *dev, int connected) {
+    dev->ext_kind = EXT_KIND_NONE;
+    dev->has_nunchuk = 0;
+    dev->gyro_valid = 0;
+    dev->nunchuk_btn_ready = 0;
+    dev->predictor.state.ready[1] = PREDICT_NONE;
+    publish_prediction(&dev->predictor);
+
+    if(!connected) {
+        dev->ext_redetect = 0;
+        dev->ext_status = EXT_STATUS_FOUND;
+        update_report_mode(dev, 0);
+        return;
+    }
+
+    // Extension data is ignored until the probe finishes
+    dev->ext_redetect = 1;
+    dev->ext_status = EXT_STATUS_IN_PROGRESS;
+    init_continue(dev, INIT_STEP_UNLOCK_EXTENSION, 100000);
+}
+
+static void init_finish(struct motion_device *dev) {
+    if(dev->ext_redetect) {
+        dev->ext_redetect = 0;
+        update_report_mode(dev, 0);
+        update_calib_cache(dev);
+        return;
+    }
+
+    dev->state = DEV_STATE_READY;
+
+    // Now that the extension is known
+    update_report_mode(dev, 1);
+
+    motion_event_t ev;
+    ev.kind = MI_EV_CONNECTED;
+    dev->rx_timestamp = now_micros();
+    put_event(dev, &ev);
+
+    if(dev->status_valid) {
+        put_status_event(dev);
+    }
+
+    // Golden ratio phases keep any number of devices' polls apart, even
+    // if they all connected at once
+    uint64_t phase = (dev->player * 618034ull % 1000000) * (STATUS_POLL_INTERVAL / 1000000);
+    dev->next_status_poll = dev->rx_timestamp + STATUS_POLL_INTERVAL + phase;
+
+    update_calib_cache(dev);
+}
+
+// Runs the init sequence of a freshly (re)connected device one step at a
+// time so that neither motion_poll nor other devices ever wait on it
+static void advance_init(struct motion_device *dev) {
+    uint64_t now = now_micros();
+
+    if(dev->out_queue.count > 0) {
+        return;
+    }
+
+    if(dev->init_wake_time == 0) {
+        dev->init_wake_time = now + dev->init_delay;
+    }
+
+    if(now < dev->init_wake_time) {
+        return;
+    }
+
+    switch(dev->init_step) {
+        case INIT_STEP_START:
+        {
+            reset_device_state(dev);
+
+            // A known device streams calibrated data right away; the
+            // calibration is still read below to refresh the cache
+            calib_cache_entry_t const *cached = dev->address[0] != '\0' ?
+                find_calib_cache_entry(dev->address) : NULL;
+            if(cached != NULL) {
+                process_calibration_data(dev, (void *)cached->calib);
+                // Report in the extension's mode from the start, so
+                // confirming it takes no mode change
+                dev->ext_kind = cached->ext_kind;
+            }
+
+            dev->current_reporting_mode = choose_report_layout(dev)->mode;
+            set_report_mode(dev, 0, dev->current_reporting_mode);
+            send_led_output_report(dev, 0x10);
+            request_status_info(dev);
+            read_accelerometer_calibration_data(dev);
+
+            // Buzz to acknowledge the connection
+            motion_rumble_step_t const buzz = { 1.0f, 250 };
+            play_haptics(dev, &buzz, 1, 0);
+
+            if(cached != NULL) {
+                init_continue(dev, INIT_STEP_CACHED, 0);
+            } else {
+                init_continue(dev, INIT_STEP_UNLOCK_EXTENSION, 100000);
+            }
+            break;
+        }
+        case INIT_STEP_CACHED:
+        {
+            init_finish(dev);
+            // The extension may have changed since; ignore its data until
+            // the probe confirms what is plugged in
+            redetect_extension(dev, 1);
+            break;
+        }
+        case INIT_STEP_UNLOCK_EXTENSION:
+        {
+            // Disable encryption of the extension data
+            uint8_t b0 = 0x55;
+            write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA400F0, &b0, 1);
+            init_continue(dev, INIT_STEP_DISABLE_ENCRYPTION, 100000);
+            break;
+        }
+        case INIT_STEP_DISABLE_ENCRYPTION:
+        {
+            uint8_t b1 = 0x00;
+            write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA400FB, &b1, 1);
+            init_continue(dev, INIT_STEP_PROBE_PORT, 100000);
+            break;
+        }
+        case INIT_STEP_PROBE_PORT:
+        {
+            // An inactive MotionPlus passes the extension plugged into it
+            // through, so this finds a Nunchuk both on its own and behind
+            // a MotionPlus.
+            dev->ext_kind = EXT_KIND_NONE;
+            dev->has_nunchuk = 0;
+            start_extension_probe(dev, 0xA4);
+            init_continue(dev, INIT_STEP_WAIT_PORT, 0);
+            break;
+        }
+        case INIT_STEP_WAIT_PORT:
+        {
+            if(!extension_probe_done(dev, now)) {
+                break;
+            }
+
+            if(dev->has_nunchuk) {
+                read_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA40020, 16);
+            }
+
+            if(dev->ext_kind == EXT_KIND_ACTIVE_MOTION_PLUS ||
+                    dev->ext_kind == EXT_KIND_ACTIVE_MOTION_PLUS_NUNCHUCK_PASSTHRU) {
+                // Already activated, e.g. by a previous run
+                init_finish(dev);
+                break;
+            }
+
+            dev->port_kind = dev->ext_kind;
+            start_extension_probe(dev, 0xA6);
+            init_continue(dev, INIT_STEP_WAIT_MOTIONPLUS, 0);
+            break;
+        }
+        case INIT_STEP_WAIT_MOTIONPLUS:
+        {
+            if(!extension_probe_done(dev, now)) {
+                break;
+            }
+
+            if(dev->ext_probe_failed || dev->ext_kind != EXT_KIND_INACTIVE_MOTION_PLUS) {
+                dev->ext_kind = dev->port_kind;
+                init_finish(dev);
+                break;
+            }
+
+            uint8_t b0 = 0x55;
+            write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA600F0, &b0, 1);
+            init_continue(dev, INIT_STEP_MOTIONPLUS_MODE, 100000);
+            break;
+        }
+        case INIT_STEP_MOTIONPLUS_MODE:
+        {
+            uint8_t b1 = dev->has_nunchuk ?
+                EXT_MP_MODE_NUNCHUCK_PASSTHRU : EXT_MP_MODE_ACTIVE;
+            write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA600FE, &b1, 1);
+
+            dev->ext_kind = dev->has_nunchuk ?
+                EXT_KIND_ACTIVE_MOTION_PLUS_NUNCHUCK_PASSTHRU :
+                EXT_KIND_ACTIVE_MOTION_PLUS;
+            init_continue(dev, INIT_STEP_MOTIONPLUS_DONE, 100000);
+            break;
+        }
+        case INIT_STEP_MOTIONPLUS_DONE:
+        {
+            init_finish(dev);
+            break;
+        }
+    }
+}
+
+// Deadline of the next speaker report
+static uint64_t speaker_due(speaker_t const *s) {
+    return s->base_time + s->samples_sent * 1000000000ull / MOTION_SPEAKER_RATE;
+}
+
+static void send_speaker_report(struct motion_device *dev, speaker_t *s, int len) {
+    struct pkt_speaker_data pkt;
+    pkt.hdr.hdr.code = HID_OUTPUT_REPORT;
+    pkt.hdr.code = WIIM_REPORT_SPEAKER_DATA;
+    pkt.len = len << 3;
+    pkt.len |= __atomic_load_n(&dev->rumble, __ATOMIC_RELAXED) ? WIIM_DRM_FLAG_RUMBLE : 0;
+
+    memset(pkt.data, 0, sizeof(pkt.data));
+    for(int i = 0; i < len; i++) {
+        pkt.data[i] = s->buf[(s->rd + i) % SPEAKER_BUFFER_SIZ];
+    }
+    s->rd += len;
+    s->samples_sent += 2 * len;
+
+    // Bypasses the output queue: speaker data has its own pacing, and
+    // the rate limit would only add jitter to it
     wiimote_send(dev->hDevice, &pkt, sizeof(pkt));
+}
+
+// Sends the device's speaker reports that are due. Called with
+// gSpeakerLock held. Returns when to call again, or UINT64_MAX if only new
+// audio can change anything.
+static uint64_t service_speaker(struct motion_device *dev, uint64_t now) {
+    speaker_t *s = dev->speaker;
+    uint64_t const interval = WIIM_SPEAKER_DATA_MAX * 2 * 1000000000ull / MOTION_SPEAKER_RATE;
+
+    if(s == NULL || s->state != SPEAKER_ACTIVE || s->wr == s->rd) {
+        if(s != NULL) {
+            s->playing = 0;
+        }
+        return UINT64_MAX;
+    }
+
+    if(!s->playing) {
+        uint64_t ready = s->fill_time + SPEAKER_PREBUFFER * 2 * 1000000000ull / MOTION_SPEAKER_RATE;
+        if(s->wr - s->rd < SPEAKER_PREBUFFER && now < ready) {
+            return ready;
+        }
+
+        s->playing = 1;
+        s->base_time = now;
+        s->samples_sent = 0;
+    }
+
+    if(now >= speaker_due(s) + SPEAKER_MAX_LAG * interval) {
+        s->base_time = now;
+        s->samples_sent = 0;
+    }
+
+    while(speaker_due(s) <= now) {
+        uint64_t buffered = s->wr - s->rd;
+        if(buffered == 0) {
+            // Ran dry; start over with a fresh prebuffer
+            s->playing = 0;
+            return UINT64_MAX;
+        }
+
+        send_speaker_report(dev, s, buffered < WIIM_SPEAKER_DATA_MAX ? (int)buffered : WIIM_SPEAKER_DATA_MAX);
+    }
+
+    return speaker_due(s);
+}
+
+static void *speaker_thread(void *user) {
+    pthread_mutex_lock(&gSpeakerLock);
+    while(gSpeakerRunning) {
+        uint64_t now = now_nanos();
+        uint64_t next = UINT64_MAX;
+
+        struct motion_device *cur = __atomic_load_n(&gDevices, __ATOMIC_ACQUIRE);
+        while(cur != NULL) {
+            uint64_t t = service_speaker(cur, now);
+            if(t < next) {
+                next = t;
+            }
+            cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE);
+        }
+
+        if(next == UINT64_MAX) {
+            pthread_cond_wait(&gSpeakerCond, &gSpeakerLock);
+            continue;
+        }
+
+        // Absolute deadlines, so time spent sending doesn't add up
+        pthread_mutex_unlock(&gSpeakerLock);
+        struct timespec ts = { next / 1000000000, next % 1000000000 };
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+        pthread_mutex_lock(&gSpeakerLock);
+    }
+    pthread_mutex_unlock(&gSpeakerLock);
+
+    return NULL;
+}
+
+static void set_speaker_state(speaker_t *s, speaker_state_t state) {
+    pthread_mutex_lock(&gSpeakerLock);
+    s->state = state;
+    if(state == SPEAKER_OFF) {
+        s->rd = s->wr;
+        s->playing = 0;
+    }
+    pthread_cond_signal(&gSpeakerCond);
+    pthread_mutex_unlock(&gSpeakerLock);
+}
+
+static void count_packet(struct motion_device *dev, uint8_t code, int len, uint64_t rx_nanos) {
+    device_counters_t *c = &dev->counters;
+
+    if(code >= MOTION_STATS_FIRST_REPORT_CODE &&
+            code < MOTION_STATS_FIRST_REPORT_CODE + MOTION_STATS_NUM_REPORT_CODES) {
+        STAT_INC(c->packets[code - MOTION_STATS_FIRST_REPORT_CODE]);
+    }
+    STAT_ADD(c->bytes, len);
+    STAT_SET(c->last_packet_time, rx_nanos / 1000);
+
+    uint64_t elapsed = (now_nanos() - rx_nanos) >> 8;
+    int bucket = 0;
+    while(elapsed != 0 && bucket < MOTION_STATS_NUM_DECODE_BUCKETS - 1) {
+        elapsed >>= 1;
+        bucket++;
+    }
+    STAT_INC(c->decode_time[bucket]);
+}
+
+static void on_device_lost(struct motion_device *dev) {
+    STAT_INC(dev->counters.disconnects);
+
+    dev->state = DEV_STATE_DISCONNECTED;
+    dev->out_queue.rd = dev->out_queue.wr = dev->out_queue.count = 0;
+    unwatch_device(dev);
+    stop_haptics(dev);
 
-    while(dev->ext_status < EXT_STATUS_FOUND) {
-        poll_device(dev);
+    // Before the handle is handed to the discovery thread for reconnecting
+    if(dev->speaker != NULL) {
+        set_speaker_state(dev->speaker, SPEAKER_OFF);
     }
 
-    if(dev->ext_kind == EXT_KIND_ACTIVE_MOTION_PLUS ||
-            dev->ext_kind == EXT_KIND_INACTIVE_MOTION_PLUS) {
-        uint8_t b0 = 0x55;
-        write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA600F0, &b0, 1);
-        sleep_millis(100);
+    motion_event_t ev;
+    ev.kind = MI_EV_DISCONNECTED;
+    dev->rx_timestamp = now_micros();
+    put_event(dev, &ev);
+
+    pthread_mutex_lock(&gHotplugLock);
+    if(gDiscoveryRunning && gNumLostHandles < MAX_PENDING_HANDLES) {
+        gLostHandles[gNumLostHandles++] = dev->hDevice;
+        pthread_cond_signal(&gHotplugCond);
+    }
+    pthread_mutex_unlock(&gHotplugLock);
+}
+
+static void poll_device(struct motion_device *dev) {
+    char buffer[128];
+    int rd;
+
+    if(dev->state == DEV_STATE_DISCONNECTED) {
+        return;
+    }
+
+    do {
+        MOTION_TRACE_BEGIN("wiimote_recv");
+        rd = wiimote_recv(dev->hDevice, buffer, 128);
+        MOTION_TRACE_END("wiimote_recv");
+
+        if(rd > 0) {
+            uint64_t rx_nanos = now_nanos();
+            dev->rx_timestamp = rx_nanos / 1000;
+            MOTION_TRACE_BEGIN("handle_input_report");
+            handle_input_report(dev, buffer, rd);
+            MOTION_TRACE_END("handle_input_report");
+            count_packet(dev, (uint8_t)buffer[1], rd, rx_nanos);
+        }
+    } while(rd > 0);
+
+    if(rd < 0) {
+        on_device_lost(dev);
+        return;
+    }
+
+    if(dev->ext_changed) {
+        dev->ext_changed = 0;
+        redetect_extension(dev, dev->status.extension_connected);
+    }
+
+    if(dev->state == DEV_STATE_INITIALIZING || dev->ext_redetect) {
+        advance_init(dev);
+    } else if(dev->out_queue.count == 0 && now_micros() >= dev->next_status_poll) {
+        // Right after draining the socket, so the request goes out in the
+        // gap behind a data report rather than in a burst
+        request_status_info(dev);
+        dev->next_status_poll += STATUS_POLL_INTERVAL;
+    }
+
+    pump_output_queue(dev);
+    service_uniform(dev, now_micros());
+
+    if(dev->speaker != NULL && dev->speaker->state == SPEAKER_CONFIGURING && dev->out_queue.count == 0) {
+        set_speaker_state(dev->speaker, SPEAKER_ACTIVE);
+    }
+}
+
+static void on_device_found_async(HWIIMOTE hDevice, void *user) {
+    pthread_mutex_lock(&gHotplugLock);
+    if(gNumFoundHandles < MAX_PENDING_HANDLES) {
+        gFoundHandles[gNumFoundHandles++] = hDevice;
+        hDevice = NULL;
+        wake_waiter();
+    }
+    pthread_mutex_unlock(&gHotplugLock);
+
+    if(hDevice != NULL) {
+        wiimote_disconnect(hDevice);
+    }
+}
+
+static void *discovery_thread(void *user) {
+    struct wiimote_listener scan_listener = {
+        .on_device_found = on_device_found_async,
+    };
+    uint64_t next_inquiry = now_micros();
+    if(!gDiscoveryInquireNow) {
+        next_inquiry += DISCOVERY_INQUIRY_INTERVAL * 1000000ull;
+    }
+
+    pthread_mutex_lock(&gHotplugLock);
+    while(gDiscoveryRunning) {
+        // Paging a known address is much quicker than an inquiry, so lost
+        // devices come first. Only this thread removes entries.
+        for(int i = 0; i < gNumLostHandles && gDiscoveryRunning;) {
+            HWIIMOTE hDevice = gLostHandles[i];
+
+            pthread_mutex_unlock(&gHotplugLock);
+            int ok = wiimote_reconnect(hDevice) == 0;
+            pthread_mutex_lock(&gHotplugLock);
+
+            if(ok && gNumFoundHandles < MAX_PENDING_HANDLES) {
+                gLostHandles[i] = gLostHandles[--gNumLostHandles];
+                gFoundHandles[gNumFoundHandles++] = hDevice;
+                wake_waiter();
+            } else {
+                i++;
+            }
+        }
 
-        uint8_t b1 = 0x04;
-        write_memory(dev, WIIM_ADDRSPACE_CTLREG, 0xA600F0, &b1, 1);
-        sleep_millis(100);
+        if(gDiscoveryRunning && now_micros() >= next_inquiry) {
+            pthread_mutex_unlock(&gHotplugLock);
+            if(wiimote_scan(&scan_listener, NULL) != 0) {
+                STAT_INC(gFailedInquiries);
+            }
+            pthread_mutex_lock(&gHotplugLock);
+            next_inquiry = now_micros() + DISCOVERY_INQUIRY_INTERVAL * 1000000ull;
+        }
 
-        set_report_mode(dev, 0, dev->current_reporting_mode);
+        if(gDiscoveryRunning) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += DISCOVERY_RETRY_INTERVAL;
+            pthread_cond_timedwait(&gHotplugCond, &gHotplugLock, &ts);
+        }
     }
+    pthread_mutex_unlock(&gHotplugLock);
 
-    return 0;
-}
-
-static void read_accelerometer_calibration_data(struct motion_device *dev) {
-    read_memory(dev, WIIM_ADDRSPACE_EEPROM, 0x00000016, 10);
+    return NULL;
 }
 
-static void init_devices() {
-    struct motion_device *cur = gDevices;
-    while(cur != NULL) {
-        cur->rumble = 0;
+// Takes over the handles the discovery thread connected
+static void adopt_found_handles() {
+    HWIIMOTE found[MAX_PENDING_HANDLES];
+    int num_found;
 
-        set_report_mode(cur, 0, WIIM_REPORT_MODE_BUTTONS_ACCEL_EXT16);
-        cur->current_reporting_mode = WIIM_REPORT_MODE_BUTTONS_ACCEL_EXT16;
-        set_report_mode(cur, 0, WIIM_REPORT_MODE_BUTTONS_ACCEL_EXT16);
-        send_led_output_report(cur->hDevice, 0x10);
-        request_status_info(cur);
-        read_accelerometer_calibration_data(cur);
-        rumble(cur, 1);
-        sleep_millis(250);
-        rumble(cur, 0);
+    if(__atomic_load_n(&gNumFoundHandles, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
 
-        disable_encryption(cur);
+    pthread_mutex_lock(&gHotplugLock);
+    num_found = gNumFoundHandles;
+    memcpy(found, gFoundHandles, num_found * sizeof(HWIIMOTE));
+    gNumFoundHandles = 0;
+    pthread_mutex_unlock(&gHotplugLock);
 
-        detect_extension(cur);
+    for(int i = 0; i < num_found; i++) {
+        struct motion_device *cur = gDevices;
+        while(cur != NULL && cur->hDevice != found[i]) {
+            cur = cur->next;
+        }
 
-        cur = cur->next;
+        if(cur != NULL) {
+            STAT_INC(cur->counters.reconnects);
+            cur->state = DEV_STATE_INITIALIZING;
+            watch_device(cur);
+            init_continue(cur, INIT_STEP_START, 0);
+        } else {
+            wm_on_device_found(found[i], NULL);
+        }
     }
 }
 
@@ -434,15 +2525,67 @@ int motion_init(motion_input_config_t const* cfg) {
         return 0;
     }
 
+    if(cfg->max_output_rate > 0) {
+        gOutputInterval = 1000000 / cfg->max_output_rate;
+    } else {
+        gOutputInterval = 1000000 / DEFAULT_MAX_OUTPUT_RATE;
+    }
+
+    gEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    gWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(gEpollFd >= 0 && gWakeFd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(gEpollFd, EPOLL_CTL_ADD, gWakeFd, &ev);
+    }
+
     struct wiimote_listener scan_listener = {
         .on_device_found = wm_on_device_found,
     };
 
-    if(wiimote_scan(&scan_listener, NULL) != 0) {
+    if(cfg->calibration_cache_path != NULL) {
+        gCalibCachePath = strdup(cfg->calibration_cache_path);
+        load_calib_cache();
+    }
+
+    int nCached = 0;
+    if(cfg->device_cache_path != NULL) {
+        wiimote_set_device_cache(cfg->device_cache_path);
+        nCached = wiimote_connect_cached(&scan_listener, NULL);
+    }
+
+    // With hot-plug, known devices are enough to start; the discovery
+    // thread looks for the rest
+    int nPlayers = cfg->max_players > 0 ? cfg->max_players : DEFAULT_MAX_PLAYERS;
+    int hotplug = (cfg->flags & MOTION_INPUT_FLAG_HOTPLUG) != 0;
+    gDiscoveryInquireNow = nCached > 0 && nCached < nPlayers && hotplug;
+    if((nCached == 0 || (nCached < nPlayers && !hotplug)) &&
+            wiimote_scan(&scan_listener, NULL) != 0) {
         printf("wiimote_scan() failed\n");
     }
 
-    init_devices();
+    // Bring the devices found so far up before returning
+    uint64_t deadline = now_micros() + 5000000;
+    int initializing;
+    do {
+        initializing = 0;
+        for(struct motion_device *cur = gDevices; cur != NULL; cur = cur->next) {
+            poll_device(cur);
+            initializing |= cur->state == DEV_STATE_INITIALIZING;
+        }
+        turn_haptics_wheel();
+
+        if(initializing) {
+            sleep_millis(1);
+        }
+    } while(initializing && now_micros() < deadline);
+
+    if(hotplug) {
+        gDiscoveryRunning = 1;
+        if(pthread_create(&gDiscoveryThread, NULL, discovery_thread, NULL) != 0) {
+            printf("motion_input: failed to start the discovery thread\n");
+            gDiscoveryRunning = 0;
+        }
+    }
 
     gIsInit = 1;
 
@@ -456,6 +2599,68 @@ int motion_shutdown() {
 
     gIsInit = 0;
 
+    pthread_mutex_lock(&gHotplugLock);
+    int was_running = gDiscoveryRunning;
+    gDiscoveryRunning = 0;
+    pthread_cond_signal(&gHotplugCond);
+    pthread_mutex_unlock(&gHotplugLock);
+
+    if(was_running) {
+        // May take a while if an inquiry is in progress
+        pthread_join(gDiscoveryThread, NULL);
+    }
+
+    pthread_mutex_lock(&gSpeakerLock);
+    was_running = gSpeakerRunning;
+    gSpeakerRunning = 0;
+    pthread_cond_signal(&gSpeakerCond);
+    pthread_mutex_unlock(&gSpeakerLock);
+
+    if(was_running) {
+        pthread_join(gSpeakerThread, NULL);
+    }
+
+    // Handles connected by the thread that were never picked up
+    for(int i = 0; i < gNumFoundHandles; i++) {
+        struct motion_device *cur = gDevices;
+        while(cur != NULL && cur->hDevice != gFoundHandles[i]) {
+            cur = cur->next;
+        }
+
+        if(cur == NULL) {
+            wiimote_disconnect(gFoundHandles[i]);
+        }
+    }
+    gNumFoundHandles = 0;
+    gNumLostHandles = 0;
+
+    struct motion_device *cur = gDevices;
+    while(cur != NULL) {
+        struct motion_device *next = cur->next;
+
+        if(cur->state != DEV_STATE_DISCONNECTED) {
+            stop_haptics(cur);
+            rumble(cur, 0);
+            drain_output_queue(cur);
+        }
+        wiimote_disconnect(cur->hDevice);
+        free(cur->speaker);
+        free(cur->gestures);
+        free(cur);
+
+        cur = next;
+    }
+    gDevices = NULL;
+
+    free(gCalibCachePath);
+    gCalibCachePath = NULL;
+    gNumCalibCache = 0;
+    gNumGestures = 0;
+
+    close(gEpollFd);
+    close(gWakeFd);
+    gEpollFd = gWakeFd = -1;
+
     if(wiimote_shutdown() != 0) {
         return 1;
     }
@@ -464,58 +2669,541 @@ int motion_shutdown() {
 }
 
 int motion_poll(motion_event_t *ev) {
-    char buffer[128];
-    int rd;
+    adopt_found_handles();
 
     struct motion_device *cur = gDevices;
-    while(cur != NULL) {
-        rd = wiimote_recv(cur->hDevice, buffer, 128);
 
-        if(rd > 0) {
-            // printf("received packet from wiimote len=%d\n", rd);
-            handle_input_report(cur, buffer, rd);
+    if(gStreamsChanged) {
+        gStreamsChanged = 0;
+        for(; cur != NULL; cur = cur->next) {
+            if(cur->state == DEV_STATE_READY) {
+                update_report_mode(cur, 0);
+            }
         }
+        cur = gDevices;
+    }
 
+    while(cur != NULL) {
+        poll_device(cur);
         cur = cur->next;
     }
 
+    turn_haptics_wheel();
 
-    ev->kind = MI_EV_NONE;
+    // Hand out the oldest pending event across all devices
+    struct motion_device *oldest = NULL;
+    uint64_t oldest_timestamp = 0;
     cur = gDevices;
     while(cur != NULL) {
-        motion_button_press_t mb;
-        if(get_btn_press_ring(&cur->btn_press_ring, &mb)) {
-            ev->kind = MI_EV_BUTTON;
-            ev->btn = mb;
-            return 1;
+        motion_event_t const *head = peek_event_ring(&cur->ev_ring);
+        if(head != NULL && (oldest == NULL || head->timestamp < oldest_timestamp)) {
+            oldest = cur;
+            oldest_timestamp = head->timestamp;
         }
 
         cur = cur->next;
     }
 
-    cur = gDevices;
-    while(cur != NULL) {
-        if(cur->accel_changed) {
-            ev->kind = MI_EV_ACCEL;
-            ev->accel.x = cur->accel.x;
-            ev->accel.y = cur->accel.y;
-            ev->accel.z = cur->accel.z;
-            return 1;
+    if(oldest != NULL) {
+        get_event_ring(&oldest->ev_ring, ev);
+        MOTION_TRACE_INSTANT("dequeue", ev->kind);
+        return 1;
+    }
+
+    ev->kind = MI_EV_NONE;
+    return 0;
+}
+
+int motion_get_fd() {
+    return gEpollFd;
+}
+
+int motion_get_timeout() {
+    if(__atomic_load_n(&gNumFoundHandles, __ATOMIC_RELAXED) > 0 || gStreamsChanged) {
+        return 0;
+    }
+
+    uint64_t now = now_micros();
+    uint64_t next = UINT64_MAX;
+
+    for(struct motion_device *cur = gDevices; cur != NULL; cur = cur->next) {
+        if(peek_event_ring(&cur->ev_ring) != NULL) {
+            return 0;
         }
 
-        cur = cur->next;
+        if(cur->state == DEV_STATE_DISCONNECTED) {
+            continue;
+        }
+
+        if(cur->state == DEV_STATE_INITIALIZING || cur->ext_redetect || cur->fd < 0) {
+            uint64_t t = now + UNWATCHED_POLL_INTERVAL * 1000;
+            if(t < next) {
+                next = t;
+            }
+        } else if(cur->next_status_poll < next) {
+            next = cur->next_status_poll;
+        }
+
+        if(cur->out_queue.count > 0 && cur->out_queue.next_send_time < next) {
+            next = cur->out_queue.next_send_time;
+        }
+
+        uint64_t uniform = uniform_due(cur);
+        if(uniform < next) {
+            next = uniform;
+        }
     }
 
-    return 0;
+    uint64_t haptics = next_haptics_due();
+    if(haptics != UINT64_MAX && haptics * 1000 < next) {
+        next = haptics * 1000;
+    }
+
+    if(next == UINT64_MAX) {
+        return -1;
+    }
+
+    // Round up so a wait never ends just before the deadline
+    return next <= now ? 0 : (int)((next - now + 999) / 1000);
 }
 
-void motion_set_leds(int iPlayer, unsigned mask) {
+int motion_wait(int timeout_ms) {
+    int deadline = motion_get_timeout();
+    if(deadline >= 0 && (timeout_ms < 0 || deadline < timeout_ms)) {
+        timeout_ms = deadline;
+    }
+
+    if(timeout_ms == 0) {
+        return 1;
+    }
+
+    struct epoll_event evs[8];
+    int n = epoll_wait(gEpollFd, evs, 8, timeout_ms);
+
+    for(int i = 0; i < n; i++) {
+        if(evs[i].data.ptr == NULL) {
+            uint64_t count;
+            (void)!read(gWakeFd, &count, sizeof(count));
+        }
+    }
+
+    return n > 0;
+}
+
+static struct motion_device *find_device(int iPlayer) {
     struct motion_device *cur = gDevices;
     while(cur != NULL && --iPlayer > 0) {
         cur = cur->next;
     }
 
+    return cur;
+}
+
+int motion_predict(int iPlayer, uint64_t timestamp, motion_prediction_t *out) {
+    // May run on another thread, like motion_get_stats
+    struct motion_device *cur = __atomic_load_n(&gDevices, __ATOMIC_ACQUIRE);
+    while(cur != NULL && --iPlayer > 0) {
+        cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(cur == NULL || out == NULL) {
+        return 1;
+    }
+
+    predictor_t *p = &cur->predictor;
+    predict_state_t s;
+    unsigned seq;
+    do {
+        seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        memcpy(&s, &p->pub, sizeof(s));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || seq != __atomic_load_n(&p->seq, __ATOMIC_RELAXED));
+
+    if(s.ready[0] == PREDICT_NONE) {
+        return 1;
+    }
+
+    float pred[PREDICT_CHANNELS];
+    for(int c = 0; c < PREDICT_CHANNELS; c++) {
+        double ahead = (double)timestamp - s.time[c / 3];
+        ahead = ahead < 0 ? 0 : (ahead > PREDICT_MAX_HORIZON ? PREDICT_MAX_HORIZON : ahead);
+        float dt = (float)(ahead / 1e6);
+        pred[c] = s.x[c] + s.v[c] * dt + 0.5f * s.a[c] * dt * dt;
+    }
+
+    out->accel.x = pred[0];
+    out->accel.y = pred[1];
+    out->accel.z = pred[2];
+    out->has_gyro = s.ready[1] != PREDICT_NONE;
+    out->gyro.yaw = pred[3];
+    out->gyro.roll = pred[4];
+    out->gyro.pitch = pred[5];
+
+    return 0;
+}
+
+void motion_set_leds(int iPlayer, unsigned mask) {
+    struct motion_device *cur = find_device(iPlayer);
+
     if(cur != NULL) {
-        send_led_output_report(cur->hDevice, (mask << 4) & 0xF0);
+        send_led_output_report(cur, (mask << 4) & 0xF0);
+    }
+}
+
+int motion_rumble(int iPlayer, motion_rumble_step_t const *steps, int count, int repeat) {
+    struct motion_device *dev = find_device(iPlayer);
+    if(dev == NULL || dev->state == DEV_STATE_DISCONNECTED ||
+            count < 0 || count > MOTION_RUMBLE_MAX_STEPS) {
+        return 1;
+    }
+
+    unsigned total = 0;
+    for(int i = 0; i < count; i++) {
+        total += steps[i].duration_ms;
     }
+    if(count > 0 && total == 0) {
+        return 1;
+    }
+
+    play_haptics(dev, steps, count, repeat);
+
+    return 0;
+}
+
+int motion_speaker_enable(int iPlayer, float volume) {
+    struct motion_device *dev = find_device(iPlayer);
+    if(dev == NULL || dev->state != DEV_STATE_READY) {
+        return 1;
+    }
+
+    if(dev->speaker == NULL) {
+        if(volume <= 0) {
+            return 0;
+        }
+
+        dev->speaker = (speaker_t*)calloc(1, sizeof(speaker_t));
+        if(dev->speaker == NULL) {
+            return 1;
+        }
+    }
+
+    speaker_t *s = dev->speaker;
+    set_speaker_state(s, SPEAKER_OFF);
+
+    if(volume <= 0) {
+        send_enable_report(dev, WIIM_REPORT_SPEAKER_MUTE, 1);
+        send_enable_report(dev, WIIM_REPORT_SPEAKER_ENABLE, 0);
+        return 0;
+    }
+
+    pthread_mutex_lock(&gSpeakerLock);
+    if(!gSpeakerRunning) {
+        gSpeakerRunning = 1;
+        if(pthread_create(&gSpeakerThread, NULL, speaker_thread, NULL) != 0) {
+            printf("motion_input: failed to start the speaker thread\n");
+            gSpeakerRunning = 0;
+        }
+    }
+    int running = gSpeakerRunning;
+    pthread_mutex_unlock(&gSpeakerLock);
+
+    if(!running) {
+        return 1;
+    }
+
+    speaker_adpcm_init(&s->adpcm);
+    // Set up by the first motion_speaker_play
+    s->resampler.in_rate = 0;
+
+    uint16_t rate = 6000000 / MOTION_SPEAKER_RATE;
+    struct speaker_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.format = WIIM_SPEAKER_FORMAT_ADPCM;
+    cfg.rate_lo = rate & 0xFF;
+    cfg.rate_hi = rate >> 8;
+    cfg.volume = (uint8_t)((volume < 1 ? volume : 1) * WIIM_SPEAKER_VOLUME_MAX + 0.5f);
+
+    uint8_t b0 = 0x01, b1 = 0x08, b2 = 0x01;
+    send_enable_report(dev, WIIM_REPORT_SPEAKER_ENABLE, 1);
+    send_enable_report(dev, WIIM_REPORT_SPEAKER_MUTE, 1);
+    write_memory(dev, WIIM_ADDRSPACE_CTLREG, WIIM_SPEAKER_REG_RESET, &b0, 1);
+    write_memory(dev, WIIM_ADDRSPACE_CTLREG, WIIM_SPEAKER_REG_CONFIG, &b1, 1);
+    write_memory(dev, WIIM_ADDRSPACE_CTLREG, WIIM_SPEAKER_REG_CONFIG, &cfg, sizeof(cfg));
+    write_memory(dev, WIIM_ADDRSPACE_CTLREG, WIIM_SPEAKER_REG_PLAY, &b2, 1);
+    send_enable_report(dev, WIIM_REPORT_SPEAKER_MUTE, 0);
+
+    set_speaker_state(s, SPEAKER_CONFIGURING);
+
+    return 0;
+}
+
+int motion_speaker_play(int iPlayer, int16_t const *pcm, int count, int sample_rate) {
+    struct motion_device *dev = find_device(iPlayer);
+    if(dev == NULL || dev->speaker == NULL || dev->speaker->state == SPEAKER_OFF) {
+        return -1;
+    }
+
+    speaker_t *s = dev->speaker;
+    if(s->resampler.in_rate != sample_rate) {
+        if(speaker_resampler_init(&s->resampler, sample_rate, MOTION_SPEAKER_RATE) != 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&gSpeakerLock);
+    int space = SPEAKER_BUFFER_SIZ - (int)(s->wr - s->rd);
+    pthread_mutex_unlock(&gSpeakerLock);
+
+    int16_t resampled[SPEAKER_RESAMPLE_CHUNK];
+    uint8_t encoded[SPEAKER_RESAMPLE_CHUNK / 2 + 1];
+    int accepted = 0;
+
+    while(accepted < count) {
+        // Samples that fit, less one for the pending nibble. Resampling n
+        // inputs yields at most n / step + 1 outputs.
+        int max_out = 2 * space - 1;
+        max_out = max_out < SPEAKER_RESAMPLE_CHUNK ? max_out : SPEAKER_RESAMPLE_CHUNK;
+        int n = (int)((max_out - 1) * s->resampler.step);
+        n = n < count - accepted ? n : count - accepted;
+        if(n <= 0) {
+            break;
+        }
+
+        int m = speaker_resample(&s->resampler, pcm + accepted, n, resampled);
+        int len = speaker_adpcm_encode(&s->adpcm, resampled, m, encoded);
+        accepted += n;
+
+        pthread_mutex_lock(&gSpeakerLock);
+        if(s->wr == s->rd) {
+            s->fill_time = now_nanos();
+        }
+        for(int i = 0; i < len; i++) {
+            s->buf[(s->wr + i) % SPEAKER_BUFFER_SIZ] = encoded[i];
+        }
+        s->wr += len;
+        space = SPEAKER_BUFFER_SIZ - (int)(s->wr - s->rd);
+        pthread_cond_signal(&gSpeakerCond);
+        pthread_mutex_unlock(&gSpeakerLock);
+    }
+
+    return accepted;
+}
+
+int motion_gesture_add(int id, float const *samples, int len, int channels, float threshold) {
+    if(samples == NULL || gNumGestures == MOTION_GESTURE_MAX_TEMPLATES) {
+        return 1;
+    }
+
+    if(gesture_template_init(&gGestures[gNumGestures], id, samples, len, channels, threshold) != 0) {
+        return 1;
+    }
+    gNumGestures++;
+
+    // Start the new template from a clean slate on every device
+    for(struct motion_device *cur = gDevices; cur != NULL; cur = cur->next) {
+        if(cur->gestures != NULL) {
+            cur->gestures->cand[gNumGestures - 1].best = INFINITY;
+            cur->gestures->cand[gNumGestures - 1].refractory = 0;
+        }
+    }
+
+    return 0;
+}
+
+void motion_gesture_clear() {
+    gNumGestures = 0;
+}
+
+static int init_filter_stage(filter_stage_t *st, motion_filter_t const *cfg) {
+    float const nyquist = MOTION_FILTER_RATE / 2.0f;
+    if(!(cfg->cutoff_hz > 0 && cfg->cutoff_hz < nyquist) || cfg->q < 0 || cfg->beta < 0) {
+        return 1;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->kind = cfg->kind;
+
+    // Biquads from the Audio EQ Cookbook, bilinear transform
+    float w0 = 2.0f * (float)M_PI * cfg->cutoff_hz / MOTION_FILTER_RATE;
+    float alpha = sinf(w0) / (2.0f * (cfg->q > 0 ? cfg->q : (float)M_SQRT1_2));
+    float cw = cosf(w0);
+    float a0 = 1.0f + alpha;
+
+    switch(cfg->kind) {
+        case MOTION_FILTER_LOWPASS:
+        case MOTION_FILTER_GRAVITY:
+            st->b0 = (1.0f - cw) / 2.0f / a0;
+            st->b1 = (1.0f - cw) / a0;
+            st->b2 = st->b0;
+            break;
+        case MOTION_FILTER_HIGHPASS:
+            st->b0 = (1.0f + cw) / 2.0f / a0;
+            st->b1 = -(1.0f + cw) / a0;
+            st->b2 = st->b0;
+            break;
+        case MOTION_FILTER_ONE_EURO:
+        {
+            st->min_cutoff = cfg->cutoff_hz;
+            st->beta = cfg->beta;
+            st->d_alpha = one_euro_d_alpha(MOTION_FILTER_RATE);
+            return 0;
+        }
+        default:
+            return 1;
+    }
+
+    st->a1 = -2.0f * cw / a0;
+    st->a2 = (1.0f - alpha) / a0;
+    return 0;
+}
+
+int motion_set_uniform_rate(int rate) {
+    if(rate < 0 || rate > MOTION_UNIFORM_MAX_RATE) {
+        return 1;
+    }
+
+    // The clock is fitted again from scratch
+    for(struct motion_device *cur = gDevices; cur != NULL; cur = cur->next) {
+        cur->uniform.reports = 0;
+    }
+    gUniformRate = rate;
+
+    return 0;
+}
+
+int motion_set_accel_filter(motion_filter_t const *stages, int count) {
+    if(count < 0 || count > MOTION_FILTER_MAX_STAGES || (count > 0 && stages == NULL)) {
+        return 1;
+    }
+
+    filter_stage_t tmp[MOTION_FILTER_MAX_STAGES];
+    for(int i = 0; i < count; i++) {
+        if(init_filter_stage(&tmp[i], &stages[i]) != 0) {
+            return 1;
+        }
+    }
+
+    memcpy(gFilters.stages, tmp, count * sizeof(tmp[0]));
+    gFilters.count = count;
+
+    for(struct motion_device *cur = gDevices; cur != NULL; cur = cur->next) {
+        cur->filter_primed = 0;
+    }
+
+    return 0;
+}
+
+void motion_subscribe(unsigned streams) {
+    for(int i = 0; i < NUM_STREAMS; i++) {
+        if(streams & (1u << i)) {
+            gStreamRefs[i]++;
+        }
+    }
+
+    gStreamsChanged = 1;
+    wake_waiter();
+}
+
+void motion_unsubscribe(unsigned streams) {
+    for(int i = 0; i < NUM_STREAMS; i++) {
+        if((streams & (1u << i)) && gStreamRefs[i] > 0) {
+            gStreamRefs[i]--;
+        }
+    }
+
+    gStreamsChanged = 1;
+    wake_waiter();
+}
+
+int motion_get_output_stats(int iPlayer, motion_output_stats_t *stats) {
+    assert(stats != NULL);
+    if(stats == NULL) {
+        return 1;
+    }
+
+    struct motion_device *cur = find_device(iPlayer);
+    if(cur == NULL) {
+        return 1;
+    }
+
+    stats->queue_depth = STAT_GET(cur->out_queue.count);
+    stats->peak_queue_depth = STAT_GET(cur->out_queue.peak_count);
+    stats->sent = STAT_GET(cur->out_queue.sent);
+    stats->coalesced = STAT_GET(cur->out_queue.coalesced);
+
+    return 0;
+}
+
+int motion_get_stats(motion_stats_t *stats, motion_device_stats_t *devices, int max_devices) {
+    assert(stats != NULL);
+    if(stats == NULL) {
+        return 0;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->failed_inquiries = STAT_GET(gFailedInquiries);
+
+    uint64_t now = now_micros();
+    int written = 0;
+    struct motion_device *cur = __atomic_load_n(&gDevices, __ATOMIC_ACQUIRE);
+    while(cur != NULL) {
+        device_counters_t *c = &cur->counters;
+        motion_device_stats_t d;
+
+        d.player = cur->player;
+        d.connected = STAT_GET(cur->state) != DEV_STATE_DISCONNECTED;
+        for(int i = 0; i < MOTION_STATS_NUM_REPORT_CODES; i++) {
+            d.packets[i] = STAT_GET(c->packets[i]);
+            stats->packets += d.packets[i];
+        }
+        d.bytes = STAT_GET(c->bytes);
+        d.unhandled_packets = STAT_GET(c->unhandled_packets);
+        d.unknown_extensions = STAT_GET(c->unknown_extensions);
+        d.failed_reads = STAT_GET(c->failed_reads);
+        for(int i = 0; i < MOTION_STATS_NUM_DECODE_BUCKETS; i++) {
+            d.decode_time[i] = STAT_GET(c->decode_time[i]);
+        }
+        d.events_emitted = STAT_GET(c->events_emitted);
+        d.events_dropped = STAT_GET(cur->ev_ring.dropped);
+        d.disconnects = STAT_GET(c->disconnects);
+        d.reconnects = STAT_GET(c->reconnects);
+        d.ir_outliers = STAT_GET(c->ir_outliers);
+
+        gesture_stream_t const *g = __atomic_load_n(&cur->gestures, __ATOMIC_ACQUIRE);
+        d.gesture_windows = g != NULL ? STAT_GET(g->windows) : 0;
+        d.gesture_pruned = g != NULL ? STAT_GET(g->pruned) : 0;
+
+        d.output.queue_depth = STAT_GET(cur->out_queue.count);
+        d.output.peak_queue_depth = STAT_GET(cur->out_queue.peak_count);
+        d.output.sent = STAT_GET(cur->out_queue.sent);
+        d.output.coalesced = STAT_GET(cur->out_queue.coalesced);
+
+        d.report_interval = STAT_GET(cur->uniform.stat_interval);
+        d.uniform_jitter = STAT_GET(cur->uniform.stat_jitter);
+        d.uniform_delay = STAT_GET(cur->uniform.stat_delay);
+        d.uniform_underruns = STAT_GET(cur->uniform.underruns);
+        d.predict_error = STAT_GET(cur->predictor.stat_predict);
+        d.hold_error = STAT_GET(cur->predictor.stat_hold);
+
+        uint64_t last = STAT_GET(c->last_packet_time);
+        if(last == 0) {
+            d.micros_since_last_packet = UINT64_MAX;
+        } else {
+            d.micros_since_last_packet = (now > last) ? now - last : 0;
+        }
+
+        stats->num_devices++;
+        stats->bytes += d.bytes;
+        stats->unhandled_packets += d.unhandled_packets;
+        stats->events_emitted += d.events_emitted;
+        stats->events_dropped += d.events_dropped;
+
+        if(devices != NULL && written < max_devices) {
+            devices[written++] = d;
+        }
+
+        cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE);
+    }
+
+    return written;
 }
@@ -0,0 +1,131 @@
+//
+// Trace point recording and Chrome trace-event JSON export
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "motion_trace.h"
+
+#ifdef MOTION_TRACE
+
+// Events per thread; the oldest ones are overwritten
+#define TRACE_RING_SIZ (1 << 16)
+
+typedef struct trace_event {
+    char const *name;
+    uint64_t timestamp;
+    int64_t arg;
+    char phase;
+} trace_event_t;
+
+// Written only by its owner thread. `wr` counts every event ever recorded
+// and is published with a release store after the event is in place.
+typedef struct trace_ring {
+    struct trace_ring *next;
+    int tid;
+    uint64_t wr;
+    trace_event_t ev[TRACE_RING_SIZ];
+} trace_ring_t;
+
+static trace_ring_t *gRings = NULL;
+static int gNextTid = 1;
+static __thread trace_ring_t *tRing = NULL;
+
+static trace_ring_t *create_ring() {
+    trace_ring_t *ring = (trace_ring_t*)calloc(1, sizeof(trace_ring_t));
+    if(ring == NULL) {
+        return NULL;
+    }
+
+    ring->tid = __atomic_fetch_add(&gNextTid, 1, __ATOMIC_RELAXED);
+
+    // Lock-free push onto the list of rings; rings are never freed so
+    // the dump can't race with a thread exiting
+    ring->next = __atomic_load_n(&gRings, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&gRings, &ring->next, ring, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    return ring;
+}
+
+void motion_trace_event(char const *name, char phase, int64_t arg) {
+    if(tRing == NULL) {
+        tRing = create_ring();
+        if(tRing == NULL) {
+            return;
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t wr = tRing->wr;
+    trace_event_t *ev = &tRing->ev[wr % TRACE_RING_SIZ];
+    ev->name = name;
+    ev->timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->arg = arg;
+    ev->phase = phase;
+
+    __atomic_store_n(&tRing->wr, wr + 1, __ATOMIC_RELEASE);
+}
+
+int motion_trace_dump(char const *path) {
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        return 1;
+    }
+
+    int first = 1;
+    fprintf(f, "{\"traceEvents\":[\n");
+
+    trace_ring_t *ring = __atomic_load_n(&gRings, __ATOMIC_ACQUIRE);
+    for(; ring != NULL; ring = ring->next) {
+        uint64_t wr = __atomic_load_n(&ring->wr, __ATOMIC_ACQUIRE);
+        uint64_t rd = (wr > TRACE_RING_SIZ) ? wr - TRACE_RING_SIZ : 0;
+
+        // Events being overwritten while we read are torn; dump from a
+        // quiet moment (e.g. at exit) for a clean trace
+        for(; rd < wr; rd++) {
+            trace_event_t const *ev = &ring->ev[rd % TRACE_RING_SIZ];
+
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%d",
+                    first ? "" : ",\n",
+                    ev->name, ev->phase,
+                    (unsigned long long)(ev->timestamp / 1000),
+                    (unsigned)(ev->timestamp % 1000),
+                    ring->tid);
+
+            if(ev->phase == 'C') {
+                fprintf(f, ",\"args\":{\"%s\":%lld}", ev->name, (long long)ev->arg);
+            } else if(ev->phase == 'i') {
+                fprintf(f, ",\"s\":\"t\",\"args\":{\"arg\":%lld}", (long long)ev->arg);
+            }
+
+            fprintf(f, "}");
+            first = 0;
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+    int failed = ferror(f);
+    if(fclose(f) != 0 || failed) {
+        return 1;
+    }
+
+    return 0;
+}
+
+#else
+
+void motion_trace_event(char const *name, char phase, int64_t arg) {
+}
+
+int motion_trace_dump(char const *path) {
+    return 1;
+}
+
+#endif
@@ -0,0 +1,158 @@
+//
+// Resampling and Yamaha ADPCM encoding for the Wiimote speaker
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "speaker_codec.h"
+
+// Table entries per zero crossing of the kernel
+#define KERNEL_RES (256)
+// Fraction of the lower rate's Nyquist frequency that passes
+#define KERNEL_CUTOFF (0.9f)
+
+// Windowed sinc sampled over [0, SPEAKER_KERNEL_ZEROS], followed by zeros
+// so lookups at the very edge need no bounds check
+static float gKernel[SPEAKER_KERNEL_ZEROS * KERNEL_RES + 2];
+static pthread_once_t gKernelOnce = PTHREAD_ONCE_INIT;
+
+static void init_kernel() {
+    for(int i = 0; i <= SPEAKER_KERNEL_ZEROS * KERNEL_RES; i++) {
+        double x = (double)i / KERNEL_RES;
+        double t = M_PI * KERNEL_CUTOFF * x;
+        double sinc = (i == 0) ? 1.0 : sin(t) / t;
+        // Blackman window
+        double w = x / SPEAKER_KERNEL_ZEROS;
+        double window = 0.42 + 0.5 * cos(M_PI * w) + 0.08 * cos(2 * M_PI * w);
+        gKernel[i] = (float)(KERNEL_CUTOFF * sinc * window);
+    }
+    gKernel[SPEAKER_KERNEL_ZEROS * KERNEL_RES + 1] = 0;
+}
+
+int speaker_resampler_init(speaker_resampler_t *r, int in_rate, int out_rate) {
+    if(in_rate < 1000 || in_rate > SPEAKER_MAX_INPUT_RATE || out_rate < 1000 || out_rate > in_rate * 64) {
+        return 1;
+    }
+
+    pthread_once(&gKernelOnce, init_kernel);
+
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+    r->step = (double)in_rate / out_rate;
+    r->scale = r->step > 1.0 ? (float)r->step : 1.0f;
+    r->half = (int)ceilf(SPEAKER_KERNEL_ZEROS * r->scale);
+
+    // Silence before the first sample, so the first output needs no
+    // special casing
+    r->len = r->half - 1;
+    r->pos = r->half - 1;
+    memset(r->hist, 0, r->len * sizeof(float));
+
+    return 0;
+}
+
+int speaker_resample(speaker_resampler_t *r, int16_t const *in, int count, int16_t *out) {
+    float const inv_scale = 1.0f / r->scale;
+    int const taps = 2 * r->half;
+    float const last = SPEAKER_KERNEL_ZEROS * KERNEL_RES;
+    int written = 0;
+
+    while(count > 0) {
+        int n = count < SPEAKER_RESAMPLE_CHUNK ? count : SPEAKER_RESAMPLE_CHUNK;
+        for(int i = 0; i < n; i++) {
+            r->hist[r->len + i] = in[i];
+        }
+        r->len += n;
+        in += n;
+        count -= n;
+
+        while((int)r->pos + r->half < r->len) {
+            int center = (int)r->pos;
+            float frac = (float)(r->pos - center);
+            float const *h = &r->hist[center - r->half + 1];
+
+            // Straight-line loop over contiguous taps, left for the
+            // compiler to vectorise
+            float acc = 0;
+            for(int i = 0; i < taps; i++) {
+                float x = fabsf((float)(i - r->half + 1) - frac) * inv_scale * KERNEL_RES;
+                x = x < last ? x : last;
+                int j = (int)x;
+                float w = gKernel[j] + (gKernel[j + 1] - gKernel[j]) * (x - j);
+                acc += h[i] * w;
+            }
+
+            acc *= inv_scale;
+            acc = acc > 32767.0f ? 32767.0f : (acc < -32768.0f ? -32768.0f : acc);
+            out[written++] = (int16_t)lrintf(acc);
+
+            r->pos += r->step;
+        }
+
+        // Drop the samples no future output reaches
+        int drop = (int)r->pos - r->half + 1;
+        if(drop > 0) {
+            memmove(r->hist, r->hist + drop, (r->len - drop) * sizeof(float));
+            r->len -= drop;
+            r->pos -= drop;
+        }
+    }
+
+    return written;
+}
+
+static int const gIndexScale[16] = {
+    230, 230, 230, 230, 307, 409, 512, 614,
+    230, 230, 230, 230, 307, 409, 512, 614,
+};
+
+static int const gDiffLookup[16] = {
+    1, 3, 5, 7, 9, 11, 13, 15,
+    -1, -3, -5, -7, -9, -11, -13, -15,
+};
+
+void speaker_adpcm_init(speaker_adpcm_t *s) {
+    s->predictor = 0;
+    s->step = 127;
+    s->pending = -1;
+}
+
+static inline int encode_sample(speaker_adpcm_t *s, int sample) {
+    int delta = sample - s->predictor;
+    int nibble = (abs(delta) * 4) / s->step;
+    nibble = nibble < 7 ? nibble : 7;
+    nibble |= delta < 0 ? 8 : 0;
+
+    // Track the decoder's state exactly, so errors don't accumulate
+    int predictor = s->predictor + (s->step * gDiffLookup[nibble]) / 8;
+    s->predictor = predictor > 32767 ? 32767 : (predictor < -32768 ? -32768 : predictor);
+
+    int step = (s->step * gIndexScale[nibble]) >> 8;
+    s->step = step < 127 ? 127 : (step > 24576 ? 24576 : step);
+
+    return nibble;
+}
+
+int speaker_adpcm_encode(speaker_adpcm_t *s, int16_t const *in, int count, uint8_t *out) {
+    int written = 0;
+    int i = 0;
+
+    if(s->pending >= 0 && count > 0) {
+        out[written++] = (uint8_t)((s->pending << 4) | encode_sample(s, in[i++]));
+        s->pending = -1;
+    }
+
+    for(; i + 1 < count; i += 2) {
+        int hi = encode_sample(s, in[i]);
+        out[written++] = (uint8_t)((hi << 4) | encode_sample(s, in[i + 1]));
+    }
+
+    if(i < count) {
+        s->pending = encode_sample(s, in[i]);
+    }
+
+    return written;
+}
@@ -8,6 +8,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -17,17 +20,261 @@
 #include <bluetooth/l2cap.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <pthread.h>
 
 #include "wiimote_hw.h"
 
 static int iDevID, iSocket;
+// Address of the adapter iDevID; every channel is opened through it
+static bdaddr_t gLocalAddr;
 static int nInitCount = 0;
 
+// Known addresses are paged all at once, and those that don't answer
+// within this time are left to the inquiry, instead of each taking the
+// whole page timeout (5.12 s by default)
+#define CACHED_CONNECT_TIMEOUT_MS (800)
+// Most cached addresses paged at once
+#define MAX_PARALLEL_CONNECTS (16)
+
+// Path of the file listing the addresses of verified Wiimotes, one per line
+static char *pszCachePath = NULL;
+
 typedef struct wiimote_device {
+    struct wiimote_device *next;
+    // Held shared while using the sockets, and exclusively by
+    // wiimote_reconnect to swap them
+    pthread_rwlock_t io_lock;
     int sock_ctl, sock_dat;
     bdaddr_t addr;
 } wiimote_device;
 
+// Every handle that hasn't been disconnected yet, connected or not.
+// Scans skip these addresses; they're brought back by wiimote_reconnect.
+static wiimote_device *gHandles = NULL;
+static pthread_mutex_t gHandlesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_known_address(bdaddr_t const *addr) {
+    int ret = 0;
+
+    pthread_mutex_lock(&gHandlesLock);
+    for(wiimote_device *cur = gHandles; cur != NULL; cur = cur->next) {
+        if(bacmp(&cur->addr, addr) == 0) {
+            ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gHandlesLock);
+
+    return ret;
+}
+
+static void register_handle(wiimote_device *dev) {
+    pthread_mutex_lock(&gHandlesLock);
+    dev->next = gHandles;
+    gHandles = dev;
+    pthread_mutex_unlock(&gHandlesLock);
+}
+
+static uint64_t now_millis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// An address being connected to by connect_channels
+typedef struct pending_connect {
+    bdaddr_t addr;
+    // Control and data channel, -1 until opened
+    int sock[2];
+    // Channel being connected, CONNECT_DONE once both are or
+    // CONNECT_FAILED
+    int step;
+} pending_connect_t;
+
+#define CONNECT_DONE (2)
+#define CONNECT_FAILED (-1)
+
+// Starts a non-blocking connect of an L2CAP channel to `addr` through the
+// adapter wiimote_init picked. Returns the socket, or -1.
+static int start_channel(bdaddr_t const *addr, unsigned short psm) {
+    int sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP);
+    if(sock < 0) {
+        perror("wiimote_hw: socket failed\n");
+        return -1;
+    }
+
+    struct sockaddr_l2 local = {0};
+    local.l2_family = AF_BLUETOOTH;
+    memcpy(&local.l2_bdaddr, &gLocalAddr, sizeof(local.l2_bdaddr));
+    if(bind(sock, (struct sockaddr*)&local, sizeof(local)) != 0) {
+        perror("wiimote_hw: bind failed\n");
+        close(sock);
+        return -1;
+    }
+
+    struct sockaddr_l2 remote = {0};
+    remote.l2_family = AF_BLUETOOTH;
+    remote.l2_psm = psm;
+    memcpy(&remote.l2_bdaddr, addr, sizeof(remote.l2_bdaddr));
+
+    if(connect(sock, (struct sockaddr*)&remote, sizeof(remote)) != 0 && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static void fail_connect(pending_connect_t *p) {
+    for(int i = 0; i < 2; i++) {
+        if(p->sock[i] >= 0) {
+            close(p->sock[i]);
+            p->sock[i] = -1;
+        }
+    }
+    p->step = CONNECT_FAILED;
+}
+
+// Moves an entry whose current channel finished connecting on to the next
+static void advance_connect(pending_connect_t *p) {
+    static unsigned short const psm[2] = { 0x11, 0x13 };
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(p->sock[p->step], SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        fail_connect(p);
+        return;
+    }
+
+    p->step++;
+    if(p->step < CONNECT_DONE) {
+        p->sock[p->step] = start_channel(&p->addr, psm[p->step]);
+        if(p->sock[p->step] < 0) {
+            fail_connect(p);
+        }
+        return;
+    }
+
+    // Sends block as before; receives pass MSG_DONTWAIT
+    for(int i = 0; i < 2; i++) {
+        fcntl(p->sock[i], F_SETFL, fcntl(p->sock[i], F_GETFL) & ~O_NONBLOCK);
+    }
+}
+
+// Opens the control and then the data channel to every address, paging
+// all of them at once. Entries that failed or didn't finish within
+// `timeout_ms` (no limit if zero) end up CONNECT_FAILED.
+static void connect_channels(pending_connect_t *pending, int count, int timeout_ms) {
+    struct pollfd fds[MAX_PARALLEL_CONNECTS];
+    int which[MAX_PARALLEL_CONNECTS];
+    uint64_t deadline = now_millis() + timeout_ms;
+    assert(count <= MAX_PARALLEL_CONNECTS);
+
+    for(int i = 0; i < count; i++) {
+        pending_connect_t *p = &pending[i];
+        p->step = 0;
+        p->sock[0] = start_channel(&p->addr, 0x11);
+        p->sock[1] = -1;
+        if(p->sock[0] < 0) {
+            p->step = CONNECT_FAILED;
+        }
+    }
+
+    for(;;) {
+        int n = 0;
+        for(int i = 0; i < count; i++) {
+            if(pending[i].step >= 0 && pending[i].step < CONNECT_DONE) {
+                fds[n].fd = pending[i].sock[pending[i].step];
+                fds[n].events = POLLOUT;
+                which[n++] = i;
+            }
+        }
+
+        int wait = -1;
+        if(timeout_ms > 0) {
+            uint64_t now = now_millis();
+            wait = now < deadline ? (int)(deadline - now) : 0;
+        }
+        if(n == 0 || wait == 0) {
+            break;
+        }
+
+        if(poll(fds, n, wait) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for(int k = 0; k < n; k++) {
+            if(fds[k].revents != 0) {
+                advance_connect(&pending[which[k]]);
+            }
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(pending[i].step != CONNECT_DONE) {
+            fail_connect(&pending[i]);
+        }
+    }
+}
+
+// Wraps the sockets of a connected entry in a new handle
+static wiimote_device *new_handle(pending_connect_t const *p) {
+    wiimote_device* dev = (wiimote_device*)malloc(sizeof(wiimote_device));
+    memcpy(&dev->addr, &p->addr, sizeof(bdaddr_t));
+    dev->sock_ctl = p->sock[0];
+    dev->sock_dat = p->sock[1];
+    pthread_rwlock_init(&dev->io_lock, NULL);
+
+    return dev;
+}
+
+// Returns nonzero if the address is listed in the device cache
+static int is_cached_address(bdaddr_t const *addr) {
+    char line[64];
+    bdaddr_t cached;
+    int ret = 0;
+
+    if(pszCachePath == NULL) {
+        return 0;
+    }
+
+    FILE *f = fopen(pszCachePath, "r");
+    if(f == NULL) {
+        return 0;
+    }
+
+    while(!ret && fgets(line, sizeof(line), f) != NULL) {
+        if(str2ba(line, &cached) == 0 && bacmp(&cached, addr) == 0) {
+            ret = 1;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+// Remembers a verified Wiimote so the next start can connect directly
+static void add_to_cache(bdaddr_t const *addr) {
+    char addr_buf[19];
+
+    if(pszCachePath == NULL || is_cached_address(addr)) {
+        return;
+    }
+
+    FILE *f = fopen(pszCachePath, "a");
+    if(f == NULL) {
+        perror("wiimote_hw: can't open device cache\n");
+        return;
+    }
+
+    ba2str(addr, addr_buf);
+    fprintf(f, "%s\n", addr_buf);
+    fclose(f);
+}
+
 // Determines whether a given Bluetooth device is a Wiiimote
 static int is_wiimote(bdaddr_t const* addr) {
     sdp_list_t *response_list = NULL, *search_list, *attrid_list;
@@ -113,7 +360,7 @@ int wiimote_init() {
     iDevID = hci_get_route(NULL);
     iSocket = hci_open_dev(iDevID);
 
-    if(iDevID < 0 || iSocket < 0) {
+    if(iDevID < 0 || iSocket < 0 || hci_devba(iDevID, &gLocalAddr) < 0) {
         return 1;
     }
 
@@ -129,6 +376,7 @@ int wiimote_shutdown() {
     }
 
     close(iSocket);
+    wiimote_set_device_cache(NULL);
     nInitCount--;
     return 0;
 }
@@ -162,39 +410,27 @@ int wiimote_scan(struct wiimote_listener *l, void *user) {
         ba2str(addr, addr_buf);
         printf("Device #%d addr=%s\n", i, addr_buf);
 
+        if(is_known_address(&ii[i].bdaddr)) {
+            printf("Device #%d is already known\n", i);
+            continue;
+        }
+
         if(is_wiimote(&ii[i].bdaddr)) {
             printf("Device #%d is a wiimote\n", i);
-            int status;
-
-            wiimote_device* dev = (wiimote_device*)malloc(sizeof(wiimote_device));
-            memcpy(&dev->addr, &ii[i].bdaddr, sizeof(bdaddr_t));
-            dev->sock_ctl = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-            dev->sock_dat = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-
-            struct sockaddr_l2 addr = {0};
-            addr.l2_family = AF_BLUETOOTH;
-            memcpy(&addr.l2_bdaddr, &dev->addr, sizeof(addr.l2_bdaddr));
-
-            addr.l2_psm = 0x11;
-            status = connect(dev->sock_ctl, (struct sockaddr*)&addr, sizeof(addr));
-            if(status != 0) {
-                perror("wiimote_hw: connect(ctl) failed\n");
-                close(dev->sock_ctl);
-                close(dev->sock_dat);
-                free(dev);
-                continue;
-            }
 
-            addr.l2_psm = 0x13;
-            status = connect(dev->sock_dat, (struct sockaddr*)&addr, sizeof(addr));
-            if(status != 0) {
-                perror("wiimote_hw: connect(dat) failed\n");
-                close(dev->sock_ctl);
-                close(dev->sock_dat);
-                free(dev);
+            add_to_cache(&ii[i].bdaddr);
+
+            pending_connect_t p;
+            memcpy(&p.addr, &ii[i].bdaddr, sizeof(bdaddr_t));
+            connect_channels(&p, 1, 0);
+            if(p.step != CONNECT_DONE) {
                 continue;
             }
 
+            wiimote_device* dev = new_handle(&p);
+
+            register_handle(dev);
+
             if(l->on_device_found != NULL) {
                 l->on_device_found(dev, user);
             }
@@ -211,28 +447,153 @@ int wiimote_disconnect(HWIIMOTE hDev) {
         return 1;
     }
 
-    close(hDev->sock_dat);
-    close(hDev->sock_ctl);
+    pthread_mutex_lock(&gHandlesLock);
+    wiimote_device **next_ptr = &gHandles;
+    while(*next_ptr != NULL && *next_ptr != hDev) {
+        next_ptr = &(*next_ptr)->next;
+    }
+    if(*next_ptr != NULL) {
+        *next_ptr = hDev->next;
+    }
+    pthread_mutex_unlock(&gHandlesLock);
+
+    if(hDev->sock_dat >= 0) {
+        close(hDev->sock_dat);
+    }
+    if(hDev->sock_ctl >= 0) {
+        close(hDev->sock_ctl);
+    }
+    pthread_rwlock_destroy(&hDev->io_lock);
     free(hDev);
 
     return 0;
 }
 
+int wiimote_reconnect(HWIIMOTE hDev) {
+    assert(nInitCount > 0);
+    if(hDev == NULL || nInitCount == 0) {
+        return 1;
+    }
+
+    // Other threads may still be sending on the old sockets; they stay
+    // open until the new ones are swapped in, so a racing send fails on
+    // the dead link instead of hitting a closed, maybe reused, descriptor
+    pending_connect_t p;
+    memcpy(&p.addr, &hDev->addr, sizeof(bdaddr_t));
+    connect_channels(&p, 1, CACHED_CONNECT_TIMEOUT_MS);
+    if(p.step != CONNECT_DONE) {
+        return 1;
+    }
+
+    pthread_rwlock_wrlock(&hDev->io_lock);
+    int old_ctl = hDev->sock_ctl, old_dat = hDev->sock_dat;
+    hDev->sock_ctl = p.sock[0];
+    hDev->sock_dat = p.sock[1];
+    pthread_rwlock_unlock(&hDev->io_lock);
+
+    close(old_dat);
+    close(old_ctl);
+
+    return 0;
+}
+
+void wiimote_set_device_cache(char const *path) {
+    free(pszCachePath);
+    pszCachePath = (path != NULL) ? strdup(path) : NULL;
+}
+
+int wiimote_connect_cached(struct wiimote_listener *l, void *user) {
+    assert(nInitCount > 0);
+    assert(l != NULL);
+
+    if(nInitCount == 0 || l == NULL || pszCachePath == NULL) {
+        return 0;
+    }
+
+    FILE *f = fopen(pszCachePath, "r");
+    if(f == NULL) {
+        // Nothing cached yet
+        return 0;
+    }
+
+    char line[64];
+    pending_connect_t pending[MAX_PARALLEL_CONNECTS];
+    int count = 0;
+
+    while(count < MAX_PARALLEL_CONNECTS && fgets(line, sizeof(line), f) != NULL) {
+        if(str2ba(line, &pending[count].addr) == 0 && !is_known_address(&pending[count].addr)) {
+            count++;
+        }
+    }
+    fclose(f);
+
+    // Already verified when they were cached; skip the OUI and SDP checks
+    connect_channels(pending, count, CACHED_CONNECT_TIMEOUT_MS);
+
+    int nConnected = 0;
+    for(int i = 0; i < count; i++) {
+        if(pending[i].step != CONNECT_DONE) {
+            continue;
+        }
+
+        wiimote_device* dev = new_handle(&pending[i]);
+        register_handle(dev);
+        nConnected++;
+
+        if(l->on_device_found != NULL) {
+            l->on_device_found(dev, user);
+        }
+    }
+
+    return nConnected;
+}
+
 int wiimote_send(HWIIMOTE hDev, void const *data, size_t length) {
-    return write(hDev->sock_dat, data, length) == length;
+    pthread_rwlock_rdlock(&hDev->io_lock);
+    // MSG_NOSIGNAL: a vanished device must not raise SIGPIPE
+    int ok = send(hDev->sock_dat, data, length, MSG_NOSIGNAL) == length;
+    pthread_rwlock_unlock(&hDev->io_lock);
+
+    return ok;
+}
+
+int wiimote_get_address(HWIIMOTE hDev, char *buf, size_t length) {
+    if(length < WIIMOTE_ADDRESS_SIZ) {
+        return -1;
+    }
+
+    ba2str(&hDev->addr, buf);
+    return 0;
+}
+
+int wiimote_get_fd(HWIIMOTE hDev) {
+    pthread_rwlock_rdlock(&hDev->io_lock);
+    int fd = hDev->sock_dat;
+    pthread_rwlock_unlock(&hDev->io_lock);
+
+    return fd;
 }
 
 int wiimote_recv(HWIIMOTE hDev, void *data, size_t length) {
     int rd;
 
+    pthread_rwlock_rdlock(&hDev->io_lock);
     rd = recv(hDev->sock_dat, data, length, MSG_DONTWAIT);
+    int err = errno;
+    pthread_rwlock_unlock(&hDev->io_lock);
+
     if(rd == -1) {
-        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        if(err == EAGAIN || err == EWOULDBLOCK) {
             return 0;
         } else {
             return -1;
         }
     }
 
+    if(rd == 0) {
+        // The remote end hung up
+        return -1;
+    }
+
     return rd;
 }
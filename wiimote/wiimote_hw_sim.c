@@ -0,0 +1,410 @@
+//
+// Wiimote communication abstraction layer, simulated implementation
+//
+// Stands in for wiimote_hw.c on machines without Bluetooth. Emulates
+// WIIMOTE_SIM_DEVICES (default 1) Wiimotes without extensions that answer
+// status requests and memory reads and stream data reports at 100 Hz in
+// whatever mode they were set to. In modes with IR data the camera sees a
+// sensor bar 2 m away circling the center of its view, and a stray
+// reflection in a corner.
+//
+// WIIMOTE_SIM_BURST_US delays reports to the next multiple of the given
+// number of microseconds, imitating the bursty delivery of a real link.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "wiimote_hw.h"
+#include "wiimote_protocol.h"
+
+#define SIM_MAX_DEVICES (32)
+#define SIM_REPORT_INTERVAL_US (10000)
+#define SIM_RESPONSE_RING_SIZ (32)
+#define SIM_PACKET_MAX_SIZ (32)
+
+typedef struct sim_packet {
+    int len;
+    uint8_t data[SIM_PACKET_MAX_SIZ];
+} sim_packet_t;
+
+typedef struct wiimote_device {
+    int index;
+    int found;
+    uint8_t mode;
+
+    // Generation time of the next data report, in microseconds
+    uint64_t next_report_time;
+    unsigned report_count;
+
+    // Timer armed for the next packet, so the device can be waited on
+    int timer_fd;
+
+    // Replies to output reports, delivered before any data report
+    int rd, wr;
+    sim_packet_t responses[SIM_RESPONSE_RING_SIZ];
+} wiimote_device;
+
+static wiimote_device gSimDevices[SIM_MAX_DEVICES];
+static int nSimDevices = 0;
+static uint64_t nBurstInterval = 0;
+static int nInitCount = 0;
+
+static uint64_t sim_now_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Time the next data report is delivered, in microseconds
+static uint64_t next_report_due(wiimote_device *dev) {
+    uint64_t due = dev->next_report_time;
+    if(nBurstInterval > 0) {
+        due = (due + nBurstInterval - 1) / nBurstInterval * nBurstInterval;
+    }
+    return due;
+}
+
+static void arm_timer(wiimote_device *dev) {
+    if(dev->timer_fd < 0) {
+        return;
+    }
+
+    // Clear a pending expiration before re-arming
+    uint64_t expirations;
+    (void)!read(dev->timer_fd, &expirations, sizeof(expirations));
+
+    uint64_t due = (dev->rd != dev->wr) ? 1 : next_report_due(dev);
+    struct itimerspec its = { { 0, 0 }, { due / 1000000, (due % 1000000) * 1000 } };
+    timerfd_settime(dev->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void push_response(wiimote_device *dev, uint8_t const *data, int len) {
+    assert(len <= SIM_PACKET_MAX_SIZ);
+
+    sim_packet_t *pkt = &dev->responses[dev->wr];
+    memcpy(pkt->data, data, len);
+    pkt->len = len;
+
+    dev->wr = (dev->wr + 1) % SIM_RESPONSE_RING_SIZ;
+    if(dev->wr == dev->rd) {
+        dev->rd = (dev->rd + 1) % SIM_RESPONSE_RING_SIZ;
+    }
+
+    arm_timer(dev);
+}
+
+// Payload size of a data report, not counting the two header bytes
+static int data_report_len(uint8_t mode) {
+    switch(mode) {
+        case WIIM_REPORT_MODE_BUTTONS:                  return 2;
+        case WIIM_REPORT_MODE_BUTTONS_ACCEL:            return 5;
+        case WIIM_REPORT_MODE_BUTTONS_EXT8:             return 10;
+        case WIIM_REPORT_MODE_BUTTONS_ACCEL_IR12:       return 17;
+        default:                                        return 21;
+    }
+}
+
+static int has_accel(uint8_t mode) {
+    return mode == WIIM_REPORT_MODE_BUTTONS_ACCEL ||
+        mode == WIIM_REPORT_MODE_BUTTONS_ACCEL_IR12 ||
+        mode == WIIM_REPORT_MODE_BUTTONS_ACCEL_EXT16 ||
+        mode == WIIM_REPORT_MODE_BUTTONS_ACCEL_IR10_EXT6 ||
+        mode == WIIM_REPORT_MODE_BUTTONS_ACCEL_IR36_INTER0 ||
+        mode == WIIM_REPORT_MODE_BUTTONS_ACCEL_IR36_INTER1;
+}
+
+// Offset of the IR data in a data report, or zero
+static int ir_offset(uint8_t mode) {
+    switch(mode) {
+        case WIIM_REPORT_MODE_BUTTONS_ACCEL_IR12:       return 7;
+        case WIIM_REPORT_MODE_BUTTONS_IR10_EXT9:        return 4;
+        case WIIM_REPORT_MODE_BUTTONS_ACCEL_IR10_EXT6:  return 7;
+        default:                                        return 0;
+    }
+}
+
+// The three dots of report time `t`, in the 12 byte extended format if
+// `extended` and the 10 byte basic one otherwise
+static void fill_ir(double t, int extended, uint8_t *ir) {
+    double cx = 512 + 200 * cos(t * 0.5), cy = 384 + 150 * sin(t * 0.5);
+    unsigned const dots[4][3] = {
+        { (unsigned)(cx - 87), (unsigned)cy, 4 },
+        { (unsigned)(cx + 87), (unsigned)cy, 4 },
+        { 980, 720, 1 },
+        { 1023, 1023, 15 },
+    };
+
+    if(extended) {
+        for(int i = 0; i < 4; i++) {
+            ir[3 * i] = dots[i][0] & 0xFF;
+            ir[3 * i + 1] = dots[i][1] & 0xFF;
+            ir[3 * i + 2] = ((dots[i][1] >> 8) << 6) | ((dots[i][0] >> 8) << 4) | dots[i][2];
+        }
+        return;
+    }
+
+    for(int i = 0; i < 2; i++) {
+        unsigned const *a = dots[2 * i], *b = dots[2 * i + 1];
+        ir[5 * i] = a[0] & 0xFF;
+        ir[5 * i + 1] = a[1] & 0xFF;
+        ir[5 * i + 2] = ((a[1] >> 8) << 6) | ((a[0] >> 8) << 4) | ((b[1] >> 8) << 2) | (b[0] >> 8);
+        ir[5 * i + 3] = b[0] & 0xFF;
+        ir[5 * i + 4] = b[1] & 0xFF;
+    }
+}
+
+// Core buttons of the n-th report: A is held every other second
+static void fill_buttons(wiimote_device *dev, uint8_t *btn) {
+    btn[0] = 0;
+    btn[1] = ((dev->report_count / 100) % 2) ? 0x08 : 0x00;
+}
+
+static int build_data_report(wiimote_device *dev, uint8_t *buf) {
+    int len = 2 + data_report_len(dev->mode);
+
+    memset(buf, 0, len);
+    buf[0] = HID_INPUT_REPORT;
+    buf[1] = dev->mode;
+    fill_buttons(dev, buf + 2);
+
+    if(has_accel(dev->mode)) {
+        // Slow rotation around the Z axis, plus 1 g on Z, in raw 10-bit
+        // units with the calibration reported by read_response
+        double t = dev->report_count * (SIM_REPORT_INTERVAL_US / 1e6) + dev->index;
+        unsigned x = (unsigned)(512 + 104 * sin(t * 2.0));
+        unsigned y = (unsigned)(512 + 104 * cos(t * 2.0));
+        unsigned z = 512 + 104;
+
+        buf[2] |= (x & 0x03) << 5;
+        buf[3] |= ((y >> 1) & 0x01) << 5;
+        buf[3] |= ((z >> 1) & 0x01) << 6;
+        buf[4] = x >> 2;
+        buf[5] = y >> 2;
+        buf[6] = z >> 2;
+    }
+
+    if(ir_offset(dev->mode) != 0) {
+        double t = dev->report_count * (SIM_REPORT_INTERVAL_US / 1e6) + dev->index;
+        fill_ir(t, dev->mode == WIIM_REPORT_MODE_BUTTONS_ACCEL_IR12, buf + ir_offset(dev->mode));
+    }
+
+    dev->report_count++;
+
+    return len;
+}
+
+static void read_response(wiimote_device *dev, struct pkt_memory_read const *req) {
+    uint8_t buf[23] = { HID_INPUT_REPORT, WIIM_REPORT_READ_MEM_AND_REGS_DATA };
+    uint16_t size = ((uint16_t)req->siz_hi << 8) | req->siz_lo;
+
+    fill_buttons(dev, buf + 2);
+    buf[5] = req->off_mi;
+    buf[6] = req->off_lo;
+
+    // Bit 0 of the address space is the rumble flag
+    uint8_t space = req->address_space & ~WIIM_DRM_FLAG_RUMBLE;
+
+    if(space == WIIM_ADDRSPACE_EEPROM && req->off_lo == 0x16) {
+        // Accelerometer calibration: zero at 512, one g at 616, followed
+        // by the checksum
+        uint8_t const calib[10] = { 0x80, 0x80, 0x80, 0x00, 0x9A, 0x9A, 0x9A, 0x00, 0x00, 0xA3 };
+        if(size > sizeof(calib)) {
+            size = sizeof(calib);
+        }
+        memcpy(buf + 7, calib, size);
+        buf[4] = ((size - 1) << 4);
+    } else {
+        // Nothing at this address, e.g. no extension connected
+        buf[4] = 0x07;
+    }
+
+    push_response(dev, buf, sizeof(buf));
+}
+
+int wiimote_init() {
+    if(nInitCount > 0) {
+        return 0;
+    }
+
+    char const *env = getenv("WIIMOTE_SIM_DEVICES");
+    nSimDevices = (env != NULL) ? atoi(env) : 1;
+    if(nSimDevices < 0) {
+        nSimDevices = 0;
+    } else if(nSimDevices > SIM_MAX_DEVICES) {
+        nSimDevices = SIM_MAX_DEVICES;
+    }
+
+    env = getenv("WIIMOTE_SIM_BURST_US");
+    nBurstInterval = (env != NULL) ? strtoull(env, NULL, 10) : 0;
+
+    memset(gSimDevices, 0, sizeof(gSimDevices));
+    for(int i = 0; i < nSimDevices; i++) {
+        gSimDevices[i].index = i;
+        gSimDevices[i].mode = WIIM_REPORT_MODE_BUTTONS;
+        gSimDevices[i].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+
+    nInitCount++;
+    printf("wiimote_init: simulating %d device(s)\n", nSimDevices);
+
+    return 0;
+}
+
+int wiimote_shutdown() {
+    if(nInitCount == 0) {
+        return 0;
+    }
+
+    nInitCount--;
+    for(int i = 0; i < nSimDevices; i++) {
+        if(gSimDevices[i].timer_fd >= 0) {
+            close(gSimDevices[i].timer_fd);
+        }
+    }
+
+    return 0;
+}
+
+int wiimote_scan(struct wiimote_listener *l, void *user) {
+    assert(nInitCount > 0);
+    assert(l != NULL);
+
+    if(nInitCount == 0 || l == NULL) {
+        return 1;
+    }
+
+    for(int i = 0; i < nSimDevices; i++) {
+        wiimote_device *dev = &gSimDevices[i];
+        if(dev->found) {
+            continue;
+        }
+
+        dev->found = 1;
+        dev->next_report_time = sim_now_micros();
+        arm_timer(dev);
+
+        if(l->on_device_found != NULL) {
+            l->on_device_found(dev, user);
+        }
+    }
+
+    return 0;
+}
+
+void wiimote_set_device_cache(char const *path) {
+}
+
+int wiimote_connect_cached(struct wiimote_listener *l, void *user) {
+    return 0;
+}
+
+int wiimote_disconnect(HWIIMOTE hDev) {
+    if(hDev == NULL) {
+        return 1;
+    }
+
+    hDev->found = 0;
+    return 0;
+}
+
+int wiimote_reconnect(HWIIMOTE hDev) {
+    return (hDev != NULL) ? 0 : 1;
+}
+
+int wiimote_send(HWIIMOTE hDev, void const *data, size_t length) {
+    struct wiimote_header const *hdr = (struct wiimote_header const *)data;
+
+    if(length < 3 || hdr->hdr.code != HID_OUTPUT_REPORT) {
+        return 0;
+    }
+
+    switch(hdr->code) {
+        case WIIM_REPORT_DATA_REPORT_MODE:
+        {
+            struct pkt_set_data_report_mode const *pkt = data;
+            hDev->mode = pkt->mode;
+            break;
+        }
+        case WIIM_REPORT_STATUS_INFO_REQUEST:
+        {
+            // Full battery, LED 1 lit
+            uint8_t buf[8] = { HID_INPUT_REPORT, WIIM_REPORT_STATUS_INFO, 0, 0, 0x10, 0, 0, 0xC8 };
+            fill_buttons(hDev, buf + 2);
+            push_response(hDev, buf, sizeof(buf));
+            break;
+        }
+        case WIIM_REPORT_READ_MEM_AND_REGS:
+        {
+            read_response(hDev, (struct pkt_memory_read const *)data);
+            break;
+        }
+        case WIIM_REPORT_WRITE_MEM_AND_REGS:
+        {
+            uint8_t buf[6] = { HID_INPUT_REPORT, WIIM_REPORT_ACKNOWLEDGE_OUTPUT, 0, 0, hdr->code, 0 };
+            fill_buttons(hDev, buf + 2);
+            push_response(hDev, buf, sizeof(buf));
+            break;
+        }
+        default:
+            break;
+    }
+
+    return 1;
+}
+
+int wiimote_get_address(HWIIMOTE hDev, char *buf, size_t length) {
+    if(length < WIIMOTE_ADDRESS_SIZ) {
+        return -1;
+    }
+
+    // Stable across runs, so the calibration cache can be exercised
+    snprintf(buf, length, "00:17:AB:00:00:%02X", hDev->index);
+    return 0;
+}
+
+int wiimote_get_fd(HWIIMOTE hDev) {
+    return hDev->timer_fd;
+}
+
+int wiimote_recv(HWIIMOTE hDev, void *data, size_t length) {
+    uint8_t buf[SIM_PACKET_MAX_SIZ];
+    int len;
+
+    if(hDev->rd != hDev->wr) {
+        sim_packet_t *pkt = &hDev->responses[hDev->rd];
+        hDev->rd = (hDev->rd + 1) % SIM_RESPONSE_RING_SIZ;
+
+        len = (pkt->len < (int)length) ? pkt->len : (int)length;
+        memcpy(data, pkt->data, len);
+        arm_timer(hDev);
+        return len;
+    }
+
+    uint64_t now = sim_now_micros();
+    if(now < next_report_due(hDev)) {
+        arm_timer(hDev);
+        return 0;
+    }
+
+    if(now - hDev->next_report_time > 100 * SIM_REPORT_INTERVAL_US) {
+        // Nobody polled for a long time; a real device would have dropped
+        // these reports too
+        hDev->next_report_time = now;
+    }
+    hDev->next_report_time += SIM_REPORT_INTERVAL_US;
+
+    len = build_data_report(hDev, buf);
+    len = (len < (int)length) ? len : (int)length;
+    memcpy(data, buf, len);
+    arm_timer(hDev);
+
+    return len;
+}
@@ -0,0 +1,410 @@
+//
+// Converts a binary wmlog capture into columnar tables
+//
+// Every event kind becomes a table directory under the output directory,
+// holding one file per column plus a columns.json describing them:
+//
+//   accel/       timestamp player buttons ax ay az
+//   button/      timestamp player buttons button released
+//   nunchuk/     timestamp player buttons stick_x stick_y ax ay az
+//   gyro/        timestamp player buttons yaw roll pitch
+//   connection/  timestamp player connected
+//   status/      timestamp player battery battery_low extension leds
+//   gesture/     timestamp player gesture confidence
+//   accel_filtered/  timestamp player buttons ax ay az
+//   accel_uniform/   timestamp player buttons ax ay az
+//   pointer/     timestamp player visible x y distance roll
+//
+// `buttons` is the bitmask of motion_button_t held on that player's device
+// after the event. Columns are plain little-endian arrays (numpy.fromfile
+// reads them directly); with -z integer columns instead store the zig-zag
+// encoded difference to the previous row as LEB128 varints.
+//
+// The input is streamed, so memory use doesn't depend on its size.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <motion_input.h>
+
+#include "wmlog.h"
+
+#define COLUMN_BUFFER_SIZ (64 * 1024)
+#define MAX_COLUMNS (8)
+#define READ_CHUNK_RECORDS (4096)
+#define MAX_PLAYERS (256)
+#define PATH_MAX_SIZ (4096)
+
+typedef enum column_type {
+    COL_U8 = 0,
+    COL_U32,
+    COL_U64,
+    COL_F32,
+} column_type_t;
+
+static char const *gTypeNames[] = { "uint8", "uint32", "uint64", "float32" };
+static int const gTypeSizes[] = { 1, 4, 8, 4 };
+
+typedef struct column {
+    char const *name;
+    column_type_t type;
+    FILE *f;
+    // Previous value, for delta encoding
+    uint64_t prev;
+    size_t len;
+    uint8_t buf[COLUMN_BUFFER_SIZ];
+} column_t;
+
+typedef struct table {
+    char const *name;
+    int num_columns;
+    column_t cols[MAX_COLUMNS];
+    uint64_t rows;
+} table_t;
+
+typedef enum table_id {
+    TABLE_ACCEL = 0,
+    TABLE_BUTTON,
+    TABLE_NUNCHUK,
+    TABLE_GYRO,
+    TABLE_CONNECTION,
+    TABLE_STATUS,
+    TABLE_GESTURE,
+    TABLE_ACCEL_FILTERED,
+    TABLE_ACCEL_UNIFORM,
+    TABLE_POINTER,
+    NUM_TABLES
+} table_id_t;
+
+static table_t gTables[NUM_TABLES];
+static int gDelta = 0;
+
+static void init_table(table_t *t, char const *name, int n, char const *const *names, column_type_t const *types) {
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->num_columns = n;
+    for(int i = 0; i < n; i++) {
+        t->cols[i].name = names[i];
+        t->cols[i].type = types[i];
+    }
+}
+
+static void init_tables() {
+    static char const *const accel[] = { "timestamp", "player", "buttons", "ax", "ay", "az" };
+    static column_type_t const accel_t[] = { COL_U64, COL_U8, COL_U32, COL_F32, COL_F32, COL_F32 };
+    static char const *const button[] = { "timestamp", "player", "buttons", "button", "released" };
+    static column_type_t const button_t[] = { COL_U64, COL_U8, COL_U32, COL_U8, COL_U8 };
+    static char const *const nunchuk[] = { "timestamp", "player", "buttons", "stick_x", "stick_y", "ax", "ay", "az" };
+    static column_type_t const nunchuk_t[] = { COL_U64, COL_U8, COL_U32, COL_F32, COL_F32, COL_F32, COL_F32, COL_F32 };
+    static char const *const gyro[] = { "timestamp", "player", "buttons", "yaw", "roll", "pitch" };
+    static column_type_t const gyro_t[] = { COL_U64, COL_U8, COL_U32, COL_F32, COL_F32, COL_F32 };
+    static char const *const conn[] = { "timestamp", "player", "connected" };
+    static column_type_t const conn_t[] = { COL_U64, COL_U8, COL_U8 };
+    static char const *const status[] = { "timestamp", "player", "battery", "battery_low", "extension", "leds" };
+    static column_type_t const status_t[] = { COL_U64, COL_U8, COL_F32, COL_U8, COL_U8, COL_U8 };
+    static char const *const gesture[] = { "timestamp", "player", "gesture", "confidence" };
+    static column_type_t const gesture_t[] = { COL_U64, COL_U8, COL_U32, COL_F32 };
+    static char const *const pointer[] = { "timestamp", "player", "visible", "x", "y", "distance", "roll" };
+    static column_type_t const pointer_t[] = { COL_U64, COL_U8, COL_U8, COL_F32, COL_F32, COL_F32, COL_F32 };
+
+    init_table(&gTables[TABLE_ACCEL], "accel", 6, accel, accel_t);
+    init_table(&gTables[TABLE_BUTTON], "button", 5, button, button_t);
+    init_table(&gTables[TABLE_NUNCHUK], "nunchuk", 8, nunchuk, nunchuk_t);
+    init_table(&gTables[TABLE_GYRO], "gyro", 6, gyro, gyro_t);
+    init_table(&gTables[TABLE_CONNECTION], "connection", 3, conn, conn_t);
+    init_table(&gTables[TABLE_STATUS], "status", 6, status, status_t);
+    init_table(&gTables[TABLE_GESTURE], "gesture", 4, gesture, gesture_t);
+    init_table(&gTables[TABLE_ACCEL_FILTERED], "accel_filtered", 6, accel, accel_t);
+    init_table(&gTables[TABLE_ACCEL_UNIFORM], "accel_uniform", 6, accel, accel_t);
+    init_table(&gTables[TABLE_POINTER], "pointer", 7, pointer, pointer_t);
+}
+
+static int make_dir(char const *path) {
+    if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "wmcol: can't create %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static int open_table(table_t *t, char const *dir) {
+    char path[PATH_MAX_SIZ];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, t->name);
+    if(!make_dir(path)) {
+        return 0;
+    }
+
+    for(int i = 0; i < t->num_columns; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s.bin", dir, t->name, t->cols[i].name);
+        t->cols[i].f = fopen(path, "wb");
+        if(t->cols[i].f == NULL) {
+            fprintf(stderr, "wmcol: can't create %s: %s\n", path, strerror(errno));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int is_delta_encoded(column_t const *c) {
+    return gDelta && c->type != COL_F32;
+}
+
+static void flush_column(column_t *c) {
+    fwrite(c->buf, 1, c->len, c->f);
+    c->len = 0;
+}
+
+static void put_bytes(column_t *c, void const *data, size_t len) {
+    if(c->len + len > COLUMN_BUFFER_SIZ) {
+        flush_column(c);
+    }
+    memcpy(c->buf + c->len, data, len);
+    c->len += len;
+}
+
+static void put_uint(column_t *c, uint64_t v) {
+    if(is_delta_encoded(c)) {
+        int64_t d = (int64_t)(v - c->prev);
+        uint64_t zz = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+        uint8_t out[10];
+        int n = 0;
+
+        c->prev = v;
+        do {
+            out[n] = zz & 0x7F;
+            zz >>= 7;
+            out[n] |= zz != 0 ? 0x80 : 0;
+            n++;
+        } while(zz != 0);
+
+        put_bytes(c, out, n);
+        return;
+    }
+
+    // Assumes a little-endian host, like the wmlog format itself
+    put_bytes(c, &v, gTypeSizes[c->type]);
+}
+
+static void put_f32(column_t *c, float v) {
+    put_bytes(c, &v, sizeof(v));
+}
+
+static void write_manifest(table_t const *t, char const *dir) {
+    char path[PATH_MAX_SIZ];
+    snprintf(path, sizeof(path), "%s/%s/columns.json", dir, t->name);
+
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        fprintf(stderr, "wmcol: can't create %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "{\n  \"rows\": %llu,\n  \"columns\": [\n", (unsigned long long)t->rows);
+    for(int i = 0; i < t->num_columns; i++) {
+        column_t const *c = &t->cols[i];
+        fprintf(f, "    { \"name\": \"%s\", \"file\": \"%s.bin\", \"type\": \"%s\", \"encoding\": \"%s\" }%s\n",
+                c->name, c->name, gTypeNames[c->type],
+                is_delta_encoded(c) ? "delta-zigzag-varint" : "plain",
+                i + 1 < t->num_columns ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+}
+
+static void close_table(table_t *t, char const *dir) {
+    for(int i = 0; i < t->num_columns; i++) {
+        if(t->cols[i].f != NULL) {
+            flush_column(&t->cols[i]);
+            fclose(t->cols[i].f);
+            t->cols[i].f = NULL;
+        }
+    }
+
+    write_manifest(t, dir);
+}
+
+// Button bitmask per player
+static uint32_t gButtons[MAX_PLAYERS];
+
+static void convert_record(wmlog_record_t const *r) {
+    table_t *t;
+    uint32_t *buttons = &gButtons[r->player];
+
+    switch(r->kind) {
+        case MI_EV_ACCEL:
+            t = &gTables[TABLE_ACCEL];
+            break;
+        case MI_EV_BUTTON:
+            if(r->button >= 32) {
+                return;
+            }
+            if(r->v[0] != 0) {
+                *buttons &= ~(1u << r->button);
+            } else {
+                *buttons |= 1u << r->button;
+            }
+            t = &gTables[TABLE_BUTTON];
+            break;
+        case MI_EV_NUNCHUK:
+            t = &gTables[TABLE_NUNCHUK];
+            break;
+        case MI_EV_GYRO:
+            t = &gTables[TABLE_GYRO];
+            break;
+        case MI_EV_CONNECTED:
+        case MI_EV_DISCONNECTED:
+            *buttons = 0;
+            t = &gTables[TABLE_CONNECTION];
+            break;
+        case MI_EV_STATUS:
+            t = &gTables[TABLE_STATUS];
+            break;
+        case MI_EV_GESTURE:
+            t = &gTables[TABLE_GESTURE];
+            break;
+        case MI_EV_ACCEL_FILTERED:
+            t = &gTables[TABLE_ACCEL_FILTERED];
+            break;
+        case MI_EV_ACCEL_UNIFORM:
+            t = &gTables[TABLE_ACCEL_UNIFORM];
+            break;
+        case MI_EV_POINTER:
+            t = &gTables[TABLE_POINTER];
+            break;
+        default:
+            return;
+    }
+
+    put_uint(&t->cols[0], r->timestamp);
+    put_uint(&t->cols[1], r->player);
+
+    switch(r->kind) {
+        case MI_EV_BUTTON:
+            put_uint(&t->cols[2], *buttons);
+            put_uint(&t->cols[3], r->button);
+            put_uint(&t->cols[4], r->v[0] != 0);
+            break;
+        case MI_EV_CONNECTED:
+        case MI_EV_DISCONNECTED:
+            put_uint(&t->cols[2], r->kind == MI_EV_CONNECTED);
+            break;
+        case MI_EV_STATUS:
+            put_f32(&t->cols[2], r->v[0]);
+            put_uint(&t->cols[3], r->v[1] != 0);
+            put_uint(&t->cols[4], r->v[2] != 0);
+            put_uint(&t->cols[5], r->button);
+            break;
+        case MI_EV_GESTURE:
+            put_uint(&t->cols[2], r->button);
+            put_f32(&t->cols[3], r->v[0]);
+            break;
+        case MI_EV_POINTER:
+            put_uint(&t->cols[2], r->button != 0);
+            for(int i = 3; i < t->num_columns; i++) {
+                put_f32(&t->cols[i], r->v[i - 3]);
+            }
+            break;
+        default:
+            // The remaining columns are the record's values in order
+            put_uint(&t->cols[2], *buttons);
+            for(int i = 3; i < t->num_columns; i++) {
+                put_f32(&t->cols[i], r->v[i - 3]);
+            }
+            break;
+    }
+
+    t->rows++;
+}
+
+static void usage(char const *pszArgv0) {
+    fprintf(stderr, "usage: %s [-z] INPUT OUTPUT_DIR\n", pszArgv0);
+    fprintf(stderr, "  INPUT  capture written by `wmlog -f bin`, or - for stdin\n");
+    fprintf(stderr, "  -z     delta and zig-zag varint encode integer columns\n");
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while((opt = getopt(argc, argv, "zh")) != -1) {
+        switch(opt) {
+            case 'z':
+                gDelta = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char const *pszInput = argv[optind];
+    char const *pszOutput = argv[optind + 1];
+
+    FILE *in = strcmp(pszInput, "-") == 0 ? stdin : fopen(pszInput, "rb");
+    if(in == NULL) {
+        fprintf(stderr, "wmcol: can't open %s: %s\n", pszInput, strerror(errno));
+        return 1;
+    }
+
+    wmlog_header_t hdr;
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+            memcmp(hdr.magic, WMLOG_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != WMLOG_VERSION ||
+            hdr.record_size < sizeof(wmlog_record_t)) {
+        fprintf(stderr, "wmcol: %s is not a wmlog capture\n", pszInput);
+        return 1;
+    }
+
+    init_tables();
+    if(!make_dir(pszOutput)) {
+        return 1;
+    }
+    for(int i = 0; i < NUM_TABLES; i++) {
+        if(!open_table(&gTables[i], pszOutput)) {
+            return 1;
+        }
+    }
+
+    // Records may be larger than ours if written by a newer version
+    size_t rec_siz = hdr.record_size;
+    uint8_t *chunk = (uint8_t *)malloc(rec_siz * READ_CHUNK_RECORDS);
+    if(chunk == NULL) {
+        return 1;
+    }
+
+    size_t n;
+    unsigned long long total = 0;
+    while((n = fread(chunk, rec_siz, READ_CHUNK_RECORDS, in)) > 0) {
+        for(size_t i = 0; i < n; i++) {
+            wmlog_record_t r;
+            memcpy(&r, chunk + i * rec_siz, sizeof(r));
+            convert_record(&r);
+        }
+        total += n;
+    }
+
+    free(chunk);
+    if(in != stdin) {
+        fclose(in);
+    }
+
+    for(int i = 0; i < NUM_TABLES; i++) {
+        close_table(&gTables[i], pszOutput);
+    }
+
+    fprintf(stderr, "wmcol: converted %llu records\n", total);
+
+    return 0;
+}
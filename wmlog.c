@@ -0,0 +1,355 @@
+//
+// Headless event logger
+//
+// Streams every event motion_poll returns to a file or stdout, as CSV or in
+// the binary format from wmlog.h. Events are collected into fixed-size
+// batches that a writer thread formats and writes, so a slow disk never
+// stalls polling. Memory use is bounded by NUM_BATCHES; events arriving
+// while every batch waits for the writer are counted and dropped.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <motion_input.h>
+
+#include "wmlog.h"
+
+#define BATCH_SIZ (4096)
+#define NUM_BATCHES (16)
+// Longest time an event waits in a partially filled batch, in milliseconds
+#define FLUSH_INTERVAL (100)
+#define OUTPUT_BUFFER_SIZ (1 << 20)
+
+typedef enum output_format {
+    FORMAT_CSV = 0,
+    FORMAT_BIN,
+} output_format_t;
+
+typedef struct batch {
+    int count;
+    wmlog_record_t rec[BATCH_SIZ];
+} batch_t;
+
+static batch_t gBatches[NUM_BATCHES];
+
+// Batches owned by neither side, and batches waiting for the writer in
+// submission order; both protected by gBatchLock
+static batch_t *gFreeBatches[NUM_BATCHES];
+static int gNumFree = 0;
+static batch_t *gFullBatches[NUM_BATCHES];
+static int gFullRd = 0, gNumFull = 0;
+static int gWriterStop = 0;
+static pthread_mutex_t gBatchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gBatchCond = PTHREAD_COND_INITIALIZER;
+
+static FILE *gOut = NULL;
+static output_format_t gFormat = FORMAT_CSV;
+static unsigned long long gWritten = 0;
+
+static volatile sig_atomic_t gStop = 0;
+
+static char const *gKindNames[MI_EV_MAX] = {
+    [MI_EV_NONE] = "none",
+    [MI_EV_CONNECTED] = "connected",
+    [MI_EV_DISCONNECTED] = "disconnected",
+    [MI_EV_BUTTON] = "button",
+    [MI_EV_ACCEL] = "accel",
+    [MI_EV_NUNCHUK] = "nunchuk",
+    [MI_EV_GYRO] = "gyro",
+    [MI_EV_STATUS] = "status",
+    [MI_EV_GESTURE] = "gesture",
+    [MI_EV_ACCEL_FILTERED] = "accel_filtered",
+    [MI_EV_ACCEL_UNIFORM] = "accel_uniform",
+    [MI_EV_POINTER] = "pointer",
+};
+
+static uint64_t now_millis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void on_signal(int sig) {
+    gStop = 1;
+}
+
+static void to_record(motion_event_t const *ev, wmlog_record_t *rec) {
+    memset(rec, 0, sizeof(*rec));
+    rec->timestamp = ev->timestamp;
+    rec->kind = (uint8_t)ev->kind;
+    rec->player = (uint8_t)ev->player;
+
+    switch(ev->kind) {
+        case MI_EV_BUTTON:
+            rec->button = (uint16_t)ev->btn.btn;
+            rec->v[0] = ev->btn.released ? 1 : 0;
+            break;
+        case MI_EV_ACCEL:
+        case MI_EV_ACCEL_FILTERED:
+        case MI_EV_ACCEL_UNIFORM:
+            rec->v[0] = ev->accel.x;
+            rec->v[1] = ev->accel.y;
+            rec->v[2] = ev->accel.z;
+            break;
+        case MI_EV_NUNCHUK:
+            rec->v[0] = ev->nunchuk.stick_x;
+            rec->v[1] = ev->nunchuk.stick_y;
+            rec->v[2] = ev->nunchuk.accel.x;
+            rec->v[3] = ev->nunchuk.accel.y;
+            rec->v[4] = ev->nunchuk.accel.z;
+            break;
+        case MI_EV_GYRO:
+            rec->v[0] = ev->gyro.yaw;
+            rec->v[1] = ev->gyro.roll;
+            rec->v[2] = ev->gyro.pitch;
+            break;
+        case MI_EV_STATUS:
+            rec->button = (uint16_t)ev->status.leds;
+            rec->v[0] = ev->status.battery;
+            rec->v[1] = ev->status.battery_low;
+            rec->v[2] = ev->status.extension_connected;
+            break;
+        case MI_EV_GESTURE:
+            rec->button = (uint16_t)ev->gesture.id;
+            rec->v[0] = ev->gesture.confidence;
+            break;
+        case MI_EV_POINTER:
+            rec->button = (uint16_t)ev->pointer.visible;
+            rec->v[0] = ev->pointer.x;
+            rec->v[1] = ev->pointer.y;
+            rec->v[2] = ev->pointer.distance;
+            rec->v[3] = ev->pointer.roll;
+            break;
+        default:
+            break;
+    }
+}
+
+static void write_batch(batch_t const *b) {
+    if(gFormat == FORMAT_BIN) {
+        fwrite(b->rec, sizeof(wmlog_record_t), b->count, gOut);
+    } else {
+        for(int i = 0; i < b->count; i++) {
+            wmlog_record_t const *r = &b->rec[i];
+            char const *kind = r->kind < MI_EV_MAX ? gKindNames[r->kind] : "unknown";
+            fprintf(gOut, "%llu,%u,%s,%u,%g,%g,%g,%g,%g\n",
+                    (unsigned long long)r->timestamp, r->player, kind, r->button,
+                    r->v[0], r->v[1], r->v[2], r->v[3], r->v[4]);
+        }
+    }
+
+    gWritten += b->count;
+}
+
+static void *writer_thread(void *user) {
+    pthread_mutex_lock(&gBatchLock);
+    for(;;) {
+        while(gNumFull == 0 && !gWriterStop) {
+            pthread_cond_wait(&gBatchCond, &gBatchLock);
+        }
+
+        if(gNumFull == 0) {
+            break;
+        }
+
+        batch_t *b = gFullBatches[gFullRd];
+        gFullRd = (gFullRd + 1) % NUM_BATCHES;
+        gNumFull--;
+        pthread_mutex_unlock(&gBatchLock);
+
+        write_batch(b);
+        b->count = 0;
+
+        pthread_mutex_lock(&gBatchLock);
+        gFreeBatches[gNumFree++] = b;
+    }
+    pthread_mutex_unlock(&gBatchLock);
+
+    fflush(gOut);
+    return NULL;
+}
+
+// Returns NULL if every batch is queued for writing
+static batch_t *take_batch() {
+    batch_t *b = NULL;
+
+    pthread_mutex_lock(&gBatchLock);
+    if(gNumFree > 0) {
+        b = gFreeBatches[--gNumFree];
+    }
+    pthread_mutex_unlock(&gBatchLock);
+
+    return b;
+}
+
+static void submit_batch(batch_t *b) {
+    pthread_mutex_lock(&gBatchLock);
+    gFullBatches[(gFullRd + gNumFull) % NUM_BATCHES] = b;
+    gNumFull++;
+    pthread_cond_signal(&gBatchCond);
+    pthread_mutex_unlock(&gBatchLock);
+}
+
+static void usage(char const *pszArgv0) {
+    fprintf(stderr, "usage: %s [-o FILE] [-f csv|bin] [-d SECONDS] [-i]\n", pszArgv0);
+    fprintf(stderr, "  -o FILE     write to FILE instead of stdout\n");
+    fprintf(stderr, "  -f FORMAT   csv (default) or bin, see wmlog.h\n");
+    fprintf(stderr, "  -d SECONDS  stop after SECONDS instead of on SIGINT/SIGTERM\n");
+    fprintf(stderr, "  -i          also log the IR pointer, turning the cameras on\n");
+}
+
+int main(int argc, char **argv) {
+    char const *pszOutput = NULL;
+    double duration = 0;
+    unsigned streams = MOTION_STREAM_BUTTONS | MOTION_STREAM_ACCEL | MOTION_STREAM_EXTENSION;
+    int opt;
+
+    while((opt = getopt(argc, argv, "o:f:d:ih")) != -1) {
+        switch(opt) {
+            case 'o':
+                pszOutput = optarg;
+                break;
+            case 'f':
+                if(strcmp(optarg, "csv") == 0) {
+                    gFormat = FORMAT_CSV;
+                } else if(strcmp(optarg, "bin") == 0) {
+                    gFormat = FORMAT_BIN;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'i':
+                streams |= MOTION_STREAM_IR;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(pszOutput == NULL || strcmp(pszOutput, "-") == 0) {
+        // The library reports progress on stdout; keep that out of the
+        // log by sending it to stderr and writing the log to the
+        // original stdout
+        int fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        gOut = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    } else {
+        gOut = fopen(pszOutput, "wb");
+    }
+
+    if(gOut == NULL) {
+        perror("wmlog: can't open the output");
+        return 1;
+    }
+    setvbuf(gOut, NULL, _IOFBF, OUTPUT_BUFFER_SIZ);
+
+    if(gFormat == FORMAT_BIN) {
+        wmlog_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, WMLOG_MAGIC, sizeof(hdr.magic));
+        hdr.version = WMLOG_VERSION;
+        hdr.record_size = sizeof(wmlog_record_t);
+        fwrite(&hdr, sizeof(hdr), 1, gOut);
+    } else {
+        fprintf(gOut, "timestamp,player,event,button,v0,v1,v2,v3,v4\n");
+    }
+
+    // No SA_RESTART, so a signal also ends motion_wait
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for(int i = 0; i < NUM_BATCHES; i++) {
+        gFreeBatches[gNumFree++] = &gBatches[i];
+    }
+
+    pthread_t hWriter;
+    if(pthread_create(&hWriter, NULL, writer_thread, NULL) != 0) {
+        fprintf(stderr, "wmlog: failed to start the writer thread\n");
+        return 1;
+    }
+
+    motion_input_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.flags = MOTION_INPUT_FLAG_HOTPLUG;
+    cfg.device_cache_path = "known_wiimotes.txt";
+    cfg.calibration_cache_path = "wiimote_calibration.txt";
+
+    motion_subscribe(streams);
+
+    if(motion_init(&cfg) != 0) {
+        fprintf(stderr, "wmlog: motion_init() failed\n");
+        return 1;
+    }
+
+    uint64_t end = duration > 0 ? now_millis() + (uint64_t)(duration * 1000) : UINT64_MAX;
+    unsigned long long dropped = 0;
+    batch_t *cur = NULL;
+    uint64_t cur_started = 0;
+
+    while(!gStop && now_millis() < end) {
+        motion_wait(FLUSH_INTERVAL);
+
+        motion_event_t ev;
+        while(motion_poll(&ev)) {
+            if(cur == NULL) {
+                cur = take_batch();
+                cur_started = now_millis();
+            }
+
+            if(cur == NULL) {
+                dropped++;
+                continue;
+            }
+
+            to_record(&ev, &cur->rec[cur->count++]);
+
+            if(cur->count == BATCH_SIZ) {
+                submit_batch(cur);
+                cur = NULL;
+            }
+        }
+
+        if(cur != NULL && cur->count > 0 && now_millis() - cur_started >= FLUSH_INTERVAL) {
+            submit_batch(cur);
+            cur = NULL;
+        }
+    }
+
+    if(cur != NULL && cur->count > 0) {
+        submit_batch(cur);
+    }
+
+    pthread_mutex_lock(&gBatchLock);
+    gWriterStop = 1;
+    pthread_cond_signal(&gBatchCond);
+    pthread_mutex_unlock(&gBatchLock);
+    pthread_join(hWriter, NULL);
+
+    motion_stats_t stats;
+    motion_get_stats(&stats, NULL, 0);
+
+    if(motion_shutdown() != 0) {
+        fprintf(stderr, "wmlog: motion_shutdown() failed\n");
+    }
+
+    fclose(gOut);
+
+    fprintf(stderr, "wmlog: %llu events written, %llu dropped by the writer, %llu by the library\n",
+            gWritten, dropped, stats.events_dropped);
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary log format written by `wmlog -f bin`: one wmlog_header_t, then
+// wmlog_record_t entries up to the end of the file, in host byte order.
+
+#define WMLOG_MAGIC "WMLOG\0\0\0"
+#define WMLOG_VERSION (1)
+
+typedef struct wmlog_header {
+    char magic[8];
+    uint32_t version;
+    // sizeof(wmlog_record_t), so readers can skip fields added later
+    uint32_t record_size;
+} wmlog_header_t;
+
+typedef struct wmlog_record {
+    // motion_event_t::timestamp
+    uint64_t timestamp;
+    // motion_event_kind_t
+    uint8_t kind;
+    uint8_t player;
+    // MI_EV_BUTTON: motion_button_t
+    // MI_EV_STATUS: LEDs lit
+    // MI_EV_GESTURE: template id
+    // MI_EV_POINTER: 1 if visible
+    uint16_t button;
+    // MI_EV_BUTTON: 1 if released
+    // MI_EV_ACCEL, MI_EV_ACCEL_FILTERED, MI_EV_ACCEL_UNIFORM: x, y, z
+    // MI_EV_NUNCHUK: stick x, stick y, accel x, y, z
+    // MI_EV_GYRO: yaw, roll, pitch
+    // MI_EV_STATUS: battery, 1 if low, 1 if an extension is connected
+    // MI_EV_GESTURE: confidence
+    // MI_EV_POINTER: x, y, distance, roll
+    float v[5];
+} wmlog_record_t;